@@ -29,6 +29,7 @@
 */
 
 #include <ctype.h>
+#include <stdarg.h>
 
 #include "mbed.h"
 #include "mbed_debug.h"
@@ -72,8 +73,30 @@
 #define DUMP_ARRAY(x,s) /* not used */
 #endif
 
+//
+// maximum response times from the Quectel BG96 AT manuals, used as the
+// ceiling of the learned timeouts, and the shortest timeout allowed
+//
+static const struct {
+    int ceiling;
+    int floor;
+} bg96_cmd_limits[BG96_CMD_COUNT] = {
+    { 150000, 5000 },       //BG96_CMD_QIACT
+    {  40000, 2000 },       //BG96_CMD_QIDEACT
+    { 150000, 5000 },       //BG96_CMD_QIOPEN
+    {  10000, 2000 },       //BG96_CMD_QICLOSE
+    {  60000, 5000 },       //BG96_CMD_QIDNSGIP
+    { 150000, 5000 },       //BG96_CMD_QSSLOPEN
+    {  10000, 2000 },       //BG96_CMD_QSSLCLOSE
+    {  75000, 5000 },       //BG96_CMD_QMTOPEN
+    {  45000, 5000 },       //BG96_CMD_QMTCONN
+    {  15000, 3000 },       //BG96_CMD_QMTSUB
+    {  60000, 5000 },       //BG96_CMD_QMTPUB
+    {   5000, 1000 },       //BG96_CMD_CPIN
+};
+
 char mqtt_payload[1548];
-char mqtt_topic[256];
+char mqtt_topic[257];
 MQTTMessage mqtt_msg;
 
 /** ----------------------------------------------------------
@@ -83,16 +106,68 @@ MQTTMessage mqtt_msg;
 */
 BG96::BG96(bool debug) :  
     _contextID(DEFAULT_PDP), 
+    _pdp_wanted(0),
     _serial(MBED_CONF_BG96_LIBRARY_BG96_TX, MBED_CONF_BG96_LIBRARY_BG96_RX), 
     _parser(&_serial),
-    _bg96_reset(MBED_CONF_BG96_LIBRARY_BG96_RESET),
-    _vbat_3v8_en(MBED_CONF_BG96_LIBRARY_BG96_WAKE),
-    _bg96_pwrkey(MBED_CONF_BG96_LIBRARY_BG96_PWRKEY)
+    _bg96_reset(MBED_CONF_BG96_LIBRARY_BG96_RESET, 0),          //pins start in their running state so a
+    _vbat_3v8_en(MBED_CONF_BG96_LIBRARY_BG96_WAKE, 1),          //BG96 left powered is not switched off
+    _bg96_pwrkey(MBED_CONF_BG96_LIBRARY_BG96_PWRKEY, 1),
+    _dns_head(0),
+    _dns_count(0),
+    _dns_ipleft(0),
+    _dns_waitip(false),
+    _dns_stale(0),
+    _dns_stale_until(0),
+    _ip_time(0),
+    _reg_time(0),
+    _rssi_time(0),
+    _reg_start(0),
+    _reg_latency(-1),
+    _reg_steered(false),
+    _query_cond(_query_mutex),
+    _warm(false),
+    _cme_error(0),
+    _wd_timeouts(0),
+    _wd_busy(false),
+    _boot_t0(0),
+    _boot_pending(0),
+    _boot_done(0),
+    _sslctx_used(0),
+    _ssl_session_cache(-1),
+    _ssl_rx(0),
+    _ssl_closed(0),
+    _mqtt_rxq_head(0),
+    _mqtt_rxq_count(0),
+    _cancel_mqtt(false),
+    _mqtt_waiting(0),
+    _dns_cancel(0)
 {
     _serial.set_baud(115200);
     _parser.debug_on(debug);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _parser.set_delimiter("\r\n");
+    _parser.oob("+QIURC: \"dnsgip\"", callback(this, &BG96::_dnsgip_urc));
+    _parser.oob("+QIURC: \"pdpdeact\"", callback(this, &BG96::_pdpdeact_urc));
+    _parser.oob("+CME ERROR:", callback(this, &BG96::_cme_error_urc));
+    _parser.oob("+QSSLURC:", callback(this, &BG96::_sslurc));
+    _parser.oob("+QMTRECV:", callback(this, &BG96::_qmtrecv_urc));
+    _parser.oob("+CEREG:", callback(this, &BG96::_cereg_urc));
+    _parser.oob("+CGREG:", callback(this, &BG96::_cgreg_urc));
+    _invalidate_cache();
+    memset(_query, 0x00, sizeof(_query));
+    memset(&_query_stats, 0x00, sizeof(_query_stats));
+    memset(_op_error, 0x00, sizeof(_op_error));
+    memset(&_wd_stats, 0x00, sizeof(_wd_stats));
+    memset(&_reg_stats, 0x00, sizeof(_reg_stats));
+    memset(_cmd_count, 0x00, sizeof(_cmd_count));
+    memset(_cmd_next, 0x00, sizeof(_cmd_next));
+    for( int i=0; i<BG96_SOCKET_MAX; i++ ) {
+        _cancel_open[i] = false;
+        _close_req[i] = false;
+        _sock_state[i] = BG96_SOCK_FREE;
+        }
+    memset(_boot_cred, 0x00, sizeof(_boot_cred));
+    _boot_reset(0);
 }
 
 BG96::~BG96(void)
@@ -108,7 +183,7 @@ void BG96::powerDown(void)
 }
 
 /** ----------------------------------------------------------
-* @brief  get BG96 SW version
+* @brief  get BG96 SW version, only read from the BG96 once
 * @param  none
 * @retval string containing SW version
 */
@@ -117,13 +192,25 @@ const char* BG96::getRev(char* combined)
     bool        ok=false;
     char        buf1[20], buf2[20];
 
+    _cache_mutex.lock();
+    ok = _cache.revision[0] != 0;
+    if( ok )
+        strcpy(combined, _cache.revision);
+    _cache_mutex.unlock();
+    if( ok )
+        return (const char*) combined;
+
     _bg96_mutex.lock();
     ok = (tx2bg96((char*)"AT+CGMM") && _parser.recv("%s\n",buf1) && _parser.recv("OK") &&
           _parser.send("AT+CGMR") && _parser.recv("%s\n",buf2) && _parser.recv("OK")    );
     _bg96_mutex.unlock();
 
-    if( ok ) 
+    if( ok ) {
         sprintf(combined,"%s Rev:%s",buf1,buf2);
+        _cache_mutex.lock();
+        strncpy(_cache.revision, combined, sizeof(_cache.revision)-1);
+        _cache_mutex.unlock();
+        }
     return ok? (const char*) combined : NULL;
 }
 
@@ -145,14 +232,16 @@ void BG96::doDebug(int f)
 bool BG96::tx2bg96(char* cmd) {
     bool ok=false;
     _bg96_mutex.lock();
-    ok=_parser.send(cmd) && _parser.recv("OK");
+    _cme_error = 0;
+    ok=_parser.send(cmd) && _recv_final();
+    _wd_check(ok);
     _bg96_mutex.unlock();
     return ok;
 }
 
 /** ----------------------------------------------------------
 * @brief  set the contextID for the BG96. This context will
-*         be used for all subsequent operations
+*         be used by all operations not given a context id
 * @param  int of desired context. if <1, return the current context
 * @retval current context
 */
@@ -171,8 +260,9 @@ int BG96::setContext( int i )
 }
 
 /** ----------------------------------------------------------
-* @brief  Configure the context for the BG96. This context will
-*         be used for all subsequent operations
+* @brief  Configure the APN of a context. The current context is
+*         not changed, the context is used by passing its id to
+*         connect(), open(), resolveUrl() or sslopen()
 * @param  BG96_PDP_Ctx PDP Configuration
 * @retval Context id if success | -1 if error
 */
@@ -182,8 +272,7 @@ int BG96::setContext( int i )
 int BG96::configure_pdp_context(BG96_PDP_Ctx * pdp_ctx)
 {
     int rc=-1;
-    if (pdp_ctx == NULL) return -1;
-    setContext(pdp_ctx->pdp_id);
+    if (pdp_ctx == NULL || pdp_ctx->pdp_id < 1 || pdp_ctx->pdp_id > 16) return -1;
     _bg96_mutex.lock();
     if (_parser.send("AT+QICSGP=%d,1,\"%s\",\"%s\",\"%s\"", pdp_ctx->pdp_id,
                                             pdp_ctx->apn, pdp_ctx->username, pdp_ctx->password) && _parser.recv("OK")) rc = pdp_ctx->pdp_id; //pdp_ctx->username, pdp_ctx->password)
@@ -198,6 +287,7 @@ int BG96::configure_pdp_context(BG96_PDP_Ctx * pdp_ctx)
 */
 void BG96::reset(void)
 {
+    _invalidate_cache();
     _bg96_reset = 0;
     _bg96_pwrkey = 0;
     _vbat_3v8_en = 0;
@@ -235,8 +325,12 @@ int BG96::getSIMStatus()
 {
     int done;
     _bg96_mutex.lock();
-    _parser.set_timeout(20000);
-    done = _parser.send("AT+CPIN?") && _parser.recv("OK");
+    uint64_t start = Kernel::get_ms_count();
+    _parser.set_timeout(_cmd_timeout(BG96_CMD_CPIN));
+    _cme_error = 0;
+    done = _parser.send("AT+CPIN?") && _recv_final();
+    if (done) _cmd_latency(BG96_CMD_CPIN, start);
+    else if (_cme_error == 0) _cmd_expired(BG96_CMD_CPIN);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return done;
@@ -255,160 +349,658 @@ int BG96::getCSServiceStatus()
     return done;
 }
 /** ----------------------------------------------------------
-* @brief  startup BG96 module
+* @brief  check if the BG96 is already running
+* @param  none
+* @retval true if it answered AT, false otherwise
+*/
+bool BG96::_probe(void)
+{
+    bool ok=false;
+
+    _bg96_mutex.lock();
+    _parser.set_timeout(BG96_PROBE_TO);
+    for( int i=0; i<BG96_PROBE_TRIES && !ok; i++ )
+        ok = _parser.send("AT") && _parser.recv("OK");     //no flush, buffered URCs and data are kept
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    _bg96_mutex.unlock();
+    return ok;
+}
+
+/** ----------------------------------------------------------
+* @brief  startup BG96 module. A BG96 that still answers AT
+*         is kept running so its registration and PDP context
+*         can be reused, otherwise it is reset.
 * @param  none
 * @retval true if successful, false otherwise
 */
 bool BG96::startup(void)
 {
-   int   done=false;
-
-   if( !BG96Ready() )
+    _bg96_mutex.lock();
+    _boot_t0 = Kernel::get_ms_count();
+    _boot_reset(0);
+    _boot_begin(BG96_BOOT_READY);
+    _warm = _probe();
+    if( _warm )
+        debug("BG96: warm start, keeping the running modem\r\n");
+    else if( !BG96Ready() ) {
+        _boot_end(BG96_BOOT_READY, false);
+        _bg96_mutex.unlock();
 		return false;
- 
-    done = configureGNSS();
+        }
+    _boot_end(BG96_BOOT_READY, true);
+
+    bool done = _init(_warm);
+    _bg96_mutex.unlock();
     return done;
  }
 
+/** ----------------------------------------------------------
+* @brief  apply the driver settings to a BG96 that answers AT.
+*         The GNSS settings are left pending, they are written
+*         while connect() waits for registration or before GNSS
+*         is used.
+* @param  true if the BG96 was kept running, its GNSS is then
+*         left as it is when it is on
+* @retval true if successful, false otherwise
+*/
+bool BG96::_init(bool warm)
+{
+    _boot_begin(BG96_BOOT_CONFIG);
+
+    // report +CME ERROR: <n> in place of ERROR so failures carry their cause
+    bool done = tx2bg96((char*)"AT+CMEE=1");
+
+    BG96_RADIO_CFG radio;
+    snprintf(radio.nwscanseq, sizeof(radio.nwscanseq), "%s", MBED_CONF_BG96_LIBRARY_BG96_NWSCANSEQ);
+    radio.nwscanmode = MBED_CONF_BG96_LIBRARY_BG96_NWSCANMODE;
+    radio.iotopmode = MBED_CONF_BG96_LIBRARY_BG96_IOTOPMODE;
+    snprintf(radio.band_gsm, sizeof(radio.band_gsm), "%s", MBED_CONF_BG96_LIBRARY_BG96_BAND_GSM);
+    snprintf(radio.band_catm1, sizeof(radio.band_catm1), "%s", MBED_CONF_BG96_LIBRARY_BG96_BAND_CATM1);
+    snprintf(radio.band_nb1, sizeof(radio.band_nb1), "%s", MBED_CONF_BG96_LIBRARY_BG96_BAND_NB1);
+    setRadioConfig(radio);
+    _boot_end(BG96_BOOT_CONFIG, done);
+
+    if( !(warm && isGNSSOn() > 0) )     //a running GNSS keeps the configuration it was started with
+        _boot_pending |= 1u << BG96_BOOT_GNSS;
+    return done;
+}
+
+//steps that must have ended before each step can start
+static const uint32_t bg96_boot_deps[BG96_BOOT_COUNT] = {
+    0,                                                          //READY
+    1u << BG96_BOOT_READY,                                      //CONFIG
+    1u << BG96_BOOT_CONFIG,                                     //REG_START
+    1u << BG96_BOOT_CONFIG,                                     //SIM
+    1u << BG96_BOOT_CONFIG,                                     //APN
+    1u << BG96_BOOT_SIM,                                        //IDENTITY, the ICCID is read from the SIM
+    1u << BG96_BOOT_CONFIG,                                     //GNSS
+    1u << BG96_BOOT_REG_START,                                  //REGISTERED
+    (1u << BG96_BOOT_REGISTERED) | (1u << BG96_BOOT_APN),       //PDP
+};
+
+static const char *bg96_boot_names[BG96_BOOT_COUNT] = {
+    "ready", "config", "reg start", "sim", "apn", "identity", "gnss", "registered", "pdp"
+};
+
+/** ----------------------------------------------------------
+* @brief  clear the timeline from a step on. The driver mutex
+*         must be held.
+* @param  first step to clear
+* @retval none
+*/
+void BG96::_boot_reset(int from)
+{
+    for( int s=from; s<BG96_BOOT_COUNT; s++ ) {
+        _boot_tl.start[s] = _boot_tl.end[s] = -1;
+        _boot_tl.ok[s] = false;
+        _boot_done &= ~(1u << s);
+        if( s != BG96_BOOT_GNSS )
+            _boot_pending &= ~(1u << s);
+        }
+}
+
+/** ----------------------------------------------------------
+* @brief  record the start and the end of a startup step. The
+*         driver mutex must be held.
+* @param  the step
+* @param  result of the step
+* @retval none
+*/
+void BG96::_boot_begin(BG96_BOOT_STEP step)
+{
+    _boot_tl.start[step] = (int32_t)(Kernel::get_ms_count() - _boot_t0);
+}
+
+void BG96::_boot_end(BG96_BOOT_STEP step, bool ok)
+{
+    _boot_tl.end[step] = (int32_t)(Kernel::get_ms_count() - _boot_t0);
+    _boot_tl.ok[step] = ok;
+    _boot_done |= 1u << step;
+    debug("BG96: boot %s %s at %d ms (%d ms)\r\n", bg96_boot_names[step], ok? "done":"failed", 
+          (int)_boot_tl.end[step], (int)(_boot_tl.end[step] - _boot_tl.start[step]));
+}
+
+/** ----------------------------------------------------------
+* @brief  run a step that does not wait on the network. The
+*         driver mutex must be held.
+* @param  the step
+* @retval true if successful, false otherwise
+*/
+bool BG96::_boot_step(BG96_BOOT_STEP step)
+{
+    char buf[24];
+
+    switch( step ) {
+        case BG96_BOOT_SIM:
+            return getSIMStatus();
+        case BG96_BOOT_APN:
+            return _set_apn(_boot_cred[0], _boot_cred[1], _boot_cred[2]);
+        case BG96_BOOT_IDENTITY:
+            return getMACAddress(buf) != NULL && getIMEI(buf) != NULL;
+        case BG96_BOOT_GNSS:
+            return configureGNSS();
+        default:
+            return false;
+        }
+}
+
+/** ----------------------------------------------------------
+* @brief  run the first pending step whose dependencies have
+*         ended. The driver mutex must be held.
+* @param  none
+* @retval true if a step was run
+*/
+bool BG96::_boot_run_next(void)
+{
+    for( int s=0; s<BG96_BOOT_COUNT; s++ ) {
+        BG96_BOOT_STEP step = (BG96_BOOT_STEP)s;
+        if( !(_boot_pending & (1u << s)) || (bg96_boot_deps[s] & ~_boot_done) )
+            continue;
+        _boot_pending &= ~(1u << s);
+        _boot_begin(step);
+        _boot_end(step, _boot_step(step));
+        return true;
+        }
+    return false;
+}
+
+/** ----------------------------------------------------------
+* @brief  run the pending steps that can still run. The driver
+*         mutex must be held.
+* @param  none
+* @retval true if none of them failed
+*/
+bool BG96::_boot_finish(void)
+{
+    bool ok = true;
+    uint32_t ran = _boot_pending;
+
+    while( _boot_run_next() )
+        ;
+    for( int s=0; s<BG96_BOOT_COUNT; s++ )
+        if( (ran & ~_boot_pending & (1u << s)) && !_boot_tl.ok[s] )
+            ok = false;
+    return ok;
+}
+
+/** ----------------------------------------------------------
+* @brief  copy the timeline of the last startup
+* @param  structure to receive the timeline
+* @retval none
+*/
+void BG96::getStartupTimeline(BG96_BOOT_TIMELINE &tl)
+{
+    _bg96_mutex.lock();
+    tl = _boot_tl;
+    _bg96_mutex.unlock();
+}
+
+const char *BG96::bootStepName(BG96_BOOT_STEP step)
+{
+    return (step >= 0 && step < BG96_BOOT_COUNT)? bg96_boot_names[step] : "";
+}
+
+/** ----------------------------------------------------------
+* @brief  watchdog check after a command. A command that failed
+*         without an error reply (+CME ERROR, or ERROR read by
+*         _recv_final()) may not have been answered at all:
+*         the channel is resynchronised with AT and, when the BG96
+*         stays silent for MBED_CONF_BG96_LIBRARY_BG96_WD_TIMEOUTS
+*         commands in a row, it is restarted. The driver mutex must
+*         be held.
+* @param  true if the command succeeded
+* @retval none
+*/
+void BG96::_wd_check(bool ok)
+{
+    if( ok || _cme_error != 0 ) {
+        _wd_timeouts = 0;
+        return;
+        }
+    if( MBED_CONF_BG96_LIBRARY_BG96_WD_TIMEOUTS <= 0 || _wd_busy )
+        return;
+
+    _wd_stats.timeouts++;
+    if( _probe() ) {
+        _wd_stats.resyncs++;
+        _wd_timeouts = 0;
+        return;
+        }
+    if( ++_wd_timeouts < MBED_CONF_BG96_LIBRARY_BG96_WD_TIMEOUTS )
+        return;
+
+    _wd_restart();
+    _wd_timeouts = 0;
+}
+
+/** ----------------------------------------------------------
+* @brief  restart a BG96 that stopped answering, with AT+CFUN=1,1
+*         first and the reset pin if that does not work. The driver
+*         settings are applied again and the link callback is told
+*         so contexts and sockets can be restored. The driver mutex
+*         must be held.
+* @param  none
+* @retval true if the BG96 answers again
+*/
+bool BG96::_wd_restart(void)
+{
+    uint64_t start = Kernel::get_ms_count();
+    Timer    t;
+    bool     ok=false;
+
+    _wd_busy = true;
+    debug("BG96: not answering, restarting it\r\n");
+    _invalidate_cache();
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    _parser.flush();
+    if( _parser.send("AT+CFUN=1,1") ) {
+        t.start();
+        while( !ok && t.read_ms() < BG96_WAIT4READY )
+            ok = _parser.recv("RDY");
+        ok = ok && _probe();
+        }
+    if( ok )
+        _wd_stats.soft_resets++;
+    else {
+        _wd_stats.hard_resets++;
+        ok = BG96Ready() && _probe();
+        }
+
+    if( ok ) {
+        _parser.set_timeout(2000);
+        tx2bg96((char*)"ATE0");
+        tx2bg96((char*)"AT+CEREG=1;+CGREG=1");
+        _parser.set_timeout(BG96_AT_TIMEOUT);
+        _init(false);
+        _boot_finish();
+        }
+    else
+        _wd_stats.failed++;
+
+    _wd_stats.last_ms = (uint32_t)(Kernel::get_ms_count() - start);
+    _wd_stats.total_ms += _wd_stats.last_ms;
+    if( _wd_stats.last_ms > _wd_stats.max_ms )
+        _wd_stats.max_ms = _wd_stats.last_ms;
+    _wd_busy = false;
+    debug("BG96: restart %s after %d ms\r\n", ok? "done" : "failed", (int)_wd_stats.last_ms);
+
+    if( ok && _link_cb )
+        _link_cb(BG96_LINK_RESET, 0);
+    return ok;
+}
+
+/** ----------------------------------------------------------
+* @brief  copy the watchdog counters
+* @param  structure to receive the counters
+* @retval none
+*/
+void BG96::getWatchdogStats(BG96_WD_STATS &stats)
+{
+    _bg96_mutex.lock();
+    stats = _wd_stats;
+    _bg96_mutex.unlock();
+}
+
 
 /** ----------------------------------------------------------
-* @brief  connect to APN
+* @brief  connect to APN. Registration is started first, the
+*         SIM check, identity reads, APN and GNSS settings run
+*         while the BG96 registers.
 * @param  apn string 
 * @param  username (not used)
 * @param  password (not used)
-* @retval nsapi_error_t
+* @retval nsapi_error_t, NSAPI_ERROR_AUTH_FAILURE if the network
+*         denied the registration
 */
 nsapi_error_t BG96::connect(const char *apn, const char *username, const char *password)
 {
-    int i = 255;
-    bool registered= false;
-    bool registration = false;
-    int reg_en;
-    int stat;
-    int techno = 2; //0->Cat.M1, 1->Cat.NB1, 2->GSM
-    char pin_status[15];
+    Timer t;
     int done = -1;
-    int type, auth;
-    char lapn[40];
-    char lusername[20];
-    char lpassword[20];
+    int stat = -1;
     
 	_bg96_mutex.lock();
+    if( _boot_t0 == 0 )
+        _boot_t0 = Kernel::get_ms_count();
+    _boot_reset(BG96_BOOT_REG_START);
+    _boot_cred[0] = apn;
+    _boot_cred[1] = username;
+    _boot_cred[2] = password;
+    _boot_pending |= (1u << BG96_BOOT_SIM) | (1u << BG96_BOOT_APN) | (1u << BG96_BOOT_IDENTITY);
+
 	_parser.set_timeout(2000);//BG96_1s_WAIT
-    while (!registered && techno < 3) {
-	   if( tx2bg96((char*)"ATE0") ) {
-            tx2bg96((char*)"AT+CGREG=0"); //Disable network registration and location information URC
-            while (i >0 && !registration) {
-                if (_parser.send("AT+CGREG?")) {
-                    done = _parser.recv("+CGREG: %d, %d", &reg_en, &stat);
-                    if (done) {
-                        switch (stat) {
-                        case 0:
-                            debug("BG96: The modem is yet unregistered.\r\n");
-                            break;
-                        case 1:
-                            debug("BG96: The modem is successfully registered.\r\n");
-                            registration = true;
-                            break;
-                        case 2:
-                            debug("BG96: The modem is trying to register.\r\n");
-                            break;
-                        case 3:
-                            debug("BG96: The modem registration has been denied.\r\n");
-                            break;
-                        case 4:
-                            debug("BG96: Registration status unknown.\r\n");
-                            break;
-                        case 5:
-                            debug("BG96: The modem is registered in roaming mode.\r\n");
-                            registration = true;
-                            break;
-                        default:
-                            break;
-                        }
-                    }
-                }
-                wait(0.5);
-                i--;
+    _boot_begin(BG96_BOOT_REG_START);
+    if( tx2bg96((char*)"ATE0") ) {
+        // registration changes are reported by +CEREG (Cat.M1/NB1) and +CGREG (GSM) URCs,
+        // the queries seed the current state in case the BG96 is already registered
+        _cache_mutex.lock();
+        _reg_start = Kernel::get_ms_count();
+        _cache_mutex.unlock();
+        tx2bg96((char*)"AT+CEREG=1;+CGREG=1");
+        tx2bg96((char*)"AT+CEREG?;+CGREG?");
+        t.start();
+        _cache_mutex.lock();
+        stat = _cache.reg_status;
+        _cache_mutex.unlock();
+        _reg_steered = false;
+        _boot_end(BG96_BOOT_REG_START, true);
+        _boot_begin(BG96_BOOT_REGISTERED);
+#if MBED_CONF_BG96_LIBRARY_BG96_STEER_ATTACH
+        BG96_NET_HINT hint;
+        bool steer = stat != 1 && stat != 5 && getLastNetwork(hint);
+        if( steer ) {
+            // AT+COPS only answers once the BG96 registered, so the other steps run first
+            while( _boot_run_next() )
+                ;
+            _parser.set_timeout(2000);
+            process_urc();
+            _cache_mutex.lock();
+            stat = _cache.reg_status;
+            _cache_mutex.unlock();
             }
-            if (registration){
-                int mode, format, techno;
-                char telco[15];
-                if (_parser.send("AT+COPS?")) {
-                    done = _parser.recv("+COPS: %d, %d, \"%[^\"]\", %d", &mode, &format, telco, &techno);
-                    if (done) {
-                        debug("Operator is %s\r\n", telco);
-                        switch (techno){
-                        case 0:
-                        case 3:
-                            debug("Technology is GSM\r\n");
-                            break;
-                        case 8:
-                        case 4:
-                            debug("Technology is LTE Cat.M1\r\n");
-                            break;
-                        case 9:
-                        case 5:
-                            debug("Technology is LTE Cat.NB1\r\n");
-                            break;
-                        default:
-                            break;
-                        }
-                    }
-                }
-                tx2bg96((char*)"AT+CTZU=1"); // Automatic Time Zone Update
-                done = true;
-                registered = true;
-            } else {
-                registered = false;
-                done = false;
+        if( steer && stat != 1 && stat != 5 && t.read_ms() < BG96_REG_TO ) {
+            // mode 4: try the saved network first, fall back to automatic selection if it fails
+            debug("BG96: steering attach to %s (AcT %d), last seen on %s, %s\r\n", hint.plmn, hint.act, hint.band, hint.cell);
+            _parser.set_timeout(BG96_REG_TO - t.read_ms());
+            _reg_steered = _parser.send("AT+COPS=4,2,\"%s\",%d", hint.plmn, hint.act) && _recv_final();
+            if( !_reg_steered )
+                _reg_stats.steer_failed++;
+            _parser.set_timeout(2000);
+            _cache_mutex.lock();
+            stat = _cache.reg_status;
+            _cache_mutex.unlock();
+            }
+#endif
+
+        // the steps that do not need the network fill the registration wait, a denial in
+        // every domain (stat 3 with none searching, see _reg_urc) ends it
+        while( stat != 1 && stat != 3 && stat != 5 && t.read_ms() < BG96_REG_TO ) {
+            if( _boot_run_next() )
+                _parser.set_timeout(2000);
+            else
+                wait_ms(BG96_URC_POLL);
+            process_urc();
+            _cache_mutex.lock();
+            stat = _cache.reg_status;
+            _cache_mutex.unlock();
             }
-       }
-       techno++;
-	}
-	if (done) {
-        debug("Checking APN ...\r\n");
-        _parser.set_timeout(5000);
-        if(_parser.send("AT+QICSGP=%d",_contextID)) {
-            done = _parser.recv("+QICSGP: %d,\"%[^\"]\",\"%[^\"]\",\"%[^\"]\",%d\r\n", &type, lapn, lusername, lpassword, &auth);
+        switch (stat) {
+        case 1:
+            debug("BG96: The modem is successfully registered in %d ms%s.\r\n", getRegistrationLatency(),
+                                                                       _reg_steered? " (steered)":"");
+            break;
+        case 3:
+            debug("BG96: The modem registration has been denied.\r\n");
+            break;
+        case 5:
+            debug("BG96: The modem is registered in roaming mode in %d ms%s.\r\n", getRegistrationLatency(),
+                                                                               _reg_steered? " (steered)":"");
+            break;
+        default:
+            debug("BG96: The modem failed to register (%d).\r\n", stat);
+            break;
+        }
+        if (stat == 1 || stat == 5){
+            int latency = getRegistrationLatency();
+            if( _reg_steered ) {
+                // the manual selection stays in force, go back to automatic for later losses
+                _parser.set_timeout(BG96_REG_TO);
+                if( !(_parser.send("AT+COPS=0") && _recv_final()) )
+                    debug("BG96: automatic network selection not restored\r\n");
+                _parser.set_timeout(2000);
+                _reg_stats.steered++;
+                _reg_stats.steered_ms += (latency > 0)? latency : 0;
+                }
+            else {
+                _reg_stats.unsteered++;
+                _reg_stats.unsteered_ms += (latency > 0)? latency : 0;
+                }
+            _save_net_hint();
+            tx2bg96((char*)"AT+CTZU=1"); // Automatic Time Zone Update
+            done = true;
+        } else {
+            done = false;
+        }
+        _boot_end(BG96_BOOT_REGISTERED, done);
+    }
+    else
+        _boot_end(BG96_BOOT_REG_START, false);
+
+    // registration may have been quicker than the other steps
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    if( done )
+        _boot_finish();
+    _boot_cred[0] = _boot_cred[1] = _boot_cred[2] = NULL;
+    _boot_pending &= ~((1u << BG96_BOOT_SIM) | (1u << BG96_BOOT_APN) | (1u << BG96_BOOT_IDENTITY));
+    if( stat == 3 ) {                       //the network refused the SIM, activating a context cannot work
+        _bg96_mutex.unlock();
+        return NSAPI_ERROR_AUTH_FAILURE;
         }
-        if (done) _parser.recv("OK");
+    if( done && !_boot_tl.ok[BG96_BOOT_APN] ) {
+        _bg96_mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+        }
+
+	//activate PDP context 1 ...	
+    _boot_begin(BG96_BOOT_PDP);
+    _bg96_mutex.unlock();
+    nsapi_error_t rc = connect(_contextID);
+    _bg96_mutex.lock();
+    _boot_end(BG96_BOOT_PDP, rc == NSAPI_ERROR_OK);
+    _bg96_mutex.unlock();
+    return rc;
+}
+
+/** ----------------------------------------------------------
+* @brief  check the APN of the default context and store it
+*         if none is set. The driver mutex must be held.
+* @param  apn string 
+* @param  username
+* @param  password
+* @retval true if successful, false otherwise
+*/
+bool BG96::_set_apn(const char *apn, const char *username, const char *password)
+{
+    int  type, auth;
+    char lapn[40];
+    char lusername[20];
+    char lpassword[20];
+    bool done=false;
+
+    debug("Checking APN ...\r\n");
+    _parser.set_timeout(5000);
+    if(_parser.send("AT+QICSGP=%d",_contextID)) {
+        done = _parser.recv("+QICSGP: %d,\"%[^\"]\",\"%[^\"]\",\"%[^\"]\",%d\r\n", &type, lapn, lusername, lpassword, &auth);
+    }
+    if (done) _parser.recv("OK");
+
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    if (!done){
+        //few delay to purge serial ...
+        wait(1);
+        debug("Storing APN %s ...\r\n", apn);
+        //program APN and connection parameter only for PDP context 1, authentication NONE
+        //TODO: add program for other context
+        done = _parser.send("AT+QICSGP=%d,1,\"%s\",\"%s\",\"%s\",0", _contextID, &apn[0], &username[0], &password[0])
+               && _parser.recv("OK");
+    }
+    return done;
+}
+
+/** ----------------------------------------------------------
+* @brief  read the network saved after the last registration
+* @param  structure receiving the network
+* @retval true if a network was saved
+*/
+bool BG96::getLastNetwork(BG96_NET_HINT &hint)
+{
+    char    buf[128];
+    size_t  fsize=0;
+    int16_t checksum;
+    bool    done;
 
+    memset(&hint, 0x00, sizeof(hint));
+    _bg96_mutex.lock();
+    done = fs_file_size(BG96_NET_HINT_FILE, fsize) == NSAPI_ERROR_OK && fsize > 0 && fsize < sizeof(buf) &&
+           fs_download_file(BG96_NET_HINT_FILE, buf, fsize, checksum) == NSAPI_ERROR_OK;
+    _bg96_mutex.unlock();
+    if( !done )
+        return false;
+    buf[fsize] = 0x00;
+    return sscanf(buf, "%7[^\n]\n%d\n%23[^\n]\n%63[^\n]", hint.plmn, &hint.act, hint.band, hint.cell) >= 2;
+}
+
+/** ----------------------------------------------------------
+* @brief  read the network the BG96 registered on (PLMN, access
+*         technology, band and serving cell) and save it to UFS
+*         when it changed, so the next attach can be steered to it
+* @param  none
+* @retval none
+*/
+void BG96::_save_net_hint(void)
+{
+    BG96_NET_HINT cur, last;
+    char          buf[128];
+    int           mode, format;
+
+    memset(&cur, 0x00, sizeof(cur));
+    _bg96_mutex.lock();
+    _parser.set_timeout(2000);
+    if( !(tx2bg96((char*)"AT+COPS=3,2") &&
+          _parser.send("AT+COPS?") &&
+          _parser.recv("+COPS: %d,%d,\"%7[^\"]\",%d", &mode, &format, cur.plmn, &cur.act) &&
+          _parser.recv("OK")) ) {
         _parser.set_timeout(BG96_AT_TIMEOUT);
-        if (!done){
-            //few delay to purge serial ...
-            wait(1);
-            debug("Storing APN %s ...\r\n", apn);
-            //program APN and connection parameter only for PDP context 1, authentication NONE
-            //TODO: add program for other context
-            if (!(_parser.send("AT+QICSGP=%d,1,\"%s\",\"%s\",\"%s\",0", _contextID, &apn[0], &username[0], &password[0])
-            && _parser.recv("OK"))) 
-            {
-                return NSAPI_ERROR_DEVICE_ERROR;
-            }
+        _bg96_mutex.unlock();
+        return;
         }
+    debug("Operator is %s\r\n", cur.plmn);
+    switch (cur.act){
+    case 0:
+    case 3:
+        debug("Technology is GSM\r\n");
+        break;
+    case 8:
+    case 4:
+        debug("Technology is LTE Cat.M1\r\n");
+        break;
+    case 9:
+    case 5:
+        debug("Technology is LTE Cat.NB1\r\n");
+        break;
+    default:
+        break;
     }
-    wait(1);
+    if( _parser.send("AT+QNWINFO") )
+        _parser.recv("+QNWINFO: \"%*[^\"]\",\"%*[^\"]\",\"%23[^\"]\"", cur.band) && _parser.recv("OK");
+    if( _parser.send("AT+QENG=\"servingcell\"") )
+        _parser.recv("+QENG: \"servingcell\",%63[^\n]\n", cur.cell) && _parser.recv("OK");
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+
+    if( !getLastNetwork(last) || strcmp(last.plmn, cur.plmn) || last.act != cur.act || strcmp(last.band, cur.band) ) {
+        snprintf(buf, sizeof(buf), "%s\n%d\n%s\n%s\n", cur.plmn, cur.act, cur.band, cur.cell);
+        if( !send_file(buf, BG96_NET_HINT_FILE, true) )
+            debug("BG96: Error saving the last network\r\n");
+        }
     _bg96_mutex.unlock();
+}
 
-	//activate PDP context 1 ...	
-    return connect(_contextID);
+/** ----------------------------------------------------------
+* @brief  check if a PDP context is active
+* @param  context id
+* @retval true if the context is listed as activated by AT+QIACT?
+*/
+bool BG96::_pdp_active(int cid)
+{
+    char resp[64];
+    int  id, state;
+    bool active=false;
+
+    _bg96_mutex.lock();
+    _parser.set_timeout(15000);
+    if( _parser.send("AT+QIACT?") ) {
+        while( _parser.recv("%63[^\n]\n", resp) && strcmp(resp, "OK") && strcmp(resp, "ERROR") ) {
+            if( sscanf(resp, "+QIACT: %d,%d", &id, &state) == 2 && id == cid && state == 1 )
+                active = true;
+            }
+        }
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    _bg96_mutex.unlock();
+    return active;
+}
+
+/** ----------------------------------------------------------
+* @brief  check if a PDP context is active
+* @param  context id, <1 for the current context
+* @retval true if the context is activated
+*/
+bool BG96::isContextActive(int pdp_id)
+{
+    return _pdp_active(_pdp_id(pdp_id));
 }
 
-nsapi_error_t BG96::connect(int pdp_id)
+/** ----------------------------------------------------------
+* @brief  activate a PDP context. Other active contexts are left
+*         as they are, a context that is already active is reused
+* @param  context id, <1 for the current context
+* @param  once: single AT+QIACT attempt, used from the event queue
+* @retval nsapi_error_t
+*/
+nsapi_error_t BG96::connect(int pdp_id, bool once)
 {
     Timer timer_s;
     char cmd[100];
-    debug("PDP activating ...\r\n");
-    sprintf(cmd,"AT+QIACT=%d", _contextID);
+    int  cid = _pdp_id(pdp_id);
+
+    if( cid > 16 )
+        return NSAPI_ERROR_PARAMETER;
+
     _bg96_mutex.lock();
-    timer_s.reset();
     bool done=false;
-    while( !done && timer_s.read_ms() < BG96_150s_TO ) {
+    if( _pdp_active(cid) ) {
+        debug("PDP %d already active, reusing it\r\n", cid);
+        done = true;
+        }
+    else
+        debug("PDP %d activating ...\r\n", cid);
+    sprintf(cmd,"AT+QIACT=%d", cid);
+    timer_s.start();
+    while( !done && timer_s.read_ms() < bg96_cmd_limits[BG96_CMD_QIACT].ceiling ) {
+        uint64_t start = Kernel::get_ms_count();
+        _parser.set_timeout(_cmd_timeout(BG96_CMD_QIACT));
         done = tx2bg96(cmd);
+        if( done )
+            _cmd_latency(BG96_CMD_QIACT, start);
+        else if( _cme_error == 0 )
+            _cmd_expired(BG96_CMD_QIACT);
+        if( once )
+            break;
     }
-    if (done)
+    if (done) {
         debug("PDP started\r\n\n");
+        _pdp_wanted |= (1u << cid);
+        }
+    if( cid == _contextID )
+        _invalidate_ip();
         
     //wait(5);
 #if MQTT_DEBUG
@@ -422,72 +1014,247 @@ nsapi_error_t BG96::connect(int pdp_id)
 
 /** ----------------------------------------------------------
 * @brief  disconnect from an APN
-* @param  none
+* @param  context id, <1 for the current context
 * @retval true/false if disconnect was successful or not
 */
-bool BG96::disconnect(void)
+bool BG96::disconnect(int pdp_id)
 {
     char buff[15];
+    int  cid = _pdp_id(pdp_id);
+
     _bg96_mutex.lock();
-    _parser.set_timeout(BG96_60s_TO);
-    sprintf(buff,"AT+QIDEACT=%d\r",_contextID);
+    _pdp_wanted &= ~(1u << cid);
+    uint64_t start = Kernel::get_ms_count();
+    _parser.set_timeout(_cmd_timeout(BG96_CMD_QIDEACT));
+    sprintf(buff,"AT+QIDEACT=%d\r",cid);
     bool ok = tx2bg96(buff);
+    if( ok )
+        _cmd_latency(BG96_CMD_QIDEACT, start);
+    else if( _cme_error == 0 )
+        _cmd_expired(BG96_CMD_QIDEACT);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock(); 
+    if( cid == _contextID )
+        _invalidate_ip();
     return ok;
 }
 
+/** ----------------------------------------------------------
+* @brief  reactivate the contexts activated with connect(), used
+*         after the network deactivated them
+* @param  once: single AT+QIACT attempt for each context
+* @retval NSAPI_ERROR_OK if every context is active again
+*/
+nsapi_error_t BG96::reactivate(bool once)
+{
+    nsapi_error_t ret = NSAPI_ERROR_OK;
+
+    _bg96_mutex.lock();
+    uint32_t wanted = _pdp_wanted | (1u << _contextID);
+    for( int cid=1; cid<=16; cid++ )
+        if( (wanted & (1u << cid)) && connect(cid, once) != NSAPI_ERROR_OK )
+            ret = NSAPI_ERROR_DEVICE_ERROR;
+    _bg96_mutex.unlock();
+    return ret;
+}
+
+typedef struct {
+    volatile bool done;
+    nsapi_error_t err;
+    char          *ipstr;
+} DNS_WAIT;
+
+static void dns_wait_cb(DNS_WAIT *w, nsapi_error_t err, const char *ip)
+{
+    if( err == NSAPI_ERROR_OK )
+        strcpy(w->ipstr, ip);
+    w->err  = err;
+    w->done = true;
+}
+
 /** ----------------------------------------------------------
 * @brief  perform DNS lookup of URL to determine IP address
+*         the driver mutex is only held while the query is sent and
+*         while URCs are checked, so other commands can run meanwhile
 * @param  string containing the URL 
+* @param  context to send the query on, <1 for the current context
 * @retval string containing the IP results from the URL DNS
 */
-bool BG96::resolveUrl(const char *name, char* ipstr)
+bool BG96::resolveUrl(const char *name, char* ipstr, int pdp_id)
 {
-    char buf2[50]={0};
-    bool ok=false;
-    int  err=0, ipcount=0, dnsttl=0;
+    DNS_WAIT w = {false, NSAPI_ERROR_DNS_FAILURE, ipstr};
+    uint32_t gen = _dns_cancel;
+    int      slot;
 
     strcpy(ipstr,"");
 
+    if( !_dns_query(name, callback(dns_wait_cb, &w), pdp_id, &slot) )
+        return false;
+
+    while( !w.done && gen == _dns_cancel ) {
+        process_urc();
+        if( !w.done )
+            wait_ms(BG96_URC_POLL);
+    }
+
     _bg96_mutex.lock();
-    _parser.set_timeout(BG96_1s_WAIT);
-    _parser.send("AT+QIDNSGIP=%d,\"%s\"", _contextID, name);
-    ok = _parser.recv("OK");
-    if (ok) { // timed out for ERROR, try OK
-        _parser.set_timeout(BG96_60s_TO);
-        if (_parser.recv("+QIURC: \"dnsgip\",%s\r\n", buf2)) {
-            if ( sscanf(buf2, "%d", &err) == 1 && err > 0 ) {
-                ok = false;
-            } else if ( sscanf(buf2, "%d,%d,%d", &err, &ipcount, &dnsttl) == 3 && err==0 && ipcount > 0 ) {
-                ok = _parser.recv("+QIURC: \"dnsgip\",\"%[^\"]\"",ipstr);       //use the first DNS value
-                if (ok) {
-                    _parser.set_timeout(BG96_1s_WAIT);
-                    for(int i= 0; i<ipcount-1;i++) 
-                        _parser.recv("+QIURC: \"dnsgip\",\"%[^\"]\"", buf2);   //and discrard the rest  if >1
-                }
-            }
+    if( !w.done ) {                 //cancelled, the query stays queued until the BG96 answers it
+        debug("BG96: DNS query for %s cancelled\r\n", name);
+        _dns_cb[slot] = NULL;
         }
-    } else {
-        ok = false;
-    }
-    _parser.set_timeout(BG96_AT_TIMEOUT);
-    _bg96_mutex.unlock();  
-    return ok;
+    _bg96_mutex.unlock();
+    return w.done && w.err == NSAPI_ERROR_OK;
 }
 
 /** ----------------------------------------------------------
-* @brief  determine if BG96 is readable
-* @param  none
-* @retval true/false
+* @brief  send a DNS query to the BG96, the result is returned
+*         through the callback when the 'dnsgip' URC arrives
+* @param  string containing the URL
+* @param  callback to execute with the result
+* @param  context to send the query on, <1 for the current context
+* @retval true if the query was accepted, false otherwise
 */
-bool BG96::readable()
+bool BG96::startResolveUrl(const char *name, BG96_DNS_Callback cb, int pdp_id)
 {
-    return _serial.readable();
+    int slot;
+
+    return _dns_query(name, cb, pdp_id, &slot);
 }
 
 /** ----------------------------------------------------------
-* @brief  determine if BG96 is writable
+* @brief  send a DNS query and queue its callback
+* @param  string containing the URL
+* @param  callback to execute with the result
+* @param  context to send the query on, <1 for the current context
+* @param  receives the queue slot of the callback, it stays there
+*         until the callback is executed
+* @retval true if the query was accepted, false otherwise
+*/
+bool BG96::_dns_query(const char *name, BG96_DNS_Callback cb, int pdp_id, int *slot)
+{
+    bool ok=false;
+
+    _bg96_mutex.lock();
+    if( _dns_count < BG96_DNS_QUEUE_SIZE ) {
+        _parser.set_timeout(BG96_1s_WAIT);
+        ok = _parser.send("AT+QIDNSGIP=%d,\"%s\"", _pdp_id(pdp_id), name) && _parser.recv("OK");
+        if( ok ) {
+            int i = (_dns_head+_dns_count) % BG96_DNS_QUEUE_SIZE;
+            *slot         = i;
+            _dns_cb[i]    = cb;
+            _dns_start[i] = Kernel::get_ms_count();
+            _dns_count++;
+        }
+        _parser.set_timeout(BG96_AT_TIMEOUT);
+    }
+    _bg96_mutex.unlock();
+    return ok;
+}
+
+/** ----------------------------------------------------------
+* @brief  handle a 'dnsgip' URC. The BG96 answers queries in the
+*         order they were sent, first a header line with the error
+*         and address count, then one line per address. The late
+*         answers of expired queries are discarded, unless they are
+*         overdue by the BG96's own limit and can no longer come.
+* @param  none
+* @retval none
+*/
+void BG96::_dnsgip_urc(void)
+{
+    char buf[50]={0};
+    int  err=0, ipcount=0, dnsttl=0;
+
+    if( !_parser.recv(",%49s\n", buf) )
+        return;
+
+    if( buf[0] == '"' ) {
+        if( _dns_ipleft > 0 ) {
+            char *end = strchr(&buf[1], '"');
+            if( end )
+                *end = 0x00;
+            if( _dns_waitip ) {                         //use the first DNS value
+                _dns_waitip = false;
+                _dns_complete(NSAPI_ERROR_OK, &buf[1]);
+            }
+            _dns_ipleft--;                              //and discard the rest if >1
+        }
+    }
+    else if( sscanf(buf, "%d,%d,%d", &err, &ipcount, &dnsttl) >= 1 ) {
+        if( _dns_stale > 0 && Kernel::get_ms_count() > _dns_stale_until )
+            _dns_stale = 0;
+        if( _dns_stale > 0 ) {                          //answer of an expired query, skip its addresses
+            _dns_stale--;
+            _dns_ipleft = (err == 0)? ipcount : 0;
+            _dns_waitip = false;
+            return;
+        }
+        if( _dns_count > 0 )
+            _cmd_latency(BG96_CMD_QIDNSGIP, _dns_start[_dns_head]);
+        if( err == 0 && ipcount > 0 ) {
+            _dns_ipleft = ipcount;
+            _dns_waitip = true;
+        }
+        else
+            _dns_complete(NSAPI_ERROR_DNS_FAILURE, NULL);
+    }
+}
+
+/** ----------------------------------------------------------
+* @brief  pop the oldest DNS query and execute its callback
+* @param  result of the query
+* @param  first IP address returned for the query or NULL
+* @retval none
+*/
+void BG96::_dns_complete(nsapi_error_t err, const char *ip)
+{
+    if( _dns_count == 0 )
+        return;
+
+    BG96_DNS_Callback cb = _dns_cb[_dns_head];
+    _dns_cb[_dns_head] = NULL;
+    _dns_head = (_dns_head+1) % BG96_DNS_QUEUE_SIZE;
+    _dns_count--;
+    if( cb )
+        cb(err, ip);
+}
+
+/** ----------------------------------------------------------
+* @brief  process URCs that are waiting in the serial buffer and
+*         fail DNS queries that were not answered in time
+* @param  none
+* @retval none
+*/
+void BG96::process_urc(void)
+{
+    _bg96_mutex.lock();
+    _process_urcs();
+
+    if( _dns_count > 0 && Kernel::get_ms_count() - _dns_start[_dns_head] > (uint64_t)_cmd_timeout(BG96_CMD_QIDNSGIP) ) {
+        _cmd_expired(BG96_CMD_QIDNSGIP);
+        if( _dns_waitip )                               //header received, its addresses are discarded
+            _dns_waitip = false;
+        else {                                          //the whole answer is still to come
+            _dns_stale++;
+            _dns_stale_until = _dns_start[_dns_head] + bg96_cmd_limits[BG96_CMD_QIDNSGIP].ceiling;
+        }
+        _dns_complete(NSAPI_ERROR_DNS_FAILURE, NULL);
+        }
+    _bg96_mutex.unlock();
+}
+
+/** ----------------------------------------------------------
+* @brief  determine if BG96 is readable
+* @param  none
+* @retval true/false
+*/
+bool BG96::readable()
+{
+    return _serial.readable();
+}
+
+/** ----------------------------------------------------------
+* @brief  determine if BG96 is writable
 * @param  none
 * @retval true/false
 */
@@ -497,7 +1264,259 @@ bool BG96::writeable()
 }
 
 /** ----------------------------------------------------------
-* @brief  obtain the current RSSI 
+* @brief  check if a cached status value can still be used
+* @param  time the value was read, 0 if never read
+* @retval true if the value is recent enough
+*/
+bool BG96::_fresh(uint64_t read_time)
+{
+    return read_time != 0 && 
+           Kernel::get_ms_count() - read_time < MBED_CONF_BG96_LIBRARY_BG96_STATUS_MAXAGE;
+}
+
+/** ----------------------------------------------------------
+* @brief  force the IP address to be read again on next use
+* @param  none
+* @retval none
+*/
+void BG96::_invalidate_ip(void)
+{
+    _cache_mutex.lock();
+    _cache.ip[0] = 0x00;
+    _ip_time = 0;
+    _cache_mutex.unlock();
+}
+
+/** ----------------------------------------------------------
+* @brief  forget all cached values, used when the BG96 is reset
+* @param  none
+* @retval none
+*/
+void BG96::_invalidate_cache(void)
+{
+    _cache_mutex.lock();
+    memset(&_cache, 0x00, sizeof(_cache));
+    _cache.reg_status = -1;
+    _cache.rssi = -1;
+    _reg_stat[0] = _reg_stat[1] = -1;
+    _ip_time = _reg_time = _rssi_time = 0;
+    _cache_mutex.unlock();
+    memset(_sslctx_cfg, 0x00, sizeof(_sslctx_cfg));    //the SSL settings do not survive a restart
+    _dns_stale = 0;                                     //nor the DNS queries still running
+}
+
+/** ----------------------------------------------------------
+* @brief  handle a 'pdpdeact' URC, the context lost its IP address
+* @param  none
+* @retval none
+*/
+void BG96::_pdpdeact_urc(void)
+{
+    int id=0;
+
+    if( _parser.recv(",%d", &id) && id >= 1 && id <= 16 ) {
+        debug("BG96: PDP context %d deactivated by the network\r\n", id);
+        if( id == _contextID ) {
+            _cache_mutex.lock();
+            _cache.ip[0] = 0x00;
+            _ip_time = Kernel::get_ms_count();
+            _cache_mutex.unlock();
+            }
+        if( _link_cb && (id == _contextID || (_pdp_wanted & (1u << id))) )
+            _link_cb(BG96_LINK_PDP_DOWN, id);
+        }
+}
+
+/** ----------------------------------------------------------
+* @brief  join a status query. If the same query is already waiting
+*         on the BG96, wait for its answer instead of sending the
+*         command again.
+* @param  query to perform
+* @param  result of the answer when it was shared
+* @param  values of the answer when it was shared
+* @retval true if the caller has to send the command and call
+*         _query_finish, false if the shared answer was copied
+*/
+bool BG96::_query_lead(BG96_QUERY q, bool &done, size_t val[2])
+{
+    _query_mutex.lock();
+    if( !_query[q].busy ) {
+        _query[q].busy = true;
+        _query_stats.sent[q]++;
+        _query_mutex.unlock();
+        return true;
+        }
+
+    uint32_t gen = _query[q].gen;
+    _query_stats.merged[q]++;
+    while( _query[q].gen == gen )
+        _query_cond.wait();
+    done   = _query[q].done;
+    val[0] = _query[q].val[0];
+    val[1] = _query[q].val[1];
+    _query_mutex.unlock();
+    return false;
+}
+
+/** ----------------------------------------------------------
+* @brief  publish the answer of a status query to waiting callers
+* @param  query that was performed
+* @param  result and values of the answer
+* @retval none
+*/
+void BG96::_query_finish(BG96_QUERY q, bool done, size_t val0, size_t val1)
+{
+    _query_mutex.lock();
+    _query[q].done   = done;
+    _query[q].val[0] = val0;
+    _query[q].val[1] = val1;
+    _query[q].busy   = false;
+    _query[q].gen++;
+    _query_cond.notify_all();
+    _query_mutex.unlock();
+}
+
+/** ----------------------------------------------------------
+* @brief  copy the counters of status queries sent and merged
+* @param  structure to receive the counters
+* @retval none
+*/
+void BG96::getQueryStats(BG96_QUERY_STATS &stats)
+{
+    _query_mutex.lock();
+    stats = _query_stats;
+    _query_mutex.unlock();
+}
+
+/** ----------------------------------------------------------
+* @brief  copy the cached identity and status values
+* @param  structure to receive the values
+* @retval none
+*/
+void BG96::getStatus(BG96_STATUS &status)
+{
+    _cache_mutex.lock();
+    status = _cache;
+    _cache_mutex.unlock();
+}
+
+/** ----------------------------------------------------------
+* @brief  skip the 0x prefix the BG96 puts on band masks, they
+*         are written back without it
+* @param  hex string
+* @retval the hex digits
+*/
+static const char *hex_digits(const char *hex)
+{
+    return (hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X'))? hex+2 : hex;
+}
+
+/** ----------------------------------------------------------
+* @brief  compare two hex strings by value so "0x0F" matches "F"
+* @param  hex strings
+* @retval true if they hold the same value
+*/
+static bool hex_equal(const char *a, const char *b)
+{
+    return strtoull(a, NULL, 16) == strtoull(b, NULL, 16);
+}
+
+/** ----------------------------------------------------------
+* @brief  read the AT+QCFG radio settings in one transaction
+* @param  structure receiving the settings
+* @retval NSAPI_ERROR_OK if all settings were read
+*/
+int BG96::getRadioConfig(BG96_RADIO_CFG &cfg)
+{
+    char resp[80];
+    char key[12];
+    char val[64];
+    int  nread=0;
+    bool done;
+
+    memset(&cfg, 0x00, sizeof(cfg));
+    cfg.nwscanmode = cfg.iotopmode = -1;
+
+    _bg96_mutex.lock();
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    done = _parser.send("AT+QCFG=\"nwscanseq\";+QCFG=\"nwscanmode\";+QCFG=\"iotopmode\";+QCFG=\"band\"");
+    while( done && (done = _parser.recv("%79[^\n]\n", resp)) && strcmp(resp, "OK") ) {
+        if( !strcmp(resp, "ERROR") ) {
+            done = false;
+            break;
+            }
+        if( sscanf(resp, "+QCFG: \"%11[^\"]\",%63s", key, val) != 2 )
+            continue;
+        nread++;
+        if( !strcmp(key, "nwscanseq") )
+            snprintf(cfg.nwscanseq, sizeof(cfg.nwscanseq), "%s", val);
+        else if( !strcmp(key, "nwscanmode") )
+            cfg.nwscanmode = atoi(val);
+        else if( !strcmp(key, "iotopmode") )
+            cfg.iotopmode = atoi(val);
+        else if( !strcmp(key, "band") ) {
+            // "<gsm>,<catm1>,<nb1>", each shown as 0x...
+            char *catm1 = strchr(val, ',');
+            char *nb1 = catm1 ? strchr(catm1+1, ',') : NULL;
+            if( nb1 ) {
+                *catm1++ = 0x00;
+                *nb1++ = 0x00;
+                snprintf(cfg.band_gsm, sizeof(cfg.band_gsm), "%s", hex_digits(val));
+                snprintf(cfg.band_catm1, sizeof(cfg.band_catm1), "%s", hex_digits(catm1));
+                snprintf(cfg.band_nb1, sizeof(cfg.band_nb1), "%s", hex_digits(nb1));
+                }
+            }
+        }
+    _bg96_mutex.unlock();
+    return (done && nread == 4)? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
+}
+
+/** ----------------------------------------------------------
+* @brief  write the radio settings that differ from the ones
+*         stored in the BG96, the BG96 keeps them across resets
+*         so the usual startup writes nothing
+* @param  settings, "" or -1 leave a value unchanged
+* @retval NSAPI_ERROR_OK if all settings match or were written
+*/
+int BG96::setRadioConfig(const BG96_RADIO_CFG &cfg)
+{
+    BG96_RADIO_CFG cur;
+    char           cmd[4][80];
+    const char*    cmds[4];
+    int            n=0;
+
+    if( !cfg.nwscanseq[0] && cfg.nwscanmode < 0 && cfg.iotopmode < 0 &&
+        !cfg.band_gsm[0] && !cfg.band_catm1[0] && !cfg.band_nb1[0] )
+        return NSAPI_ERROR_OK;
+
+    if( getRadioConfig(cur) != NSAPI_ERROR_OK )
+        return NSAPI_ERROR_DEVICE_ERROR;
+
+    if( cfg.nwscanseq[0] && !hex_equal(cfg.nwscanseq, cur.nwscanseq) )
+        sprintf(cmd[n++], "AT+QCFG=\"nwscanseq\",%s,1", cfg.nwscanseq);
+    if( cfg.nwscanmode >= 0 && cfg.nwscanmode != cur.nwscanmode )
+        sprintf(cmd[n++], "AT+QCFG=\"nwscanmode\",%d,1", cfg.nwscanmode);
+    if( cfg.iotopmode >= 0 && cfg.iotopmode != cur.iotopmode )
+        sprintf(cmd[n++], "AT+QCFG=\"iotopmode\",%d,1", cfg.iotopmode);
+    if( (cfg.band_gsm[0] && !hex_equal(cfg.band_gsm, cur.band_gsm)) ||
+        (cfg.band_catm1[0] && !hex_equal(cfg.band_catm1, cur.band_catm1)) ||
+        (cfg.band_nb1[0] && !hex_equal(cfg.band_nb1, cur.band_nb1)) )
+        sprintf(cmd[n++], "AT+QCFG=\"band\",%s,%s,%s,1", cfg.band_gsm[0]? cfg.band_gsm : cur.band_gsm,
+                                                         cfg.band_catm1[0]? cfg.band_catm1 : cur.band_catm1,
+                                                         cfg.band_nb1[0]? cfg.band_nb1 : cur.band_nb1);
+    if( n == 0 )
+        return NSAPI_ERROR_OK;
+
+    for( int i=0; i<n; i++ ) {
+        debug("BG96: radio setting changed, %s\r\n", cmd[i]);
+        cmds[i] = cmd[i];
+        }
+    return send_batch(cmds, n, BG96_AT_TIMEOUT);
+}
+
+/** ----------------------------------------------------------
+* @brief  obtain the current RSSI, re-read when the cached value
+*         is older than the configured maximum age
 * @param  none
 * @retval integet representing the RSSI, 1=poor,2=weak,3=mid-level,4=good,5=strong; 0=not available 
 */
@@ -506,16 +1525,173 @@ int BG96::getRSSI(void)
     int   cs=0, er=0;
     bool  done=false;
 
+    _cache_mutex.lock();
+    done = _fresh(_rssi_time);
+    cs = _cache.rssi;
+    _cache_mutex.unlock();
+    if( done )
+        return cs;
+
+    size_t val[2];
+    if( !_query_lead(BG96_QUERY_RSSI, done, val) )
+        return done? (int)val[0]:0;
+
     _bg96_mutex.lock();
     done = _parser.send("AT+CSQ") && _parser.recv("+CSQ: %d,%d\n",&cs,&er);
     _bg96_mutex.unlock();
 
+    if( done ) {
+        _cache_mutex.lock();
+        _cache.rssi = cs;
+        _rssi_time = Kernel::get_ms_count();
+        _cache_mutex.unlock();
+        }
+    _query_finish(BG96_QUERY_RSSI, done, cs, 0);
     return done? cs:0;
 }
 
+/** ----------------------------------------------------------
+* @brief  obtain the network registration status
+* @param  none
+* @retval <stat> of +CGREG, 1=registered, 5=roaming, -1 if unknown
+*/
+int BG96::getRegistrationStatus(void)
+{
+    int   stat=-1;
+    bool  done=false;
+
+    _cache_mutex.lock();
+    done = _fresh(_reg_time);
+    stat = _cache.reg_status;
+    _cache_mutex.unlock();
+    if( done )
+        return stat;
+
+    // the +CEREG/+CGREG answers are taken by _reg_urc() which updates the cache
+    _bg96_mutex.lock();
+    done = _parser.send("AT+CEREG?;+CGREG?") && _parser.recv("OK");
+    _bg96_mutex.unlock();
+
+    if( !done )
+        return -1;
+    _cache_mutex.lock();
+    stat = _cache.reg_status;
+    _cache_mutex.unlock();
+    return stat;
+}
+
+/** ----------------------------------------------------------
+* @brief  obtain the time the last network registration took
+* @param  none
+* @retval ms from the start of connect() to registration, -1 if unknown
+*/
+int BG96::getRegistrationLatency(void)
+{
+    int latency;
+
+    _cache_mutex.lock();
+    latency = _reg_latency;
+    _cache_mutex.unlock();
+    return latency;
+}
 
 /** ----------------------------------------------------------
-* @brief  obtain the IP address socket is using
+* @brief  handle a +CEREG (EPS domain: Cat.M1/NB1) or +CGREG
+*         (GPRS domain: GSM) line. Both the URC '<stat>' and the
+*         query answer '<n>,<stat>' start with the same prefix.
+*         The BG96 is registered when either domain is, and only
+*         reported as denied (3) when no domain is still searching.
+* @param  none
+* @retval none
+*/
+void BG96::_cereg_urc(void)
+{
+    _reg_urc(0);
+}
+
+void BG96::_cgreg_urc(void)
+{
+    _reg_urc(1);
+}
+
+void BG96::_reg_urc(int domain)
+{
+    char line[40];
+    int  v[2];
+    int  n, stat;
+    bool was_registered;
+
+    if( !_parser.recv("%39[^\n]\n", line) )
+        return;
+    n = sscanf(line, "%d,%d", &v[0], &v[1]);
+    if( n < 1 )
+        return;
+    _reg_stat[domain] = (n == 2)? v[1] : v[0];
+
+    if( _reg_stat[0] == 1 || _reg_stat[0] == 5 )
+        stat = _reg_stat[0];
+    else if( _reg_stat[1] == 1 || _reg_stat[1] == 5 )
+        stat = _reg_stat[1];
+    else if( _reg_stat[0] == 2 || _reg_stat[1] == 2 )
+        stat = 2;                   //a domain still searching, e.g. GSM after an LTE denial, can still register
+    else if( _reg_stat[0] == 3 || _reg_stat[1] == 3 )
+        stat = 3;                   //denied, and no domain left searching
+    else
+        stat = (_reg_stat[0] >= 0)? _reg_stat[0] : _reg_stat[1];
+
+    _cache_mutex.lock();
+    was_registered = (_cache.reg_status == 1 || _cache.reg_status == 5);
+    if( stat != 1 && stat != 5 )
+        _ip_time = 0;               //a deregistered BG96 may have lost its address
+    else if( _reg_start != 0 ) {
+        _reg_latency = (int)(Kernel::get_ms_count() - _reg_start);
+        _reg_start = 0;
+        }
+    _cache.reg_status = stat;
+    _reg_time = Kernel::get_ms_count();
+    _cache_mutex.unlock();
+
+    if( _link_cb && was_registered != (stat == 1 || stat == 5) )
+        _link_cb(was_registered? BG96_LINK_DEREGISTERED : BG96_LINK_REGISTERED, 0);
+}
+
+/** ----------------------------------------------------------
+* @brief  copy the registration counters
+* @param  structure to receive the counters
+* @retval none
+*/
+void BG96::getRegistrationStats(BG96_REG_STATS &stats)
+{
+    _bg96_mutex.lock();
+    stats = _reg_stats;
+    _bg96_mutex.unlock();
+}
+
+/** ----------------------------------------------------------
+* @brief  restart the network search, used to recover when the BG96
+*         does not register again by itself. AT+COPS=0 only answers
+*         once the BG96 registered, so the radio is switched off and
+*         on instead and the registration URCs report the outcome
+* @param  none
+* @retval true if the radio was restarted
+*/
+bool BG96::reregister(void)
+{
+    bool done;
+
+    _bg96_mutex.lock();
+    _parser.set_timeout(BG96_CFUN_TO);
+    done = _parser.send("AT+CFUN=4") && _recv_final();
+    done = _parser.send("AT+CFUN=1") && _recv_final() && done;
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    _bg96_mutex.unlock();
+    return done;
+}
+
+/** ----------------------------------------------------------
+* @brief  obtain the IP address socket is using, re-read when the
+*         cached value is older than the configured maximum age
+*         or was invalidated by a URC
 * @param  none
 * @retval string containing IP or NULL on failure
 */
@@ -523,10 +1699,25 @@ const char *BG96::getIPAddress(char *ipstr)
 {
     int   dummy=0, cs=0, ct=0;
     bool  done=false;
-    char resp[6];
+
+    _cache_mutex.lock();
+    done = _fresh(_ip_time);
+    if( done )
+        strcpy(ipstr, _cache.ip);
+    _cache_mutex.unlock();
+    if( done )
+        return ipstr[0]? ipstr:NULL;
+
+    size_t val[2];
+    if( !_query_lead(BG96_QUERY_IP, done, val) ) {
+        _cache_mutex.lock();
+        strcpy(ipstr, _cache.ip);
+        _cache_mutex.unlock();
+        return (done && ipstr[0])? ipstr:NULL;
+        }
+
     _bg96_mutex.lock();
-    //_parser.flush();
-    done = _parser.send("AT+QIACT?"); //&& _parser.recv("%s\r\n", resp) && strcmp(resp, "OK") == 0
+    done = _parser.send("AT+QIACT?");
     if (done) {
         _parser.set_timeout(15000); 
         done = _parser.recv("+QIACT:%d,%d,%d,\"%16[^\"]\"", &dummy, &cs, &ct, ipstr) && _parser.recv("OK");
@@ -536,113 +1727,579 @@ const char *BG96::getIPAddress(char *ipstr)
     _parser.flush();
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
-    //debug("Received %s\r\n", reply);
-    debug("ipstr: %s\r\n", ipstr);
+
+    _cache_mutex.lock();
+    if( done )
+        strcpy(_cache.ip, ipstr);
+    else
+        _cache.ip[0] = 0x00;
+    _ip_time = Kernel::get_ms_count();
+    _cache_mutex.unlock();
+    _query_finish(BG96_QUERY_IP, done, 0, 0);
+    debug("ipstr: %s\r\n", done? ipstr:"");
     return done? ipstr:NULL;
 }
 
 /** ----------------------------------------------------------
-* @brief  return the MAC
+* @brief  return the MAC, the ICCID is only read from the BG96 once
 * @param  none
 * @retval string containing the MAC or NULL on failure
 *         MAC is created using the ICCID of the SIM
 */
-const char *BG96::getMACAddress(char* sn)
+const char *BG96::getMACAddress(char* sn)
+{
+    char iccid[24]={0};
+    bool done=false;
+
+    _cache_mutex.lock();
+    done = _cache.iccid[0] != 0;
+    strcpy(iccid, _cache.iccid);
+    _cache_mutex.unlock();
+
+    if( !done ) {
+        _bg96_mutex.lock();
+        done = _parser.send("AT+QCCID") && _parser.recv("+QCCID: %20[0-9A-Fa-f]", iccid) && 
+               strlen(iccid) == 20;
+        _bg96_mutex.unlock();
+        if( !done )
+            return NULL;
+        _cache_mutex.lock();
+        strcpy(_cache.iccid, iccid);
+        _cache_mutex.unlock();
+        }
+
+    //last 14 digits of the ICCID, reversed, as 7 colon separated pairs
+    for( int k=0, j=19; k<20; k++ )
+        sn[k] = (k%3 == 2)? ':' : iccid[j--];
+    sn[20] = 0x00; 
+
+    return (const char*)sn;
+}
+
+/** ----------------------------------------------------------
+* @brief  return the IMEI, only read from the BG96 once
+* @param  none
+* @retval string containing the IMEI or NULL on failure
+*/
+const char *BG96::getIMEI(char* imei)
+{
+    bool done=false;
+
+    _cache_mutex.lock();
+    done = _cache.imei[0] != 0;
+    strcpy(imei, _cache.imei);
+    _cache_mutex.unlock();
+    if( done )
+        return (const char*)imei;
+
+    _bg96_mutex.lock();
+    done = _parser.send("AT+GSN") && _parser.recv("%15[0-9]\n", imei) && _parser.recv("OK");
+    _bg96_mutex.unlock();
+    if( !done )
+        return NULL;
+
+    _cache_mutex.lock();
+    strcpy(_cache.imei, imei);
+    _cache_mutex.unlock();
+    return (const char*)imei;
+}
+
+/** ----------------------------------------------------------
+* @brief  determine if BG96 is connected to an APN
+* @param  none
+* @retval true or false
+*/
+bool BG96::isConnected(void)
+{
+    char ipAddress[50] = {0};
+    return getIPAddress(ipAddress);//resolveUrl("www.google.com", ipAddress);//
+}
+
+/** ----------------------------------------------------------
+* @brief  open a BG96 socket
+* @param  type of socket to open ('u' or 't')
+* @param  id of BG96 socket
+* @param  address (IP)
+* @param  port of the socket
+* @param  context to open the socket on, <1 for the current context
+* @retval true if successful, else false on failure
+*/
+bool BG96::open(const char type, int id, const char* addr, int port, int pdp_id)
+{
+    char* stype = (char*)"TCP";
+    char  cmd[20];
+    int   err=1;
+    bool  ok;
+      
+    if( type == 'u' ) 
+      stype = (char*)"UDP";
+      
+    if( id < 0 || id >= BG96_SOCKET_MAX )
+        return false;
+
+    _bg96_mutex.lock();
+    if( _cancel_open[id] ) {
+        _bg96_mutex.unlock();
+        return false;
+    }
+    sprintf(cmd,"+QIOPEN: %d,%%d", id);
+    uint64_t start = Kernel::get_ms_count();
+    int      to = _cmd_timeout(BG96_CMD_QIOPEN);
+    _parser.set_timeout(to);
+    _cme_error = 0;
+    ok=_parser.send("AT+QIOPEN=%d,%d,\"%s\",\"%s\",%d,0,0\r", _pdp_id(pdp_id), id, stype, addr, port) && _recv_final();
+    _wd_check(ok);
+    if (ok) { 
+        ok = _wait_urc(to, &_cancel_open[id], cmd, &err);
+        if( ok )
+            _cmd_latency(BG96_CMD_QIOPEN, start);
+        else if( !_cancel_open[id] )
+            _cmd_expired(BG96_CMD_QIOPEN);
+        ok = ok && err == 0;
+        if( _cancel_open[id] ) {        //free the connectID, the open may still complete
+            debug("BG96: open of socket %d cancelled\r\n", id);
+            ok = false;
+            _parser.set_timeout(_cmd_timeout(BG96_CMD_QICLOSE));
+            _parser.send("AT+QICLOSE=%d,%d", id, BG96_CLOSE_TO) && _parser.recv("OK");
+        }
+    } else {
+        ok = false;
+    }
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    _bg96_mutex.unlock();
+    if( ok )
+        while( recv(id, cmd, sizeof(cmd)) )
+            /* clear out any residual data in BG96 buffer */;
+
+    return ok;
+}
+
+/** ----------------------------------------------------------
+* @brief  get last error code
+* @param  none.
+* @retval returns true/false if successful and updated error string
+*/
+bool BG96::getError(char *str)
+{
+    char lstr[MAX_ERROR_DESCRIPTION_LENGTH];
+    int  err;
+    memset(lstr,0x00,sizeof(lstr));
+    _bg96_mutex.lock();
+    bool done = (_parser.send("AT+QIGETERROR") 
+              && _parser.recv("+QIGETERROR: %d,%[^\\n]",&err,lstr)
+              && _parser.recv("OK") );
+    _bg96_mutex.unlock();
+    if( done )
+        sprintf(str,"Error:%d",err);
+    return done;
+}
+
+bool BG96::getError(BG96_ERROR &error)
+{
+    _bg96_mutex.lock();
+    bool done = (_parser.send("AT+QIGETERROR") 
+              && _parser.recv("+QIGETERROR: %d,%[^\\n]",&(error.errornum),error.description)
+              && _parser.recv("OK") );
+    _bg96_mutex.unlock();
+    return done;
+}
+
+/** ----------------------------------------------------------
+* @brief  return the result of the last command of an operation
+* @param  operation
+* @retval 0 if successful, CME error code or -1 otherwise
+*/
+int BG96::getLastError(BG96_OP op)
+{
+    int err;
+
+    if( op < 0 || op >= BG96_OP_COUNT ) return -1;
+    _bg96_mutex.lock();
+    err = _op_error[op];
+    _bg96_mutex.unlock();
+    return err;
+}
+
+/** ----------------------------------------------------------
+* @brief  return the result of the last command of an operation
+* @param  operation
+* @param  structure receiving the error number and description
+* @retval true if the last command of the operation failed
+*/
+bool BG96::getLastError(BG96_OP op, BG96_ERROR &error)
+{
+    error.errornum = getLastError(op);
+    if( error.errornum == 0 ) {
+        error.description[0] = '\0';
+        return false;
+        }
+    if( error.errornum < 0 )
+        strcpy(error.description, "No error code reported");
+    else
+        sprintf(error.description, "+CME ERROR: %d", error.errornum);
+    return true;
+}
+
+/** ----------------------------------------------------------
+* @brief  handle a +CME ERROR final result. Called from the
+*         parser while a command waits for its answer, so the
+*         error is kept for the running transaction and the
+*         wait is cut short instead of timing out.
+* @param  none
+* @retval none
+*/
+void BG96::_cme_error_urc(void)
+{
+    int err;
+
+    if( _parser.recv("%d\n", &err) )
+        _cme_error = err;
+    else
+        _cme_error = -1;
+    _parser.abort();
+}
+
+/** ----------------------------------------------------------
+* @brief  +QSSLURC: "recv",<id> or "closed",<id> received, kept
+*         for sslWaitRx() and sslChkRxAvail()
+* @param  none
+* @retval none
+*/
+void BG96::_sslurc(void)
+{
+    char ev[12];
+    int  id;
+
+    if( !_parser.recv(" \"%11[^\"]\",%d", ev, &id) || id < 0 || id >= BG96_SOCKET_MAX )
+        return;
+    if( strcmp(ev, "recv") == 0 )
+        _ssl_rx |= 1u << id;
+    else if( strcmp(ev, "closed") == 0 )
+        _ssl_closed |= 1u << id;
+}
+
+/** ----------------------------------------------------------
+* @brief  +QMTRECV: message received, queued for mqtt_recv() so
+*         it is not lost while another command or wait runs. The
+*         oldest message is dropped when the queue is full
+* @param  none
+* @retval none
+*/
+void BG96::_qmtrecv_urc(void)
+{
+    if( _mqtt_rxq_count == BG96_MQTT_RXQ_SIZE ) {
+        debug("BG96: MQTT receive queue full, oldest message dropped\r\n");
+        _mqtt_rxq_head = (_mqtt_rxq_head+1) % BG96_MQTT_RXQ_SIZE;
+        _mqtt_rxq_count--;
+        }
+    int i = (_mqtt_rxq_head+_mqtt_rxq_count) % BG96_MQTT_RXQ_SIZE;
+    if( _parser.recv(" %d,%d,\"%256[^\"]\",%1547s\n", &_mqtt_rxq[i].id, &_mqtt_rxq[i].msg_id,
+                     _mqtt_rxq[i].topic, _mqtt_rxq[i].payload) )
+        _mqtt_rxq_count++;
+}
+
+/** ----------------------------------------------------------
+* @brief  run the handlers of the URCs waiting in the serial
+*         buffer. _bg96_mutex must be held
+* @param  none
+* @retval none
+*/
+void BG96::_process_urcs(void)
+{
+    _parser.set_timeout(BG96_URC_TIMEOUT);
+    while( _serial.readable() )
+        _parser.process_oob();
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+}
+
+/** ----------------------------------------------------------
+* @brief  record the result of an operation's command, must be
+*         called with _bg96_mutex held before it is released
+* @param  operation
+* @param  true if the command succeeded
+* @retval none
+*/
+void BG96::_set_op_error(BG96_OP op, bool ok)
+{
+    if( ok )
+        _op_error[op] = 0;
+    else
+        _op_error[op] = (_cme_error != 0) ? _cme_error : -1;
+    _cme_error = 0;
+}
+
+
+/** ----------------------------------------------------------
+* @brief  request that an open() in progress stops. Releasing the
+*         id waits for the driver so an open() still running sees
+*         the request first.
+* @param  id of BG96 socket
+* @param  true to cancel, false to release the id
+* @retval none
+*/
+void BG96::cancelOpen(int id, bool cancel)
+{
+    if( id < 0 || id >= BG96_SOCKET_MAX )
+        return;
+    if( cancel )
+        _cancel_open[id] = true;
+    else {
+        _bg96_mutex.lock();
+        _cancel_open[id] = false;
+        _bg96_mutex.unlock();
+    }
+}
+
+/** ----------------------------------------------------------
+* @brief  get a free connectID
+* @param  none
+* @retval connectID, -1 if none is free
+*/
+int BG96::allocSocket(void)
+{
+    int id;
+
+    _bg96_mutex.lock();
+    for( id=0; id<BG96_SOCKET_MAX && _sock_state[id] != BG96_SOCK_FREE; id++ )
+        ;
+    if( id == BG96_SOCKET_MAX && drainSockets() < BG96_SOCKET_MAX )
+        for( id=0; id<BG96_SOCKET_MAX && _sock_state[id] != BG96_SOCK_FREE; id++ )
+            ;
+    if( id < BG96_SOCKET_MAX ) {
+        _sock_state[id] = BG96_SOCK_USED;
+        _cancel_open[id] = false;
+        _close_req[id] = false;
+        }
+    else
+        id = -1;
+    _bg96_mutex.unlock();
+    return id;
+}
+
+/** ----------------------------------------------------------
+* @brief  ask for a connectID to be closed. The driver mutex may
+*         be held by the open() this stops, so only the flags are
+*         set; drainSockets() marks the id as draining and sends
+*         the AT+QICLOSE
+* @param  connectID of the socket
+* @retval none
+*/
+void BG96::closeAsync(int id)
+{
+    if( id < 0 || id >= BG96_SOCKET_MAX )
+        return;
+    _cancel_open[id] = true;                //stops an open() still waiting, and keeps it from retrying
+    _close_req[id] = true;
+}
+
+/** ----------------------------------------------------------
+* @brief  close the draining connectIDs. Any answer, OK or
+*         +CME ERROR, confirms the BG96 no longer uses the id.
+* @param  none
+* @retval number of connectIDs still draining
+*/
+int BG96::drainSockets(void)
+{
+    int left=0;
+
+    _bg96_mutex.lock();
+    for( int id=0; id<BG96_SOCKET_MAX; id++ ) {
+        if( _close_req[id] ) {
+            _close_req[id] = false;
+            _sock_state[id] = BG96_SOCK_DRAINING;
+            }
+        if( _sock_state[id] != BG96_SOCK_DRAINING )
+            continue;
+        uint64_t start = Kernel::get_ms_count();
+        _parser.set_timeout(_cmd_timeout(BG96_CMD_QICLOSE));
+        _cme_error = 0;
+        bool ok = _parser.send("AT+QICLOSE=%d,%d", id, BG96_CLOSE_TO) && _recv_final();
+        if( ok )
+            _cmd_latency(BG96_CMD_QICLOSE, start);
+        _wd_check(ok);
+        if( ok || _cme_error != 0 ) {
+            _sock_state[id] = BG96_SOCK_FREE;
+            debug("BG96: socket %d closed after %d ms\r\n", id, (int)(Kernel::get_ms_count() - start));
+            }
+        else
+            left++;
+        }
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    _bg96_mutex.unlock();
+    return left;
+}
+
+/** ----------------------------------------------------------
+* @brief  free a connectID
+* @param  connectID
+* @retval none
+*/
+void BG96::releaseSocket(int id)
+{
+    if( id < 0 || id >= BG96_SOCKET_MAX )
+        return;
+    _bg96_mutex.lock();
+    _sock_state[id] = BG96_SOCK_FREE;
+    _bg96_mutex.unlock();
+}
+
+/** ----------------------------------------------------------
+* @brief  get a free SSL context
+* @param  none
+* @retval SSL context id, -1 if none is free
+*/
+int BG96::allocSslContext(void)
 {
- 
+    int ctx;
+
     _bg96_mutex.lock();
-    if( _parser.send("AT+QCCID") ) {
-        _parser.recv("+QCCID: %c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c",
-            &sn[26], &sn[25], &sn[24],&sn[23],&sn[22],
-            &sn[21], &sn[19], &sn[18],&sn[16],&sn[15],
-            &sn[13], &sn[12], &sn[10],&sn[9], &sn[7],
-            &sn[6],  &sn[4],  &sn[3], &sn[1], &sn[0]); 
-        sn[2] = sn[5] = sn[8] = sn[11] = sn[14] = sn[17] = ':';
-        sn[20] = 0x00; 
-        }
+    for( ctx=0; ctx<BG96_SSLCTX_MAX && (_sslctx_used & (1u << ctx)); ctx++ )
+        ;
+    if( ctx < BG96_SSLCTX_MAX )
+        _sslctx_used |= 1u << ctx;
+    else
+        ctx = -1;
     _bg96_mutex.unlock();
+    return ctx;
+}
 
-    return (const char*)sn;
+void BG96::releaseSslContext(int ctx)
+{
+    if( ctx < 0 || ctx >= BG96_SSLCTX_MAX )
+        return;
+    _bg96_mutex.lock();
+    _sslctx_used &= ~(1u << ctx);
+    _bg96_mutex.unlock();
 }
 
+//built-in SSL profiles, the first one matches the settings used before profiles existed
+static const BG96_SSL_PROFILE bg96_ssl_profiles[] = {
+    // name                      version  ciphersuite  seclevel negotiate ignoretime sni    session
+    { "default",                    4,     "0xFFFF",      -1,     300,      true,    false, true },
+    { "tls12",                      3,     "0xFFFF",      -1,     300,      true,    false, true },
+    { "tls12-ecdhe-rsa-gcm",        3,     "0xC02F",      -1,     300,      true,    false, true },   //ECDHE_RSA_WITH_AES_128_GCM_SHA256
+    { "tls12-ecdhe-ecdsa-gcm",      3,     "0xC02B",      -1,     300,      true,    false, true },   //ECDHE_ECDSA_WITH_AES_128_GCM_SHA256
+    { "tls12-rsa-aes128",           3,     "0x003C",      -1,     300,      true,    false, true },   //RSA_WITH_AES_128_CBC_SHA256
+    { "tls12-rsa-aes256",           3,     "0x003D",      -1,     300,      true,    false, true },   //RSA_WITH_AES_256_CBC_SHA256
+};
+
 /** ----------------------------------------------------------
-* @brief  determine if BG96 is connected to an APN
-* @param  none
-* @retval true or false
+* @brief  find a built-in SSL profile
+* @param  profile name
+* @retval profile, NULL if none has this name
 */
-bool BG96::isConnected(void)
+const BG96_SSL_PROFILE *BG96::getSslProfile(const char *name)
 {
-    char ipAddress[50] = {0};
-    return getIPAddress(ipAddress);//resolveUrl("www.google.com", ipAddress);//
+    for( unsigned i=0; name != NULL && i<sizeof(bg96_ssl_profiles)/sizeof(bg96_ssl_profiles[0]); i++ )
+        if( strcmp(bg96_ssl_profiles[i].name, name) == 0 )
+            return &bg96_ssl_profiles[i];
+    return NULL;
+}
+
+const BG96_SSL_PROFILE *BG96::getSslProfiles(int &count)
+{
+    count = sizeof(bg96_ssl_profiles)/sizeof(bg96_ssl_profiles[0]);
+    return bg96_ssl_profiles;
 }
 
 /** ----------------------------------------------------------
-* @brief  open a BG96 socket
-* @param  type of socket to open ('u' or 't')
-* @param  id of BG96 socket
-* @param  address (IP)
-* @param  port of the socket
-* @retval true if successful, else false on failure
+* @brief  apply an SSL profile to a context in one batch, unless
+*         the context already has it. The session cache setting is
+*         sent on its own since older firmware rejects it; the first
+*         ERROR marks it unsupported and it is not sent again
+* @param  SSL context
+* @param  the profile
+* @param  security level to use in place of the profile's
+* @retval NSAPI_ERROR_OK on success
 */
-bool BG96::open(const char type, int id, const char* addr, int port)
-{
-    char* stype = (char*)"TCP";
-    char  cmd[20];
-    int   err=1;
-    bool  ok;
-      
-    if( type == 'u' ) 
-      stype = (char*)"UDP";
-      
+int BG96::configure_ssl_profile(int sslctx_id, const BG96_SSL_PROFILE *profile, int seclevel)
+{
+    char        cfg[6][56];
+    const char* cmds[6];
+    int         n=0, rc;
+    uint32_t    hash = 2166136261u;
+
+    if( profile == NULL || sslctx_id < 0 || sslctx_id >= BG96_SSLCTX_MAX )
+        return NSAPI_ERROR_PARAMETER;
+
+    snprintf(cfg[n++], sizeof(cfg[0]), "AT+QSSLCFG=\"sslversion\",%d,%d", sslctx_id, profile->sslversion);
+    snprintf(cfg[n++], sizeof(cfg[0]), "AT+QSSLCFG=\"ciphersuite\",%d,%s", sslctx_id, profile->ciphersuite);
+    snprintf(cfg[n++], sizeof(cfg[0]), "AT+QSSLCFG=\"seclevel\",%d,%d", sslctx_id, seclevel);
+    snprintf(cfg[n++], sizeof(cfg[0]), "AT+QSSLCFG=\"negotiatetime\",%d,%d", sslctx_id, profile->negotiatetime);
+    snprintf(cfg[n++], sizeof(cfg[0]), "AT+QSSLCFG=\"ignorelocaltime\",%d,%d", sslctx_id, profile->ignorelocaltime? 1:0);
+    snprintf(cfg[n++], sizeof(cfg[0]), "AT+QSSLCFG=\"sni\",%d,%d", sslctx_id, profile->sni? 1:0);
+    for( int i=0; i<n; i++ ) {
+        cmds[i] = cfg[i];
+        for( const char *c=cfg[i]; *c; c++ )
+            hash = (hash ^ (uint8_t)*c) * 16777619u;
+        }
+    hash = (hash ^ (profile->session_cache? 1u:0u)) * 16777619u;
+    if( hash == 0 )
+        hash = 1;
+
     _bg96_mutex.lock();
-    sprintf(cmd,"+QIOPEN: %d,%%d", id);
-    _parser.set_timeout(BG96_150s_TO);
-    ok=_parser.send("AT+QIOPEN=%d,%d,\"%s\",\"%s\",%d,0,0\r", _contextID, id, stype, addr, port) && _parser.recv("OK");
-    if (ok) { 
-        ok = _parser.recv(cmd, &err) && err == 0;
-    } else {
-        ok = false;
-    }
-    _parser.set_timeout(BG96_AT_TIMEOUT);
+    if( _sslctx_cfg[sslctx_id] == hash ) {
+        _bg96_mutex.unlock();
+        return NSAPI_ERROR_OK;
+        }
+    rc = send_batch(cmds, n, BG96_AT_TIMEOUT);
+    if( rc == NSAPI_ERROR_OK && _ssl_session_cache != 0 && (profile->session_cache || _ssl_session_cache > 0) ) {
+        _parser.set_timeout(3000);
+        bool ok = _parser.send("AT+QSSLCFG=\"session\",%d,%d", sslctx_id, profile->session_cache? 1:0) && _recv_final();
+        _parser.set_timeout(BG96_AT_TIMEOUT);
+        if( _ssl_session_cache < 0 ) {
+            _ssl_session_cache = ok? 1 : 0;
+            debug("BG96: TLS session cache %s\r\n", ok? "supported":"not supported by this firmware");
+            }
+        }
+    _sslctx_cfg[sslctx_id] = (rc == NSAPI_ERROR_OK)? hash : 0;
     _bg96_mutex.unlock();
-    if( ok )
-        while( recv(id, cmd, sizeof(cmd)) )
-            /* clear out any residual data in BG96 buffer */;
-
-    return ok;
+    debug("BG96: SSL context %d %s profile %s\r\n", sslctx_id, rc == NSAPI_ERROR_OK? "uses":"failed to apply", profile->name);
+    return rc;
 }
 
 /** ----------------------------------------------------------
-* @brief  get last error code
-* @param  none.
-* @retval returns true/false if successful and updated error string
+* @brief  set one numeric AT+QSSLCFG option, the context no
+*         longer matches the profile applied to it
+* @param  option name
+* @param  SSL context
+* @param  value
+* @retval 1 on success, 0 on failure
 */
-bool BG96::getError(char *str)
+int BG96::configure_ssl_option(const char *option, int sslctx_id, int value)
 {
-    char lstr[MAX_ERROR_DESCRIPTION_LENGTH];
-    int  err;
-    memset(lstr,0x00,sizeof(lstr));
+    bool done;
+
+    if( sslctx_id < 0 || sslctx_id >= BG96_SSLCTX_MAX )
+        return 0;
     _bg96_mutex.lock();
-    bool done = (_parser.send("AT+QIGETERROR") 
-              && _parser.recv("+QIGETERROR: %d,%[^\\n]",&err,lstr)
-              && _parser.recv("OK") );
+    _sslctx_cfg[sslctx_id] = 0;
+    _parser.set_timeout(3000);
+    _cme_error = 0;
+    done = _parser.send("AT+QSSLCFG=\"%s\",%d,%d", option, sslctx_id, value) && _parser.recv("OK");
+    _set_op_error(BG96_OP_SSL, done);
+    _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
-    if( done )
-        sprintf(str,"Error:%d",err);
     return done;
 }
 
-bool BG96::getError(BG96_ERROR &error)
+int BG96::configure_ciphersuite(int sslctx_id, const char *suite)
 {
+    bool done;
+
+    if( suite == NULL || sslctx_id < 0 || sslctx_id >= BG96_SSLCTX_MAX )
+        return 0;
     _bg96_mutex.lock();
-    bool done = (_parser.send("AT+QIGETERROR") 
-              && _parser.recv("+QIGETERROR: %d,%[^\\n]",&(error.errornum),error.description)
-              && _parser.recv("OK") );
+    _sslctx_cfg[sslctx_id] = 0;
+    _parser.set_timeout(3000);
+    _cme_error = 0;
+    done = _parser.send("AT+QSSLCFG=\"ciphersuite\",%d,%s", sslctx_id, suite) && _parser.recv("OK");
+    _set_op_error(BG96_OP_SSL, done);
+    _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return done;
 }
 
-
 /** ----------------------------------------------------------
 * @brief  close the BG96 socket
 * @param  id of BG96 socket
@@ -653,8 +2310,14 @@ bool BG96::close(int id)
     bool  done=false;
 
     _bg96_mutex.lock();
-    _parser.set_timeout(BG96_150s_TO);
-    done = (_parser.send("AT+QICLOSE=%d,%d", id, BG96_CLOSE_TO) && _parser.recv("OK"));
+    uint64_t start = Kernel::get_ms_count();
+    _parser.set_timeout(_cmd_timeout(BG96_CMD_QICLOSE));
+    _cme_error = 0;
+    done = (_parser.send("AT+QICLOSE=%d,%d", id, BG96_CLOSE_TO) && _recv_final());
+    if( done )
+        _cmd_latency(BG96_CMD_QICLOSE, start);
+    else if( _cme_error == 0 )
+        _cmd_expired(BG96_CMD_QICLOSE);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return done;
@@ -761,7 +2424,12 @@ bool BG96::isPowerOn()
 
 bool BG96::powerOnGNSS()
 {
-    if (isPowerOn()) return true;
+    if (isPowerOn()) {
+        _bg96_mutex.lock();
+        bool done = _boot_finish();         //GNSS settings still pending after startup()
+        _bg96_mutex.unlock();
+        return done;
+        }
     if (!BG96Ready()) return false;
     return configureGNSS();
 }
@@ -773,50 +2441,21 @@ void BG96::powerOffGNSS()
 
 bool BG96::configureGNSS()
 {
-    // _bg96_mutex.lock();
-    // bool done = ( _parser.send("AT+QGPSCFG=%s,%s","\"outport\"", "\"usbnmea\"") && _parser.recv("OK") );
-    // if (done) {
-    //     done = ( _parser.send("AT+QGPSCFG=%s,%d","\"nmeasrc\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_NMEASRC) && _parser.recv("OK") );
-    // } else {
-    //     return done;
-    // }
-    // if (done) {
-    //     done = ( _parser.send("AT+QGPSCFG=%s,%d","\"gpsnmeatype\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GPSNMNEATYPE) && _parser.recv("OK") );
-    // } else {
-    //     return done;
-    // }
-    // if (done) {
-    //     done = ( _parser.send("AT+QGPSCFG=%s,%d","\"glonassnmeatype\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GLONASSNMNEATYPE) && _parser.recv("OK") );
-    // } else {
-    //     return done;
-    // }
-    // if (done) {
-    //     done = ( _parser.send("AT+QGPSCFG=%s,%d","\"galileonmeatype\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GALILEONMNEATYPE) && _parser.recv("OK") );
-    // } else {
-    //     return done;
-    // }
-    // if (done) {
-    //     done = ( _parser.send("AT+QGPSCFG=%s,%d","\"beidounmeatype\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_BEIDOUNMNEATYPE) && _parser.recv("OK") );
-    // } else {
-    //     return done;
-    // }
-    // if (done) {
-    //     done = ( _parser.send("AT+QGPSCFG=%s,%d", "\"gsvextnmeatype\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GSVEXTNMEATYPE) && _parser.recv("OK") );
-    // } else {
-    //     return done;
-    // }
-    // if (done) {
-    //     done = ( _parser.send("AT+QGPSCFG=%s,%d", "\"gnssconfig\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GNSSCONFIG) && _parser.recv("OK") );
-    // } else {
-    //     return done;
-    // }
-    // if (done) {
-    //     done = ( _parser.send("AT+QGPSCFG=%s,%d", "\"autogps\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_AUTOGPS) && _parser.recv("OK") );
-    // } else {
-    //     return done;
-    // }
-    // _bg96_mutex.unlock();
-    return true;
+    char        cfg[9][48];
+    const char* cmds[9];
+
+    sprintf(cfg[0], "AT+QGPSCFG=\"outport\",\"%s\"", MBED_CONF_BG96_LIBRARY_BG96_GNSS_OUTPORT);
+    sprintf(cfg[1], "AT+QGPSCFG=\"nmeasrc\",%d", MBED_CONF_BG96_LIBRARY_BG96_GNSS_NMEASRC);
+    sprintf(cfg[2], "AT+QGPSCFG=\"gpsnmeatype\",%d", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GPSNMNEATYPE);
+    sprintf(cfg[3], "AT+QGPSCFG=\"glonassnmeatype\",%d", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GLONASSNMNEATYPE);
+    sprintf(cfg[4], "AT+QGPSCFG=\"galileonmeatype\",%d", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GALILEONMNEATYPE);
+    sprintf(cfg[5], "AT+QGPSCFG=\"beidounmeatype\",%d", MBED_CONF_BG96_LIBRARY_BG96_GNSS_BEIDOUNMNEATYPE);
+    sprintf(cfg[6], "AT+QGPSCFG=\"gsvextnmeatype\",%d", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GSVEXTNMEATYPE);
+    sprintf(cfg[7], "AT+QGPSCFG=\"gnssconfig\",%d", MBED_CONF_BG96_LIBRARY_BG96_GNSS_GNSSCONFIG);
+    sprintf(cfg[8], "AT+QGPSCFG=\"autogps\",%d", MBED_CONF_BG96_LIBRARY_BG96_GNSS_AUTOGPS);
+    for (int i = 0; i < 9; i++) cmds[i] = cfg[i];
+
+    return send_batch(cmds, 9, BG96_AT_TIMEOUT) == NSAPI_ERROR_OK;
 }
 
 bool BG96::startGNSS(void)
@@ -829,6 +2468,7 @@ bool BG96::startGNSS(void)
                                                         MBED_CONF_BG96_LIBRARY_BG96_GNSS_FIXCOUNT,
                                                         MBED_CONF_BG96_LIBRARY_BG96_GNSS_FIXRATE
     */
+    _boot_finish();                         //GNSS settings still pending after startup()
     bool done = ( _parser.send("AT+QGPS=1") && _parser.recv("OK") );
     _bg96_mutex.unlock();
     return done;
@@ -846,11 +2486,15 @@ int BG96::isGNSSOn(void)
 {
     int state=0;
     bool done=false;
+    size_t val[2];
+    if( !_query_lead(BG96_QUERY_GNSS, done, val) )
+        return done ? (int)val[0] : -1;
     _bg96_mutex.lock();
     _parser.set_timeout(BG96_1s_WAIT);
     done = (_parser.send("AT+QGPS?") && _parser.recv("+QGPS: %d", &state));
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
+    _query_finish(BG96_QUERY_GNSS, done, state, 0);
     return done ? state : -1;
 }
 
@@ -988,22 +2632,85 @@ int BG96::send_file(const char* content, const char* filename, bool overrideok)
     return good;
 }
 
+/** ----------------------------------------------------------
+* @brief  FNV-1a hash of a credential and its terminating 0
+* @param  PEM text, NULL hashes as ""
+* @param  hash to continue from
+* @retval the hash
+*/
+uint32_t BG96::credentialHash(const char* content, uint32_t hash)
+{
+    if( content == NULL )
+        content = "";
+    do
+        hash = (hash ^ (uint8_t)*content) * 16777619u;
+    while( *content++ );
+    return hash;
+}
+
+/** ----------------------------------------------------------
+* @brief  upload a credential only when its content changed. The
+*         size of the file is checked with AT+QFLST and its FNV-1a
+*         hash against the one saved with the last upload, so an
+*         unchanged PEM costs two short commands instead of a delete
+*         and an upload.
+* @param  PEM text
+* @param  UFS file name
+* @retval 1 if the file holds the content, 0 on failure
+*/
+int BG96::send_credential(const char* content, const char* filename)
+{
+    char     hashfile[96];
+    char     saved[32], cur[32];
+    size_t   fsize=0, hsize=0;
+    size_t   size = strlen(content)+1;          //send_file() also uploads the terminating 0
+    uint32_t hash = credentialHash(content);
+    int16_t  checksum;
+    bool     same;
+
+    snprintf(cur, sizeof(cur), "%u %08lX\n", (unsigned)size, (unsigned long)hash);
+    snprintf(hashfile, sizeof(hashfile), "%s%s", filename, BG96_CRED_HASH_EXT);
+
+    _bg96_mutex.lock();
+    same = fs_file_size(filename, fsize) == NSAPI_ERROR_OK && fsize == size &&
+           fs_file_size(hashfile, hsize) == NSAPI_ERROR_OK && hsize > 0 && hsize < sizeof(saved) &&
+           fs_download_file(hashfile, saved, hsize, checksum) == NSAPI_ERROR_OK;
+    if( same ) {
+        saved[hsize] = 0x00;
+        same = strcmp(saved, cur) == 0;
+        }
+    if( same ) {
+        _bg96_mutex.unlock();
+        debug("BG96: %s unchanged, not uploaded\r\n", filename);
+        return 1;
+        }
+
+    // the old hash goes first so an interrupted upload is never taken as current
+    if( file_exists(hashfile) )
+        delete_file(hashfile);
+    int good = send_file(content, filename, true);
+    if( good && !send_file(cur, hashfile, true) )
+        debug("BG96: Error saving the hash of %s\r\n", filename);
+    _bg96_mutex.unlock();
+    return good;
+}
+
 int BG96::configure_cacert_path(const char* path, int sslctx_id)
 {
     char cmd[128];
     bool done=false;
-    int good = -1;
+    int good = 0;
     sprintf(cmd, "AT+QSSLCFG=\"cacert\",%d,\"%s\"",sslctx_id, path);
     _bg96_mutex.lock();
     _parser.set_timeout(3000);
+    _cme_error = 0;
     done = _parser.send(cmd) && _parser.recv("OK");
+    _set_op_error(BG96_OP_SSL, done);
     if (done) {
         debug("BG96: Successfully configured CA certificate path\r\n");
         good = 1;
     } else {
-        char errstring[20];
-        if (getError(errstring)) sscanf(errstring,"Error:%d",&good);
-        _parser.send("AT+QSSLCFG=?") && _parser.recv("OK");
+        debug("BG96: Error %d configuring CA certificate path\r\n", _op_error[BG96_OP_SSL]);
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();   
@@ -1017,7 +2724,9 @@ int BG96::configure_client_cert_path(const char* path, int sslctx_id)
     int good = 0;
     sprintf(cmd, "AT+QSSLCFG=\"clientcert\",%d,\"%s\"",sslctx_id, path);
     _bg96_mutex.lock();
+    _cme_error = 0;
     done = _parser.send(cmd) && _parser.recv("OK");
+    _set_op_error(BG96_OP_SSL, done);
     if (done) {
         debug("BG96: Successfully configured client certificate path\r\n");
         good = 1;
@@ -1035,7 +2744,9 @@ int BG96::configure_privkey_path(const char* path, int sslctx_id)
     int good = 0;
     sprintf(cmd, "AT+QSSLCFG=\"clientkey\",%d,\"%s\"",sslctx_id, path);
     _bg96_mutex.lock();
+    _cme_error = 0;
     done = _parser.send(cmd) && _parser.recv("OK");
+    _set_op_error(BG96_OP_SSL, done);
     if (done) {
         debug("BG96: Successfully configured client key path\r\n");
         good = 1;
@@ -1058,17 +2769,30 @@ int BG96::sslopen(const char* hostname, int port, int pdp_ctx, int client_id, in
         return 0;
     }
 
-    if (pdp_ctx <1 || pdp_ctx > 11) {
+    pdp_ctx = _pdp_id(pdp_ctx);
+    if (pdp_ctx <1 || pdp_ctx > 16) {
         debug("BG96: Wrong PDP Context ID.\r\n");
         return 0;
     }
 
     sprintf(cmd, "AT+QSSLOPEN=%d,%d,%d,\"%s\",%d", pdp_ctx, client_id, sslctx_id, hostname, port);
     _bg96_mutex.lock();
-    _parser.set_timeout(BG96_150s_TO);
-    done =  _parser.send(cmd) && _parser.recv("OK");
-    if (done) _parser.recv("+QSSLOPEN: %d,%d", &cid, &err);
+    _ssl_rx &= ~(1u << client_id);
+    _ssl_closed &= ~(1u << client_id);
+    uint64_t start = Kernel::get_ms_count();
+    _parser.set_timeout(_cmd_timeout(BG96_CMD_QSSLOPEN));
+    _cme_error = 0;
+    done =  _parser.send(cmd) && _recv_final();
+    _wd_check(done);
+    if (done) {
+        if (_parser.recv("+QSSLOPEN: %d,%d", &cid, &err))
+            _cmd_latency(BG96_CMD_QSSLOPEN, start);
+        else
+            _cmd_expired(BG96_CMD_QSSLOPEN);
+    }
+    if (done && err != 0) _cme_error = err;    //open failed after OK, keep the <err> it reported
     if (err != 0) done=false; 
+    _set_op_error(BG96_OP_SSL, done);
     if (!done) {
         debug("BG96: Error opening TLS socket to host %s\r\n", hostname);
     }
@@ -1077,65 +2801,77 @@ int BG96::sslopen(const char* hostname, int port, int pdp_ctx, int client_id, in
     return done;
 }
 
+/** ----------------------------------------------------------
+* @brief  check that the BG96 still has a TLS connection open with
+*         AT+QSSLSTATE. Without a connection it only answers OK; the
+*         final line is always read so it is not taken as the answer
+*         to the next command
+* @param  client id of the TLS connection
+* @retval true if the connection is listed as connected (state 2)
+*/
 bool BG96::ssl_client_status(int client_id)
 {
     bool done=false;
-    int id = -1;
-    int remoteport, localport;
-    int socket_state;
-    int pdp_id, server_id, ssl_id;
-    int access_mode;
-    char dummy[10];
-    char ATport[26];
-    char ip[26];
-    _bg96_mutex.lock();
-    _parser.set_timeout(BG96_60s_TO);
-    if(_parser.send("AT+QSSLSTATE=%d", client_id))
-    _parser.recv("+QSSLSTATE:%d,\"%[^\"]\",\"%[^\"]\",%d,%d,%d,%d,%d,%d,\"%[^\"]\",%d",
-                        &id,dummy,ip,&remoteport,&localport,&socket_state,
-                        &pdp_id,&server_id,&access_mode,ATport,&ssl_id);
+    int  id=-1, socket_state=-1;
+    char resp[128];
+
+    _bg96_mutex.lock();
+    _parser.set_timeout(3000);
+    _cme_error = 0;
+    if( _parser.send("AT+QSSLSTATE=%d", client_id) ) {
+        while( _parser.recv("%127[^\n]\n", resp) ) {
+            if( strncmp(resp, "+QSSLSTATE:", 11) == 0 ) {
+                // <clientID>,"SSLClient",<IP>,<remote port>,<local port>,<socket state>,...
+                done = sscanf(resp, "+QSSLSTATE: %d,\"%*[^\"]\",\"%*[^\"]\",%*d,%*d,%d", &id, &socket_state) == 2;
+                done = _recv_final() && done;
+                break;
+                }
+            if( strcmp(resp, "OK") == 0 || strcmp(resp, "ERROR") == 0 || strncmp(resp, "+CME ERROR", 10) == 0 )
+                break;
+            }
+        }
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
-    // debug("TLSState: \r\n");
-    // debug("Client ID: %d\r\n", id);
-    // debug("Server IP: %s\r\n", ip);
-    // debug("Remote Port: %d\r\n", remoteport);
-    // debug("Local Port: %d\r\n", localport);
-    // debug("Socket State: %d\r\n", socket_state);
-    // debug("Access_mode: %d\r\n", access_mode);
-    // debug("AT Port: %s\r\n", ATport);
-    if (done && id == client_id && socket_state == 2) return true;
-    return false;
-
+    return done && id == client_id && socket_state == 2;
 }
 
 int BG96::sslsend(int client_id, const void * data, uint32_t amount)
 {
-    int size=-1;
-     
-    _bg96_mutex.lock();
-    _parser.set_timeout(BG96_TX_TIMEOUT);
-
-    if ( _parser.send("AT+QSSLSEND=%d,%ld", client_id, amount) && _parser.recv(">") )
-        size = _parser.write((char*)data, (int)amount);
-    _parser.recv("SEND OK");
-    _parser.set_timeout(BG96_AT_TIMEOUT);
-    _bg96_mutex.unlock();
-
-    return size;
+    return sslsend(client_id, data, amount, BG96_TX_TIMEOUT);
 }
 
+/** ----------------------------------------------------------
+* @brief  send one chunk on a TLS socket
+* @param  client_id of BG96 TLS socket
+* @param  pointer to the data to send
+* @param  number of bytes, cut to BG96_SSL_SEND_MAX
+* @param  ms to wait for the BG96
+* @retval bytes sent, 0 if the BG96 send buffer is full, -1 on error
+*/
 int BG96::sslsend(int client_id, const void * data, uint32_t amount, int timeout)
 {
-    int size = -1;
+    int  size = -1;
+    char resp[32];
      
+    if (amount > BG96_SSL_SEND_MAX)
+        amount = BG96_SSL_SEND_MAX;
     _bg96_mutex.lock();
     _parser.set_timeout(timeout);
-
-    _parser.send("AT+QSSLSEND=%d,%ld", client_id, amount);
-    if (_parser.recv(">")) {
-        size = _parser.write((char*)data, (int)amount);
-        _parser.recv("SEND OK");
+    _cme_error = 0;
+    if (_parser.send("AT+QSSLSEND=%d,%ld", client_id, amount) && _parser.recv(">") &&
+        _parser.write((char*)data, (int)amount) == (int)amount) {
+        while (_parser.recv("%31[^\n]\n", resp)) {
+            if (strcmp(resp, "SEND OK") == 0) {
+                size = amount;
+                break;
+            }
+            if (strcmp(resp, "SEND FAIL") == 0) {
+                size = 0;
+                break;
+            }
+            if (strcmp(resp, "ERROR") == 0 || strncmp(resp, "+CME ERROR", 10) == 0)
+                break;
+        }
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
@@ -1144,24 +2880,49 @@ int BG96::sslsend(int client_id, const void * data, uint32_t amount, int timeout
 }
 
 /** ----------------------------------------------------------
-* @brief  check if RX data has arrived on TLS socket
+* @brief  check if RX data has arrived on TLS socket, from the
+*         URCs already received
 * @param  client_id of BG96 TLS socket
 * @retval true/false
 */
 bool BG96::sslChkRxAvail(int client_id)
 {
-    char  cmd[20];
-    sprintf(cmd, "+QSSLURC: \"recv\",%d", client_id);
+    if( client_id < 0 || client_id >= BG96_SOCKET_MAX )
+        return false;
     _bg96_mutex.lock();
-    _parser.set_timeout(1);
-    bool i = _parser.recv(cmd);
-    _parser.set_timeout(BG96_AT_TIMEOUT);
+    _process_urcs();
+    bool i = (_ssl_rx & (1u << client_id)) != 0;
     _bg96_mutex.unlock();
     return i;
 }
 
 /** ----------------------------------------------------------
-* @brief  receive data from BG96
+* @brief  wait for data on a TLS socket
+* @param  client_id of BG96 TLS socket
+* @param  time to give up at, in Kernel::get_ms_count() ms
+* @retval 1 if data is waiting, 0 on timeout, -1 if closed
+*/
+int BG96::sslWaitRx(int client_id, uint64_t deadline)
+{
+    int rc;
+
+    if( client_id < 0 || client_id >= BG96_SOCKET_MAX )
+        return -1;
+    uint16_t bit = 1u << client_id;
+    while( true ) {
+        _bg96_mutex.lock();
+        _process_urcs();                            //other URCs arriving meanwhile go to their handlers
+        rc = (_ssl_rx & bit)? 1 : (_ssl_closed & bit)? -1 : 0;
+        _bg96_mutex.unlock();
+        if( rc != 0 || Kernel::get_ms_count() >= deadline )
+            return rc;
+        wait_ms(BG96_URC_POLL);                     //the BG96 is free for other threads meanwhile
+        }
+}
+
+/** ----------------------------------------------------------
+* @brief  receive data from BG96. The data signalled flag is
+*         cleared once the BG96 buffer is read empty.
 * @param  id of BG96 socket
 * @param  pointer to location to store returned data
 * @param  count of the number of bytes to get
@@ -1169,10 +2930,10 @@ bool BG96::sslChkRxAvail(int client_id)
 */
 int32_t BG96::sslrecv(int client_id, void *data, uint32_t cnt)
 {
-    int  rxCount, ret_cnt=0;
-
+    int  rxCount=-1, ret_cnt=0;
 
-    sslChkRxAvail(client_id);
+    if( client_id < 0 || client_id >= BG96_SOCKET_MAX )
+        return 0;
 
     _bg96_mutex.lock();
     _parser.set_timeout(BG96_RX_TIMEOUT);
@@ -1187,6 +2948,8 @@ int32_t BG96::sslrecv(int client_id, void *data, uint32_t cnt)
             ret_cnt = rxCount;
         }  
     }
+    if( rxCount >= 0 && rxCount < (int)cnt )
+        _ssl_rx &= ~(1u << client_id);          //buffer read empty, the next data raises a new URC
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return ret_cnt;
@@ -1202,8 +2965,12 @@ bool BG96::sslclose(int client_id)
     bool  done=false;
 
     _bg96_mutex.lock();
-    _parser.set_timeout(BG96_60s_TO); //10s network response time
-    done = (_parser.send("AT+QSSLCLOSE=%d,%d", client_id, BG96_CLOSE_TO) && _parser.recv("OK"));
+    uint64_t start = Kernel::get_ms_count();
+    _parser.set_timeout(_cmd_timeout(BG96_CMD_QSSLCLOSE));
+    _cme_error = 0;
+    done = (_parser.send("AT+QSSLCLOSE=%d,%d", client_id, BG96_CLOSE_TO) && _recv_final());
+    if (done) _cmd_latency(BG96_CMD_QSSLCLOSE, start);
+    else if (_cme_error == 0) _cmd_expired(BG96_CMD_QSSLCLOSE);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return done;
@@ -1217,17 +2984,37 @@ int BG96::mqtt_open(const char* hostname, int port)
 
     sprintf(cmd, "AT+QMTOPEN=%d,\"%s\",%d", 0, hostname, port);
 
+    core_util_atomic_incr_u32(&_mqtt_waiting, 1);
     _bg96_mutex.lock();
-    _parser.set_timeout(10000);
-    if (_parser.send(cmd) && _parser.recv("OK")) {
-        _parser.recv("+QMTOPEN: %d,%d\r\n", &id, &rc);
+    if (_cancel_mqtt) {                     //cancelled while waiting for the driver
+        _cancel_mqtt = false;
+        core_util_atomic_decr_u32(&_mqtt_waiting, 1);
+        _bg96_mutex.unlock();
+        return -1;
+    }
+    uint64_t start = Kernel::get_ms_count();
+    int      to = _cmd_timeout(BG96_CMD_QMTOPEN);
+    _parser.set_timeout(to);
+    _cme_error = 0;
+    if (_parser.send(cmd) && _recv_final()) {
+        _set_op_error(BG96_OP_MQTT_OPEN, true);
+        if (_wait_urc(to, &_cancel_mqtt, "+QMTOPEN: %d,%d\r\n", &id, &rc))
+            _cmd_latency(BG96_CMD_QMTOPEN, start);
+        else if (!_cancel_mqtt)
+            _cmd_expired(BG96_CMD_QMTOPEN);
+        if (_cancel_mqtt) {
+            debug("BG96: MQTT open cancelled\r\n");
+            _parser.set_timeout(BG96_AT_TIMEOUT);
+            _parser.send("AT+QMTCLOSE=0") && _parser.recv("OK");
+            rc = -1;
+        }
     } else {
-        char errstring[15];
-        _parser.set_timeout(BG96_AT_TIMEOUT);
-        _bg96_mutex.unlock();   
-        if(getError(errstring)) sscanf(errstring, "Error:%d", &rc);
-        return rc;
+        _set_op_error(BG96_OP_MQTT_OPEN, false);
+        rc = _op_error[BG96_OP_MQTT_OPEN];
+        _wd_check(false);
     }
+    _cancel_mqtt = false;                   //a cancel only applies to the operation it stopped
+    core_util_atomic_decr_u32(&_mqtt_waiting, 1);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return rc;
@@ -1255,16 +3042,219 @@ int BG96::send_generic_cmd(const char* cmd, int timeout)
     if (cmd == NULL) return NSAPI_ERROR_PARAMETER;
     _bg96_mutex.lock();
     _parser.set_timeout(timeout);
-    rc = _parser.send(cmd) && _parser.recv("OK");
+    _cme_error = 0;
+    rc = _parser.send(cmd) && _recv_final();
+    _set_op_error(BG96_OP_GENERIC, rc);
+    _wd_check(rc);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
-    if (rc < 0) {
-        char errstring[15];
-        if (getError(errstring)) sscanf(errstring, "Error:%d", &rc);
-    }
     return rc;
 }
 
+/** ----------------------------------------------------------
+* @brief  p99 of the latencies recorded for a command. With at most
+*         BG96_CMD_SAMPLES (16) samples the p99 rank is the last one,
+*         so this is the slowest recent latency; the name is kept for
+*         when more samples are kept. The driver mutex must be held.
+* @param  the command
+* @retval latency in ms, -1 if there are not enough samples
+*/
+int BG96::_cmd_p99(BG96_CMD cmd)
+{
+    uint32_t lat[BG96_CMD_SAMPLES];
+    int      n = _cmd_count[cmd];
+
+    if( n < BG96_CMD_MIN_SAMPLES )
+        return -1;
+    memcpy(lat, _cmd_lat[cmd], n*sizeof(uint32_t));
+    for( int i=1; i<n; i++ ) {          //insertion sort, n is small
+        uint32_t v = lat[i];
+        int      k = i;
+        for( ; k>0 && lat[k-1] > v; k-- )
+            lat[k] = lat[k-1];
+        lat[k] = v;
+        }
+    return (int)lat[(n*99+99)/100 - 1];
+}
+
+/** ----------------------------------------------------------
+* @brief  timeout to use for a command: a margin over the p99 of
+*         its recent latencies, kept between the command floor and
+*         its documented maximum. The maximum is used until enough
+*         latencies are known. The driver mutex must be held.
+* @param  the command
+* @retval timeout in ms
+*/
+int BG96::_cmd_timeout(BG96_CMD cmd)
+{
+    int p99 = MBED_CONF_BG96_LIBRARY_BG96_ADAPTIVE_TIMEOUTS? _cmd_p99(cmd) : -1;
+
+    if( p99 < 0 )
+        return bg96_cmd_limits[cmd].ceiling;
+    p99 *= BG96_CMD_MARGIN;
+    if( p99 < bg96_cmd_limits[cmd].floor )
+        return bg96_cmd_limits[cmd].floor;
+    if( p99 > bg96_cmd_limits[cmd].ceiling )
+        return bg96_cmd_limits[cmd].ceiling;
+    return p99;
+}
+
+/** ----------------------------------------------------------
+* @brief  record the latency of a command that was answered. The
+*         driver mutex must be held.
+* @param  the command
+* @param  Kernel::get_ms_count() when the command was sent
+* @retval none
+*/
+void BG96::_cmd_latency(BG96_CMD cmd, uint64_t start)
+{
+    _cmd_lat[cmd][_cmd_next[cmd]] = (uint32_t)(Kernel::get_ms_count() - start);
+    _cmd_next[cmd] = (_cmd_next[cmd]+1) % BG96_CMD_SAMPLES;
+    if( _cmd_count[cmd] < BG96_CMD_SAMPLES )
+        _cmd_count[cmd]++;
+}
+
+/** ----------------------------------------------------------
+* @brief  a command was not answered in time. The latencies are
+*         dropped so the documented maximum is used until new ones
+*         are learned, a slower link is not timed out again. The
+*         driver mutex must be held.
+* @param  the command
+* @retval none
+*/
+void BG96::_cmd_expired(BG96_CMD cmd)
+{
+    _cmd_count[cmd] = 0;
+    _cmd_next[cmd] = 0;
+}
+
+/** ----------------------------------------------------------
+* @brief  copy the timeout used for a command and its statistics
+* @param  the command
+* @param  structure to receive the values
+* @retval none
+*/
+void BG96::getCommandTiming(BG96_CMD cmd, BG96_CMD_TIMING &timing)
+{
+    _bg96_mutex.lock();
+    timing.ceiling = bg96_cmd_limits[cmd].ceiling;
+    timing.timeout = _cmd_timeout(cmd);
+    timing.p99     = _cmd_p99(cmd);
+    timing.samples = _cmd_count[cmd];
+    _bg96_mutex.unlock();
+}
+
+/** ----------------------------------------------------------
+* @brief  wait for a URC in short slices so another thread can
+*         cancel the wait. The driver mutex must be held.
+* @param  ms to wait
+* @param  flag set by the thread that cancels the wait
+* @param  format and arguments as for ATCmdParser::recv
+* @retval true if the URC was received, false on timeout or cancel
+*/
+bool BG96::_wait_urc(int timeout, volatile bool *cancel, const char *fmt, ...)
+{
+    Timer   t;
+    bool    ok=false;
+    va_list args;
+
+    _parser.set_timeout(BG96_CANCEL_POLL);
+    t.start();
+    while( !ok && !*cancel && t.read_ms() < timeout ) {
+        va_start(args, fmt);
+        ok = _parser.vrecv(fmt, args);
+        va_end(args);
+        }
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    return ok;
+}
+
+/** ----------------------------------------------------------
+* @brief  wait for the final result of a command, skipping any
+*         echo or intermediate lines. A plain ERROR sets _cme_error
+*         to -1, so the watchdog tells it from a BG96 that did not
+*         answer
+* @param  none
+* @retval true if OK was received, false on ERROR or timeout
+*/
+bool BG96::_recv_final(void)
+{
+    char resp[64];
+
+    while( _parser.recv("%63[^\n]\n", resp) ) {
+        if( strcmp(resp, "OK") == 0 )
+            return true;
+        if( strcmp(resp, "ERROR") == 0 || strncmp(resp, "+CME ERROR", 10) == 0 ) {
+            if( _cme_error == 0 )
+                _cme_error = -1;                        //an error reply, not a BG96 that stopped answering
+            return false;
+            }
+        }
+    return false;
+}
+
+/** ----------------------------------------------------------
+* @brief  send a batch of configuration commands in one transaction.
+*         Commands are joined on as few lines as possible, when a
+*         joined line fails its commands are replayed one at a time
+*         so every command is still attempted and the failing one
+*         can be reported.
+* @param  array of commands, each starting with "AT"
+* @param  number of commands
+* @param  timeout for each command line
+* @param  true to join commands, false to send them back to back
+* @param  receives the index of the first failing command or -1
+* @retval NSAPI_ERROR_OK if all commands succeeded
+*/
+int BG96::send_batch(const char **cmds, int count, int timeout, bool join, int *failed)
+{
+    char line[BG96_BATCH_LINE_MAX];
+    int  first_failed = -1;
+    int  i=0;
+
+    if (cmds == NULL || count < 1) return NSAPI_ERROR_PARAMETER;
+
+    _bg96_mutex.lock();
+    _parser.set_timeout(timeout);
+    while( i < count ) {
+        int    first = i;
+        size_t len = strlen(cmds[i]);
+
+        if( len >= sizeof(line) ) {
+            i++;
+            if( first_failed < 0 ) first_failed = first;
+            continue;
+        }
+        strcpy(line, cmds[i++]);
+        while( join && i < count && len + strlen(cmds[i]) - 1 < sizeof(line) ) {
+            line[len++] = ';';                  //AT+A;+B, the "AT" of the next command is dropped
+            strcpy(&line[len], cmds[i]+2);
+            len += strlen(cmds[i]+2);
+            i++;
+        }
+
+        if( _parser.send("%s", line) && _recv_final() )
+            continue;
+
+        if( i-first == 1 ) {
+            if( first_failed < 0 ) first_failed = first;
+            continue;
+        }
+        for( int k=first; k<i; k++ ) {
+            if( !(_parser.send("%s", cmds[k]) && _recv_final()) && first_failed < 0 )
+                first_failed = k;
+        }
+    }
+    _parser.set_timeout(BG96_AT_TIMEOUT);
+    _bg96_mutex.unlock();
+
+    if( failed != NULL )
+        *failed = first_failed;
+    if( first_failed >= 0 )
+        debug("BG96: batch command %d failed: %s\r\n", first_failed, cmds[first_failed]);
+    return (first_failed < 0) ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
+}
+
 int BG96::mqtt_connect(int sslctx_id, const char* clientid,
                                       const char* username,
                                       const char* password,
@@ -1276,19 +3266,42 @@ int BG96::mqtt_connect(int sslctx_id, const char* clientid,
     int rc=-1;
 
     sprintf(cmd, "AT+QMTCONN=%d,\"%s\",\"%s\",\"%s\"", sslctx_id, clientid, username, password);
+    core_util_atomic_incr_u32(&_mqtt_waiting, 1);
     _bg96_mutex.lock();
-    _parser.set_timeout(45000);
-    rc = _parser.send(cmd) && _parser.recv("OK");
-    if (!rc) {
-        char errstring[15];
-        _parser.set_timeout(BG96_AT_TIMEOUT);
+    if (_cancel_mqtt) {                     //cancelled while waiting for the driver
+        _cancel_mqtt = false;
+        core_util_atomic_decr_u32(&_mqtt_waiting, 1);
         _bg96_mutex.unlock();
-        if (getError(errstring)) sscanf(errstring, "Error:%d", &result.rc);
         result.result = -1;
-        return rc;
+        result.rc = -1;
+        return 0;
+    }
+    uint64_t start = Kernel::get_ms_count();
+    int      to = _cmd_timeout(BG96_CMD_QMTCONN);
+    _parser.set_timeout(to);
+    _cme_error = 0;
+    rc = _parser.send(cmd) && _recv_final();
+    _set_op_error(BG96_OP_MQTT_CONNECT, rc);
+    _wd_check(rc);
+    if (!rc) {
+        result.rc = _op_error[BG96_OP_MQTT_CONNECT];
+        result.result = -1;
     } else {
-        _parser.recv("+QMTCONN:%d,%d,%d", &id, &result.result, &result.rc);
+        if (_wait_urc(to, &_cancel_mqtt, "+QMTCONN:%d,%d,%d", &id, &result.result, &result.rc))
+            _cmd_latency(BG96_CMD_QMTCONN, start);
+        else if (!_cancel_mqtt)
+            _cmd_expired(BG96_CMD_QMTCONN);
+        if (_cancel_mqtt) {
+            debug("BG96: MQTT connect cancelled\r\n");
+            _parser.set_timeout(BG96_AT_TIMEOUT);
+            _parser.send("AT+QMTCLOSE=%d", sslctx_id) && _parser.recv("OK");
+            result.result = -1;
+            result.rc = -1;
+            rc = 0;
+        }
     }
+    _cancel_mqtt = false;                   //a cancel only applies to the operation it stopped
+    core_util_atomic_decr_u32(&_mqtt_waiting, 1);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return rc;    
@@ -1307,8 +3320,14 @@ int BG96::mqtt_disconnect(int mqtt_id)
  {
     int rc=-1;
     _bg96_mutex.lock();
-    _parser.set_timeout(15000);
-    if (_parser.send("AT+QMTSUB=%d,%d,\"%s\",%d", mqtt_id, msg_id, topic, qos) && _parser.recv("OK")) rc = NSAPI_ERROR_OK;
+    uint64_t start = Kernel::get_ms_count();
+    _parser.set_timeout(_cmd_timeout(BG96_CMD_QMTSUB));
+    _cme_error = 0;
+    if (_parser.send("AT+QMTSUB=%d,%d,\"%s\",%d", mqtt_id, msg_id, topic, qos) && _recv_final()) {
+        rc = NSAPI_ERROR_OK;
+        _cmd_latency(BG96_CMD_QMTSUB, start);
+    } else if (_cme_error == 0)
+        _cmd_expired(BG96_CMD_QMTSUB);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return rc;
@@ -1318,8 +3337,14 @@ int BG96::mqtt_disconnect(int mqtt_id)
  {
     int rc=-1;
     _bg96_mutex.lock();
-    _parser.set_timeout(15000);
-    if (_parser.send("AT+QMTUNS=%d,%d,\"%s\"", mqtt_id, msg_id, topic) && _parser.recv("OK")) rc = NSAPI_ERROR_OK;
+    uint64_t start = Kernel::get_ms_count();
+    _parser.set_timeout(_cmd_timeout(BG96_CMD_QMTSUB));
+    _cme_error = 0;
+    if (_parser.send("AT+QMTUNS=%d,%d,\"%s\"", mqtt_id, msg_id, topic) && _recv_final()) {
+        rc = NSAPI_ERROR_OK;
+        _cmd_latency(BG96_CMD_QMTSUB, start);
+    } else if (_cme_error == 0)
+        _cmd_expired(BG96_CMD_QMTSUB);
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
     return rc;  
@@ -1333,7 +3358,8 @@ int BG96::mqtt_publish(int mqtt_id, int msg_id, int qos, int retain, const char*
     bool done;
      
     _bg96_mutex.lock();
-    _parser.set_timeout(BG96_60s_TO);
+    uint64_t start = Kernel::get_ms_count();
+    _parser.set_timeout(_cmd_timeout(BG96_CMD_QMTPUB));
 
     done = _parser.send("AT+QMTPUB=%d,%d,%d,%d,\"%s\"", mqtt_id, msg_id, qos, retain, topic); 
     if( done && _parser.recv(">") ) {
@@ -1354,11 +3380,15 @@ int BG96::mqtt_publish(int mqtt_id, int msg_id, int qos, int retain, const char*
         done = sent;
     } else { 
         done = false;
-        return rc;
     }
-    if ( done && _parser.recv("+QMTPUB: %d,%d,%d", &id, &mid, &res) && res == 0 ) {
-        debug("successfully published data.\r\n");
-        rc = 1;
+    if ( done && _parser.recv("+QMTPUB: %d,%d,%d", &id, &mid, &res) ) {
+        _cmd_latency(BG96_CMD_QMTPUB, start);
+        if (res == 0) {
+            debug("successfully published data.\r\n");
+            rc = 1;
+        }
+    } else if (done) {
+        _cmd_expired(BG96_CMD_QMTPUB);
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
     _bg96_mutex.unlock();
@@ -1390,10 +3420,25 @@ int BG96::getLatesSyncTime(char *gmttime, int *dst)
 void* BG96::mqtt_checkAvail(int mqtt_id)
 {
     MQTTMessage* msg;
-    int id, msg_id;
+    int id=-1, i=0;
+    uint64_t deadline = Kernel::get_ms_count() + 1000;
+
     _bg96_mutex.lock();
-    _parser.set_timeout(1000);
-    int i = _parser.recv("+QMTRECV: %d,%d,\"%256[^\"]\",%s\n", &id, &msg_id, mqtt_topic, mqtt_payload);
+    _process_urcs();
+    while( _mqtt_rxq_count == 0 && Kernel::get_ms_count() < deadline ) {
+        _bg96_mutex.unlock();
+        wait_ms(BG96_URC_POLL);
+        _bg96_mutex.lock();
+        _process_urcs();
+    }
+    if( _mqtt_rxq_count > 0 ) {
+        id = _mqtt_rxq[_mqtt_rxq_head].id;
+        strcpy(mqtt_topic, _mqtt_rxq[_mqtt_rxq_head].topic);
+        strcpy(mqtt_payload, _mqtt_rxq[_mqtt_rxq_head].payload);
+        _mqtt_rxq_head = (_mqtt_rxq_head+1) % BG96_MQTT_RXQ_SIZE;
+        _mqtt_rxq_count--;
+        i = 1;
+    }
     
     if (i && id == mqtt_id) {
         msg = &mqtt_msg;
@@ -1424,14 +3469,23 @@ int BG96::fs_size(size_t &free_size, size_t &total_size)
 {
     bool done;
     int rc;
+    size_t val[2];
+    if( !_query_lead(BG96_QUERY_FS_SIZE, done, val) ) {
+        free_size  = val[0];
+        total_size = val[1];
+        return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR ;
+        }
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(2000);
     done = _parser.send("AT+QFLDS=\"UFS\"");
     if (done) {
        done = _parser.recv("+QFLDS: %u,%u", &free_size, &total_size) && _parser.recv("OK");
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
+    _query_finish(BG96_QUERY_FS_SIZE, done, free_size, total_size);
     return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR ;
 }
 
@@ -1440,12 +3494,14 @@ int BG96::fs_nfiles(int &nfiles, size_t &sfiles)
     bool done;
     int rc;
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(2000);
     done = _parser.send("AT+QFLDS");
     if (done) {
        done = _parser.recv("+QFLDS: %u,%d", &sfiles, &nfiles) && _parser.recv("OK");
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
 }
@@ -1456,12 +3512,14 @@ int BG96::fs_file_size(const char *filename, size_t &filesize)
     char dummy[80];
     int rc;
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(2000);
     done = _parser.send("AT+QFLST=\"%s\"",filename);
     if (done) {
        done = _parser.recv("+QFLST: \"%80[^\"]\",%u", dummy, &filesize) && _parser.recv("OK");
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR ;
 }
@@ -1471,12 +3529,14 @@ int BG96::fs_delete_file(const char *filename)
     int rc = -1;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(2000);
     done = _parser.send("AT+QFDEL=\"%s\"", filename) && _parser.recv("OK");
     if (done) {
         rc = 0;
     } 
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return rc;
 }
@@ -1490,11 +3550,13 @@ int BG96::fs_upload_file(const char *filename, void *data, size_t &lsize)
     unsigned int checksum=0;
 
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(BG96_1s_WAIT);
     done = _parser.send("AT+QFUPL=\"%s\",%u", filename, lsize) && _parser.recv("CONNECT");
     if (!done) {
         lsize = 0;
         _parser.set_timeout(BG96_AT_TIMEOUT);
+        _set_op_error(BG96_OP_FS, done);
         _bg96_mutex.unlock();
         return -1;
     } else { //We are now in transparent mode, send data to stream 
@@ -1516,6 +3578,7 @@ int BG96::fs_upload_file(const char *filename, void *data, size_t &lsize)
         rc = NSAPI_ERROR_OK;
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return rc;   
 }
@@ -1525,12 +3588,14 @@ int BG96::fs_download_file(const char *filename, void* data, size_t &filesize, i
     int rc;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(2000);
     done = _parser.send("AT+QFDWL=\"%s\"", filename) && _parser.recv("CONNECT");
     if (!done){
         rc = NSAPI_ERROR_DEVICE_ERROR;
         filesize = 0;
         _parser.set_timeout(BG96_AT_TIMEOUT);
+        _set_op_error(BG96_OP_FS, done);
         _bg96_mutex.unlock();
         return rc;
     } else {
@@ -1553,6 +3618,7 @@ int BG96::fs_download_file(const char *filename, void* data, size_t &filesize, i
         rc = NSAPI_ERROR_DEVICE_ERROR;
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return rc;      
 }
@@ -1562,6 +3628,7 @@ int BG96::fs_open(const char *filename, FILE_MODE mode, FILE_HANDLE &fh)
     int rc = NSAPI_ERROR_DEVICE_ERROR;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     done = _parser.send("AT+QFOPEN=\"%s\",%d", filename, mode);
     if (done) {
         FILE_HANDLE fhandle;
@@ -1574,6 +3641,7 @@ int BG96::fs_open(const char *filename, FILE_MODE mode, FILE_HANDLE &fh)
             rc = NSAPI_ERROR_DEVICE_ERROR;
         }
     }
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return rc;
 }
@@ -1583,11 +3651,13 @@ int BG96::fs_read(FILE_HANDLE fh, size_t length, void *data)
     int rc;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(2000);
     done = _parser.send("AT+QFREAD=%ld, %u", fh, length) && _parser.recv("CONNECT");
     if (!done){
         rc = NSAPI_ERROR_DEVICE_ERROR;
         _parser.set_timeout(BG96_AT_TIMEOUT);
+        _set_op_error(BG96_OP_FS, done);
         _bg96_mutex.unlock();
         return rc;
     }
@@ -1602,6 +3672,7 @@ int BG96::fs_read(FILE_HANDLE fh, size_t length, void *data)
         rc = NSAPI_ERROR_DEVICE_ERROR;  
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return rc;
 }
@@ -1611,11 +3682,13 @@ int BG96::fs_write(FILE_HANDLE fh, size_t length, void *data)
     int rc;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(5000);
     done = _parser.send("AT+QFWRITE=%ld, %u", fh, length) && _parser.recv("CONNECT");
     if (!done){
         rc = NSAPI_ERROR_DEVICE_ERROR;
         _parser.set_timeout(BG96_AT_TIMEOUT);
+        _set_op_error(BG96_OP_FS, done);
         _bg96_mutex.unlock();
         return rc;
     }
@@ -1630,6 +3703,7 @@ int BG96::fs_write(FILE_HANDLE fh, size_t length, void *data)
         rc = NSAPI_ERROR_DEVICE_ERROR;
     }
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return rc;    
 }
@@ -1639,8 +3713,10 @@ int BG96::fs_seek(FILE_HANDLE fh, size_t offset, FILE_POS position)
     int rc = NSAPI_ERROR_DEVICE_ERROR;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     done = _parser.send("AT+QFSEEK=%ld,%u,%d", fh, offset, position) && _parser.recv("OK");
     if (done) rc = NSAPI_ERROR_OK;
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return rc;
 }
@@ -1650,6 +3726,7 @@ int BG96::fs_get_offset(FILE_HANDLE fh, size_t &offset)
     int rc = NSAPI_ERROR_DEVICE_ERROR;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     done = _parser.send("AT+QFPOSITION=%ld", fh);
     if (done) {
         size_t loff=0;
@@ -1661,6 +3738,7 @@ int BG96::fs_get_offset(FILE_HANDLE fh, size_t &offset)
             rc = NSAPI_ERROR_DEVICE_ERROR;
         }
     }
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return rc;        
 }
@@ -1670,9 +3748,11 @@ int BG96::fs_truncate(FILE_HANDLE fh, size_t offset)
     int rc = NSAPI_ERROR_DEVICE_ERROR;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(2000);
     done = _parser.send("AT+QFTUCAT=%ld", fh) && _parser.recv("OK");
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR ;
 }
@@ -1682,9 +3762,11 @@ int BG96::fs_close(FILE_HANDLE fh)
     int rc = NSAPI_ERROR_DEVICE_ERROR;
     bool done;
     _bg96_mutex.lock();
+    _cme_error = 0;
     _parser.set_timeout(2000);
     done = _parser.send("AT+QFCLOSE=%ld", fh) && _parser.recv("OK");
     _parser.set_timeout(BG96_AT_TIMEOUT);
+    _set_op_error(BG96_OP_FS, done);
     _bg96_mutex.unlock();
     return done ? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR ;
 }
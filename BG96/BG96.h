@@ -55,9 +55,23 @@
 #define BG96_RX_TIMEOUT         1000   //time before a TX timeout occurs
 #define BG96_WAIT4READY         15000  //wait 15 seconds for 'RDY' after reset
 #define BG96_AT_TIMEOUT         1000   //standard AT command timeout
+#define BG96_REG_TO             128000 //time allowed for network registration
+#define BG96_CFUN_TO            15000  //time allowed to switch the radio on or off
+#define BG96_PROBE_TO           300    //time allowed to answer the warm start probe
+#define BG96_PROBE_TRIES        3      //probes sent before the BG96 is power cycled
 #define BG96_WRK_CONTEXT        1      //we will only use context 1 in driver
 #define BG96_CLOSE_TO           1      //wait x seconds for a socket close
 #define BG96_MISC_TIMEOUT       1000
+#define BG96_DNS_QUEUE_SIZE     4      //number of DNS queries that may be outstanding on the BG96
+#define BG96_MQTT_RXQ_SIZE      2      //+QMTRECV messages kept until mqtt_recv() reads them
+#define BG96_URC_POLL           50     //ms between URC checks while waiting on a URC
+#define BG96_URC_TIMEOUT        100    //time allowed to complete a partially received URC
+#define BG96_BATCH_LINE_MAX     256    //longest command line sent when batching commands
+#define BG96_CANCEL_POLL        100    //ms slices used while waiting on a URC that can be cancelled
+#define BG96_SOCKET_MAX         12     //connectIDs the BG96 supports (0-11)
+#define BG96_SSLCTX_MAX         6      //SSL contexts the BG96 supports (0-5)
+#define BG96_PDP_MAX            16     //PDP contexts the BG96 supports (1-16)
+#define BG96_SSL_SEND_MAX       1460   //most bytes one AT+QSSLSEND accepts
 
 #define BG96_MQTT_CLIENT_MAX_PUBLISH_MSG_SIZE 1548
  
@@ -114,6 +128,59 @@
 #define MBED_CONF_BG96_LIBRARY_BG96_GNSS_AUTOGPS                0
 #endif
 
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_STATUS_MAXAGE)
+#define MBED_CONF_BG96_LIBRARY_BG96_STATUS_MAXAGE               10000 //ms a cached IP/registration/RSSI value is reused
+#endif
+
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_STEER_ATTACH)
+#define MBED_CONF_BG96_LIBRARY_BG96_STEER_ATTACH                1     //steer the attach to the last network used
+#endif
+#define BG96_NET_HINT_FILE      "lastnet.txt"                         //UFS file holding the last network used
+#define BG96_CRED_HASH_EXT      ".fnv"                                //suffix of the UFS file holding the hash of an uploaded credential
+
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_ADAPTIVE_TIMEOUTS)
+#define MBED_CONF_BG96_LIBRARY_BG96_ADAPTIVE_TIMEOUTS           1     //learn command timeouts from the observed latencies
+#endif
+#define BG96_CMD_SAMPLES        16     //latencies kept for each command
+#define BG96_CMD_MIN_SAMPLES    8      //latencies needed before the learned timeout is used
+#define BG96_CMD_MARGIN         2      //the learned timeout is this many times the p99 (here the slowest recent) latency
+
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS)
+#define MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS                 4     //TLS sockets the interface can hand out, at most BG96_SSLCTX_MAX
+#endif
+
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_TLS_IDLE_TIMEOUT)
+#define MBED_CONF_BG96_LIBRARY_BG96_TLS_IDLE_TIMEOUT            30000 //ms a released keep-alive TLS connection stays open
+#endif
+
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_MCU_TLS)
+#define MBED_CONF_BG96_LIBRARY_BG96_MCU_TLS                     0     //1 builds BG96McuTLSSocket, mbedTLS on the MCU over BG96 TCP
+#endif
+
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_WD_TIMEOUTS)
+#define MBED_CONF_BG96_LIBRARY_BG96_WD_TIMEOUTS                 2     //unanswered commands before the BG96 is restarted, 0 disables
+#endif
+
+//radio settings applied at startup, "" or -1 leaves the BG96 setting unchanged
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_NWSCANSEQ)
+#define MBED_CONF_BG96_LIBRARY_BG96_NWSCANSEQ                   ""
+#endif
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_NWSCANMODE)
+#define MBED_CONF_BG96_LIBRARY_BG96_NWSCANMODE                  -1
+#endif
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_IOTOPMODE)
+#define MBED_CONF_BG96_LIBRARY_BG96_IOTOPMODE                   -1
+#endif
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_BAND_GSM)
+#define MBED_CONF_BG96_LIBRARY_BG96_BAND_GSM                    ""
+#endif
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_BAND_CATM1)
+#define MBED_CONF_BG96_LIBRARY_BG96_BAND_CATM1                  ""
+#endif
+#if !defined(MBED_CONF_BG96_LIBRARY_BG96_BAND_NB1)
+#define MBED_CONF_BG96_LIBRARY_BG96_BAND_NB1                    ""
+#endif
+
 #if !defined(MBED_CONF_BG96_LIBRARY_BG96_GNSS_GNSSMODE)
 #define MBED_CONF_BG96_LIBRARY_BG96_GNSS_GNSSMODE                1 //CURRENTLY ONLY ONE SUPPORTED BY BG96
 #endif
@@ -139,6 +206,149 @@ typedef struct {
     int rc;
 } ConnectResult;
 
+typedef mbed::Callback<void(nsapi_error_t, const char*)> BG96_DNS_Callback;
+
+typedef enum {
+    BG96_LINK_PDP_DOWN,             //'pdpdeact' URC, the PDP context lost its address
+    BG96_LINK_DEREGISTERED,         //+CEREG/+CGREG reported the BG96 left the network
+    BG96_LINK_REGISTERED,           //+CEREG/+CGREG reported the BG96 registered again
+    BG96_LINK_RESET                 //the watchdog restarted the BG96, contexts and sockets were lost
+} BG96_LINK_EVENT;
+
+typedef mbed::Callback<void(BG96_LINK_EVENT, int)> BG96_Link_Callback;   //event, PDP context id (0 for registration events)
+
+typedef struct {
+    char iccid[24];                 //SIM ICCID, empty if not read yet
+    char imei[20];                  //module IMEI, empty if not read yet
+    char revision[40];              //module model and firmware revision, empty if not read yet
+    char ip[NSAPI_IP_SIZE];         //IP address of the active context, empty if none
+    int  reg_status;                //last +CGREG/+CEREG <stat> value, -1 if unknown
+    int  rssi;                      //last +CSQ <rssi> value, -1 if unknown
+} BG96_STATUS;
+
+typedef struct {
+    char nwscanseq[9];              //RAT search order, e.g. "020301" (Cat.M1, GSM, Cat.NB1), "" if unchanged/unknown
+    int  nwscanmode;                //0 automatic, 1 GSM only, 3 LTE only, -1 if unchanged/unknown
+    int  iotopmode;                 //0 Cat.M1, 1 Cat.NB1, 2 Cat.M1 and Cat.NB1, -1 if unchanged/unknown
+    char band_gsm[9];               //hex band masks, "" if unchanged/unknown
+    char band_catm1[17];
+    char band_nb1[17];
+} BG96_RADIO_CFG;
+
+typedef enum {
+    BG96_CMD_QIACT,                 //AT+QIACT, activate a PDP context
+    BG96_CMD_QIDEACT,               //AT+QIDEACT
+    BG96_CMD_QIOPEN,                //AT+QIOPEN up to the +QIOPEN URC
+    BG96_CMD_QICLOSE,               //AT+QICLOSE
+    BG96_CMD_QIDNSGIP,              //AT+QIDNSGIP up to the 'dnsgip' URC
+    BG96_CMD_QSSLOPEN,              //AT+QSSLOPEN up to the +QSSLOPEN URC
+    BG96_CMD_QSSLCLOSE,             //AT+QSSLCLOSE
+    BG96_CMD_QMTOPEN,               //AT+QMTOPEN up to the +QMTOPEN URC
+    BG96_CMD_QMTCONN,               //AT+QMTCONN up to the +QMTCONN URC
+    BG96_CMD_QMTSUB,                //AT+QMTSUB and AT+QMTUNS
+    BG96_CMD_QMTPUB,                //AT+QMTPUB up to the +QMTPUB URC
+    BG96_CMD_CPIN,                  //AT+CPIN?
+    BG96_CMD_COUNT
+} BG96_CMD;
+
+typedef struct {
+    int ceiling;                    //documented maximum response time, ms
+    int timeout;                    //timeout currently used, ms
+    int p99;                        //p99 of the recent latencies (the slowest of them with 16 samples), -1 if not enough samples
+    int samples;                    //latencies recorded since the last timeout
+} BG96_CMD_TIMING;
+
+typedef struct {
+    uint32_t timeouts;              //commands the BG96 did not answer
+    uint32_t resyncs;               //timeouts after which the BG96 answered AT again
+    uint32_t soft_resets;           //restarts done with AT+CFUN=1,1
+    uint32_t hard_resets;           //restarts that needed the reset pin
+    uint32_t failed;                //restarts after which the BG96 still did not answer
+    uint32_t last_ms;               //duration of the last restart
+    uint32_t max_ms;                //longest restart
+    uint32_t total_ms;              //time spent restarting
+} BG96_WD_STATS;
+
+typedef struct {
+    uint32_t steered;               //registrations reached on the saved network with AT+COPS=4
+    uint32_t steered_ms;            //time those registrations took
+    uint32_t steer_failed;          //steering attempts the BG96 did not complete
+    uint32_t unsteered;             //registrations reached by automatic selection
+    uint32_t unsteered_ms;          //time those registrations took
+} BG96_REG_STATS;
+
+typedef enum {
+    BG96_BOOT_READY,                //RDY after power up, or AT answered on a warm start
+    BG96_BOOT_CONFIG,               //AT+CMEE and radio settings
+    BG96_BOOT_REG_START,            //registration URCs enabled, attach started
+    BG96_BOOT_SIM,                  //AT+CPIN?
+    BG96_BOOT_APN,                  //AT+QICSGP checked and written if needed
+    BG96_BOOT_IDENTITY,             //ICCID and IMEI read into the cache
+    BG96_BOOT_GNSS,                 //AT+QGPSCFG settings
+    BG96_BOOT_REGISTERED,           //+CEREG/+CGREG registered
+    BG96_BOOT_PDP,                  //AT+QIACT
+    BG96_BOOT_COUNT
+} BG96_BOOT_STEP;
+
+typedef struct {
+    int32_t start[BG96_BOOT_COUNT]; //ms from startup() to the start of each step, -1 if it did not run
+    int32_t end[BG96_BOOT_COUNT];   //ms from startup() to the end of each step, -1 if it did not end
+    bool    ok[BG96_BOOT_COUNT];    //result of each step
+} BG96_BOOT_TIMELINE;
+
+typedef struct {
+    char plmn[8];                   //MCC and MNC of the last network, e.g. "20801"
+    int  act;                       //access technology as reported by +COPS (0 GSM, 8 Cat.M1, 9 Cat.NB1)
+    char band[24];                  //band as reported by +QNWINFO
+    char cell[64];                  //serving cell as reported by +QENG="servingcell"
+} BG96_NET_HINT;
+
+typedef enum {
+    BG96_QUERY_RSSI,                //AT+CSQ
+    BG96_QUERY_IP,                  //AT+QIACT?
+    BG96_QUERY_GNSS,                //AT+QGPS?
+    BG96_QUERY_FS_SIZE,             //AT+QFLDS="UFS"
+    BG96_QUERY_COUNT
+} BG96_QUERY;
+
+typedef struct {
+    uint32_t sent[BG96_QUERY_COUNT];    //round trips made to the BG96
+    uint32_t merged[BG96_QUERY_COUNT];  //callers answered by another caller's round trip
+} BG96_QUERY_STATS;
+
+typedef enum {
+    BG96_OP_GENERIC,                //send_generic_cmd
+    BG96_OP_MQTT_OPEN,              //AT+QMTOPEN
+    BG96_OP_MQTT_CONNECT,           //AT+QMTCONN
+    BG96_OP_SSL,                    //AT+QSSLCFG and AT+QSSLOPEN
+    BG96_OP_FS,                     //AT+QF* file system commands
+    BG96_OP_COUNT
+} BG96_OP;
+
+typedef struct {
+    bool     busy;                  //a caller is waiting on the BG96 answer
+    uint32_t gen;                   //incremented each time an answer is received
+    bool     done;                  //result of the last answer
+    size_t   val[2];                //values of the last answer
+} BG96_QUERY_SLOT;
+
+typedef enum {
+    BG96_SOCK_FREE,                 //connectID can be given to a socket
+    BG96_SOCK_USED,                 //connectID belongs to a socket
+    BG96_SOCK_DRAINING              //socket closed, waiting for the BG96 to confirm AT+QICLOSE
+} BG96_SOCK_STATE;
+
+typedef struct {
+    const char *name;               //name the profile is found by, shown by the handshake benchmark
+    int         sslversion;         //0 SSL3.0, 1 TLS1.0, 2 TLS1.1, 3 TLS1.2, 4 all
+    const char *ciphersuite;        //"0xFFFF" for all the suites the BG96 supports, or one suite, e.g. "0xC02F"
+    int         seclevel;           //0 no authentication, 1 server, 2 server and client, -1 from the certificates set
+    int         negotiatetime;      //s allowed for the handshake, 10-300
+    bool        ignorelocaltime;    //do not check the certificate validity against the BG96 clock
+    bool        sni;                //send the host name in the handshake (Server Name Indication)
+    bool        session_cache;      //keep the TLS session so the next connection to the same server resumes it
+} BG96_SSL_PROFILE;
+
 typedef struct {
     int pdp_id;
     const char* apn;
@@ -165,6 +375,14 @@ public:
     * @return true only if BG96 has started up correctly
     */
     bool startup(void);
+
+    /**
+    * Check how the last startup was done
+    *
+    * @return true if the BG96 was already running and was kept as is,
+    *         false if it was power cycled
+    */
+    bool isWarmStart(void) { return _warm; }
  
     /**
     * Wait for 'RDY' signal or timeout waiting...
@@ -207,24 +425,43 @@ public:
     * @param apn the name of the APN
     * @param username (not used)
     * @param password (not used)
-    * @return nsapi_error_t
+    * @return nsapi_error_t, NSAPI_ERROR_AUTH_FAILURE if the network denied the registration
     */
     nsapi_error_t connect(const char *apn, const char *username, const char *password);
  
     /**
-    * Connect BG96 to APN
+    * Activate a PDP context, several contexts can be active at the same time
     *
-    * @param id of configured pdp context
+    * @param id of configured pdp context, <1 for the current context
+    * @param once true to send AT+QIACT a single time instead of retrying
+    *        it up to the command ceiling
     * @return nsapi_error_t
     */
-    nsapi_error_t connect(int pdp_id);
+    nsapi_error_t connect(int pdp_id, bool once=false);
 
     /**
-    * Disconnect BG96 from AP
+    * Deactivate a PDP context
     *
+    * @param id of the pdp context, <1 for the current context
     * @return true if BG96 is disconnected successfully
     */
-    bool disconnect(void);
+    bool disconnect(int pdp_id=0);
+
+    /**
+    * Check if a PDP context is active
+    *
+    * @param id of the pdp context, <1 for the current context
+    * @return true if the BG96 reports the context as activated
+    */
+    bool isContextActive(int pdp_id);
+
+    /**
+    * Reactivate every context activated with connect() and not disconnected
+    *
+    * @param once true to send AT+QIACT a single time for each context
+    * @return NSAPI_ERROR_OK if all of them are active again
+    */
+    nsapi_error_t reactivate(bool once=false);
  
     /**
     * Get the RSSI of the BG96
@@ -248,6 +485,130 @@ public:
     */
     const char *getMACAddress(char*);
  
+    /**
+    * Get the IMEI of BG96
+    *
+    * @return null-terminated IMEI or null on failure
+    */
+    const char *getIMEI(char*);
+
+    /**
+    * Get the network registration status of BG96
+    *
+    * @return <stat> value of +CGREG/+CEREG, -1 if unknown
+    */
+    int getRegistrationStatus(void);
+
+    /**
+    * Get the time the last network registration took
+    *
+    * @return ms from the start of connect() to registration, -1 if unknown
+    */
+    int getRegistrationLatency(void);
+
+    /**
+    * Check if the last registration was steered to the network saved by
+    * the previous session (see BG96_NET_HINT_FILE)
+    *
+    * @return true if AT+COPS was used to select the saved network
+    */
+    bool wasAttachSteered(void) { return _reg_steered; }
+
+    /**
+    * Get the registration counters, split between registrations steered
+    * to the saved network and automatic ones
+    *
+    * @param stats structure to receive the counters
+    */
+    void getRegistrationStats(BG96_REG_STATS &stats);
+
+    /**
+    * Read the network saved after the last successful registration
+    *
+    * @param hint structure to receive the network
+    * @return true if a network was saved
+    */
+    bool getLastNetwork(BG96_NET_HINT &hint);
+
+    /**
+    * Restart the network search by switching the radio off and on,
+    * the registration URCs report when the BG96 registers again
+    *
+    * @return true if the radio was restarted
+    */
+    bool reregister(void);
+
+    /**
+    * Get the timeout used for a command and the latencies it was learned from
+    *
+    * @param cmd the command
+    * @param timing structure to receive the values
+    */
+    void getCommandTiming(BG96_CMD cmd, BG96_CMD_TIMING &timing);
+
+    /**
+    * Get the AT channel watchdog counters
+    *
+    * @param stats structure to receive the counters
+    */
+    void getWatchdogStats(BG96_WD_STATS &stats);
+
+    /**
+    * Get when each step of the last startup() and connect() ran. Steps
+    * that do not need the network run while it is registering.
+    *
+    * @param tl structure to receive the timeline
+    */
+    void getStartupTimeline(BG96_BOOT_TIMELINE &tl);
+
+    /**
+    * Get the name of a startup step
+    *
+    * @param step the step
+    * @return printable name
+    */
+    static const char *bootStepName(BG96_BOOT_STEP step);
+
+    /**
+    * Set the function called when the network link changes. It is called
+    * from the URC handler with the driver locked, so it must not call
+    * back into the driver.
+    *
+    * @param cb function to call, NULL to remove it
+    */
+    void attachLinkEvent(BG96_Link_Callback cb) { _link_cb = cb; }
+
+    /**
+    * Copy the cached identity and status values, no AT command is sent
+    *
+    * @param status structure to receive the values
+    */
+    void getStatus(BG96_STATUS &status);
+
+    /**
+    * Read the radio settings (AT+QCFG nwscanseq, nwscanmode, iotopmode and band)
+    *
+    * @param cfg structure to receive the settings
+    * @return NSAPI_ERROR_OK on success
+    */
+    int getRadioConfig(BG96_RADIO_CFG &cfg);
+
+    /**
+    * Write the radio settings, only the values that differ from the ones
+    * stored in the BG96 are written. Fields set to "" or -1 are left unchanged.
+    *
+    * @param cfg settings to apply
+    * @return NSAPI_ERROR_OK on success
+    */
+    int setRadioConfig(const BG96_RADIO_CFG &cfg);
+
+    /**
+    * Copy the counters of status queries sent and merged
+    *
+    * @param stats structure to receive the counters
+    */
+    void getQueryStats(BG96_QUERY_STATS &stats);
+
     /**
     * Check if BG96 is conenected
     *
@@ -262,9 +623,10 @@ public:
     * @param id for saving socket number to (returned by BG96)
     * @param port port to open connection with
     * @param addr the IP address of the destination
+    * @param pdp_id context to open the socket on, <1 for the current context
     * @return true only if socket opened successfully
     */
-    bool open(const char type, int id, const char* addr, int port);
+    bool open(const char type, int id, const char* addr, int port, int pdp_id=0);
  
     /**
     * Sends data to an open socket
@@ -295,6 +657,134 @@ public:
     * @return true only if socket is closed successfully
     */
     bool close(int id);
+
+    /**
+    * Stop an open() in progress on a socket, may be called from any thread.
+    * open() closes the BG96 socket and fails, later open() calls on the id
+    * fail at once until the id is released with cancelOpen(id, false)
+    *
+    * @param id of the socket
+    * @param cancel false to release the id once the socket is closed
+    */
+    void cancelOpen(int id, bool cancel=true);
+
+    /**
+    * Get a free connectID for a socket. A connectID still draining is only
+    * waited for when no other one is free
+    *
+    * @return connectID, -1 if none is free
+    */
+    int allocSocket(void);
+
+    /**
+    * Close a socket without waiting for the BG96, may be called from any
+    * thread without the driver mutex. The request is only flagged, the
+    * connectID is draining from the next drainSockets() until it gets the
+    * AT+QICLOSE answer; an open() in progress on it is stopped
+    *
+    * @param id connectID of the socket
+    */
+    void closeAsync(int id);
+
+    /**
+    * Send AT+QICLOSE for the draining connectIDs and free the ones the
+    * BG96 answered
+    *
+    * @return number of connectIDs still draining
+    */
+    int drainSockets(void);
+
+    /**
+    * Free a connectID the BG96 no longer uses, e.g. after AT+QSSLCLOSE
+    *
+    * @param id connectID
+    */
+    void releaseSocket(int id);
+
+    /**
+    * Get an SSL context no other TLS socket or MQTT client uses
+    *
+    * @return SSL context id, -1 if none is free
+    */
+    int allocSslContext(void);
+
+    /**
+    * Give back an SSL context
+    *
+    * @param ctx SSL context id
+    */
+    void releaseSslContext(int ctx);
+
+    /**
+    * Find one of the built-in SSL profiles ("default", "tls12", "tls12-ecdhe-rsa-gcm",
+    * "tls12-ecdhe-ecdsa-gcm", "tls12-rsa-aes128", "tls12-rsa-aes256")
+    *
+    * @param name profile name
+    * @return profile, NULL if there is none with this name
+    */
+    static const BG96_SSL_PROFILE *getSslProfile(const char *name);
+
+    /**
+    * Get the built-in SSL profiles
+    *
+    * @param count receives the number of profiles
+    * @return first profile
+    */
+    static const BG96_SSL_PROFILE *getSslProfiles(int &count);
+
+    /**
+    * Apply an SSL profile to an SSL context. Nothing is sent when the
+    * context already has this profile
+    *
+    * @param sslctx_id SSL context
+    * @param profile the profile
+    * @param seclevel security level to use, replaces profile->seclevel
+    * @return NSAPI_ERROR_OK on success
+    */
+    int configure_ssl_profile(int sslctx_id, const BG96_SSL_PROFILE *profile, int seclevel);
+
+    /**
+    * Set one numeric AT+QSSLCFG option of an SSL context, e.g. "sslversion"
+    *
+    * @param option option name
+    * @param sslctx_id SSL context
+    * @param value value to set
+    * @return 1 on success, 0 on failure
+    */
+    int configure_ssl_option(const char *option, int sslctx_id, int value);
+
+    /**
+    * Set the cipher suite of an SSL context
+    *
+    * @param sslctx_id SSL context
+    * @param suite "0xFFFF" for all, or one suite, e.g. "0xC02F"
+    * @return 1 on success, 0 on failure
+    */
+    int configure_ciphersuite(int sslctx_id, const char *suite);
+
+    /**
+    * Check if the BG96 firmware accepted AT+QSSLCFG="session", i.e. TLS
+    * sessions are cached per SSL context and resumed by the next
+    * AT+QSSLOPEN to the same server
+    *
+    * @return 1 supported, 0 not supported, -1 not known yet
+    */
+    int sslSessionCache(void) { return _ssl_session_cache; }
+
+    /**
+    * Stop a mqtt_open() or mqtt_connect() in progress, may be called from any
+    * thread. A call made while the operation waits for the driver stops it
+    * before anything is sent, a call made while none runs is ignored. The MQTT network is closed; the request is
+    * cleared when the operation it stopped ends
+    */
+    void cancelMqtt(void) { if( _mqtt_waiting ) _cancel_mqtt = true; }
+
+    /**
+    * Make the resolveUrl() calls in progress return false at once, may be
+    * called from any thread. The BG96 has no command to stop a query, its
+    * answer is dropped when it arrives
+    */
+    void cancelResolve(void) { _dns_cancel++; }
  
     /**
     * Checks if data is available
@@ -309,10 +799,25 @@ public:
     /**
     * Resolves a URL name to IP address
     */
-    bool resolveUrl(const char *name, char* str);
+    bool resolveUrl(const char *name, char* str, int pdp_id=0);
+
+    /**
+    * Start a DNS lookup without waiting for the result
+    *
+    * @param name host name to resolve
+    * @param cb called with the result once the 'dnsgip' URC has been received
+    * @param pdp_id context to send the query on, <1 for the current context
+    * @return true if the BG96 accepted the query
+    */
+    bool startResolveUrl(const char *name, BG96_DNS_Callback cb, int pdp_id=0);
+
+    /**
+    * Process URCs waiting in the serial buffer and expire stale DNS queries
+    */
+    void process_urc(void);
  
     /*
-    * Obtain or set the current BG96 active context
+    * Obtain or set the current BG96 context, used when no context id is given
     */
     int setContext( int i );
     /*
@@ -343,6 +848,22 @@ public:
      */
     bool getError(BG96_ERROR &error);
 
+    /** Return the +CME ERROR code reported by the last command of an operation
+     *
+     *  @param          operation
+     *  @retval         0 if it succeeded, the CME error code, or -1 if it failed
+     *                  without reporting one (timeout or plain ERROR)
+     */
+    int getLastError(BG96_OP op);
+
+    /** Return the +CME ERROR reported by the last command of an operation
+     *
+     *  @param          operation
+     *  @param          reference to a valid BG96_ERROR structure to return result
+     *  @retval         true if the last command of the operation failed
+     */
+    bool getLastError(BG96_OP op, BG96_ERROR &error);
+
     /** Return the amount a data available
      *
      *  @param          char* [at least 40 long]
@@ -398,12 +919,47 @@ public:
 
     int         send_generic_cmd(const char* cmd, int timeout);
 
+    /**
+    * Send a batch of commands that only answer OK or ERROR
+    *
+    * @param cmds array of commands, each starting with "AT"
+    * @param count number of commands
+    * @param timeout timeout for each command line
+    * @param join true to join commands on a single line (AT+A;+B;...),
+    *        false to send them back to back
+    * @param failed receives the index of the first failing command or -1
+    * @return NSAPI_ERROR_OK if all commands succeeded
+    */
+    int         send_batch(const char **cmds, int count, int timeout, bool join=true, int *failed=NULL);
+
     int         file_exists(const char* filename);
 
     int         delete_file(const char* filename);
 
     int         send_file(const char* content, const char* filename, bool overrideok);
 
+    /**
+    * Upload a certificate or key unless the BG96 already holds the same
+    * content. The size and hash of each upload are kept in filename
+    * followed by BG96_CRED_HASH_EXT.
+    *
+    * @param content PEM text
+    * @param filename UFS file to write
+    * @return 1 if the file holds the content, 0 on failure
+    */
+    int         send_credential(const char* content, const char* filename);
+
+    /**
+    * FNV-1a hash of a credential as send_credential() computes it, the
+    * terminating 0 included. Chain calls through hash to fingerprint
+    * several credentials; a NULL credential hashes as an empty one.
+    *
+    * @param content PEM text, may be NULL
+    * @param hash hash of the previous credentials
+    * @return the hash
+    */
+    static uint32_t credentialHash(const char* content, uint32_t hash=2166136261u);
+
     int         configure_cacert_path(const char* path, int sslctx_id);
 
     int         configure_client_cert_path(const char* path, int sslctx_id);
@@ -414,10 +970,30 @@ public:
 
     int        sslsend(int client_id, const void *data, uint32_t amount);
 
+    /**
+    * Send at most BG96_SSL_SEND_MAX bytes on a TLS client
+    *
+    * @param client_id TLS client
+    * @param data bytes to send
+    * @param amount number of bytes, larger amounts are cut to BG96_SSL_SEND_MAX
+    * @param timeout ms to wait for the BG96
+    * @return bytes sent on SEND OK, 0 on SEND FAIL (the BG96 send buffer is full), -1 on error
+    */
     int        sslsend(int client_id, const void * data, uint32_t amount, int timeout);
 
     bool        sslChkRxAvail(int client_id);
 
+    /**
+    * Wait for the +QSSLURC: "recv" event of a TLS client, without polling
+    * the BG96. The driver is released between BG96_CANCEL_POLL slices so
+    * other sockets keep working
+    *
+    * @param client_id TLS client
+    * @param deadline Kernel::get_ms_count() value after which to give up
+    * @return 1 if data is waiting, 0 on timeout, -1 if the server closed the connection
+    */
+    int         sslWaitRx(int client_id, uint64_t deadline);
+
     int32_t    sslrecv(int client_id, void *data, uint32_t cnt);
 
     bool       sslclose(int client_id);
@@ -453,8 +1029,46 @@ private:
     bool        tx2bg96(char* cmd);
     bool        BG96Ready(void);
     bool        hw_reset(void);
+    bool        _recv_final(void);
+    bool        _probe(void);
+    int         _cmd_timeout(BG96_CMD cmd);
+    int         _cmd_p99(BG96_CMD cmd);
+    void        _cmd_latency(BG96_CMD cmd, uint64_t start);
+    void        _cmd_expired(BG96_CMD cmd);
+    bool        _wait_urc(int timeout, volatile bool *cancel, const char *fmt, ...);
+    bool        _dns_query(const char *name, BG96_DNS_Callback cb, int pdp_id, int *slot);
+    bool        _init(bool warm);
+    void        _wd_check(bool ok);
+    bool        _wd_restart(void);
+    void        _boot_reset(int from);
+    void        _boot_begin(BG96_BOOT_STEP step);
+    void        _boot_end(BG96_BOOT_STEP step, bool ok);
+    bool        _boot_step(BG96_BOOT_STEP step);
+    bool        _boot_run_next(void);
+    bool        _boot_finish(void);
+    bool        _set_apn(const char *apn, const char *username, const char *password);
+    bool        _pdp_active(int cid);
+    int         _pdp_id(int pdp_id) { return (pdp_id < 1)? _contextID : pdp_id; }
+    void        _save_net_hint(void);
+    void        _dnsgip_urc(void);
+    void        _pdpdeact_urc(void);
+    void        _cme_error_urc(void);
+    void        _sslurc(void);
+    void        _qmtrecv_urc(void);
+    void        _process_urcs(void);
+    void        _cereg_urc(void);
+    void        _cgreg_urc(void);
+    void        _reg_urc(int domain);
+    void        _set_op_error(BG96_OP op, bool ok);
+    bool        _fresh(uint64_t read_time);
+    void        _invalidate_ip(void);
+    void        _invalidate_cache(void);
+    bool        _query_lead(BG96_QUERY q, bool &done, size_t val[2]);
+    void        _query_finish(BG96_QUERY q, bool done, size_t val0, size_t val1);
+    void        _dns_complete(nsapi_error_t err, const char *ip);
 
     int         _contextID;
+    uint32_t    _pdp_wanted;                            //bit n set while context n is activated by connect()
     Mutex       _bg96_mutex;
 
     UARTSerial  _serial;
@@ -464,6 +1078,70 @@ private:
     DigitalOut  _vbat_3v8_en;
     DigitalOut  _bg96_pwrkey;
     GNSSLoc     _gnss_loc;
+
+    BG96_DNS_Callback _dns_cb[BG96_DNS_QUEUE_SIZE];     //queries waiting on a 'dnsgip' URC, oldest first
+    uint64_t    _dns_start[BG96_DNS_QUEUE_SIZE];        //time each query was sent
+    int         _dns_head;
+    int         _dns_count;
+    int         _dns_ipleft;                            //address lines still expected for the current query
+    bool        _dns_waitip;                            //true until the first address line is received
+    int         _dns_stale;                             //expired queries whose late 'dnsgip' answer must be discarded
+    uint64_t    _dns_stale_until;                       //time the BG96 answers the last expired query at the latest
+
+    Mutex       _cache_mutex;                           //protects the cached values below
+    BG96_STATUS _cache;                                 //identity and status read from the BG96
+    uint64_t    _ip_time;                               //time the cached values were read, 0 if not valid
+    uint64_t    _reg_time;
+    uint64_t    _rssi_time;
+    int         _reg_stat[2];                           //<stat> of the EPS (+CEREG) and GPRS (+CGREG) domains
+    uint64_t    _reg_start;                             //time connect() started waiting for registration, 0 if not waiting
+    int         _reg_latency;                           //ms the last registration took, -1 if unknown
+    bool        _reg_steered;                           //true if the last registration was steered by the saved network
+    BG96_REG_STATS _reg_stats;
+    BG96_Link_Callback _link_cb;                        //told about PDP and registration losses
+
+    Mutex       _query_mutex;                           //protects the in-flight queries below
+    ConditionVariable _query_cond;                      //signalled when a query is answered
+    BG96_QUERY_SLOT  _query[BG96_QUERY_COUNT];
+    BG96_QUERY_STATS _query_stats;
+
+    bool        _warm;                                  //true if startup kept a running BG96
+    int         _cme_error;                             //code of the +CME ERROR seen in the current transaction, 0 if none
+    int         _op_error[BG96_OP_COUNT];               //result of the last command of each operation
+
+    int         _wd_timeouts;                           //consecutive commands the BG96 did not answer
+    bool        _wd_busy;                               //true while the watchdog restarts the BG96
+    BG96_WD_STATS _wd_stats;
+
+    uint64_t    _boot_t0;                               //time startup() started
+    uint32_t    _boot_pending;                          //bit n set while step n waits to be run
+    uint32_t    _boot_done;                             //bit n set once step n ended
+    BG96_BOOT_TIMELINE _boot_tl;
+    const char *_boot_cred[3];                          //APN, username and password while connect() runs
+
+    uint32_t    _cmd_lat[BG96_CMD_COUNT][BG96_CMD_SAMPLES]; //recent latencies of each command, ms
+    uint8_t     _cmd_count[BG96_CMD_COUNT];             //latencies recorded
+    uint8_t     _cmd_next[BG96_CMD_COUNT];              //next entry to overwrite
+
+    volatile bool _cancel_open[BG96_SOCKET_MAX];        //open() of the socket must stop
+    uint8_t     _sock_state[BG96_SOCKET_MAX];           //BG96_SOCK_STATE of each connectID, only written with _bg96_mutex held
+    volatile bool _close_req[BG96_SOCKET_MAX];          //set by closeAsync(), moved to _sock_state by drainSockets()
+    uint8_t     _sslctx_used;                           //bit n set while SSL context n is given out
+    uint32_t    _sslctx_cfg[BG96_SSLCTX_MAX];           //hash of the profile applied to each SSL context, 0 if unknown
+    int         _ssl_session_cache;                     //firmware supports the session cache: 1 yes, 0 no, -1 not probed
+    volatile uint16_t _ssl_rx;                          //bit n set when TLS client n has data the BG96 signalled
+    volatile uint16_t _ssl_closed;                      //bit n set when the server closed TLS client n
+    struct {
+        int     id;
+        int     msg_id;
+        char    topic[257];
+        char    payload[1548];
+    }           _mqtt_rxq[BG96_MQTT_RXQ_SIZE];          //+QMTRECV messages not yet read, oldest first
+    int         _mqtt_rxq_head;
+    int         _mqtt_rxq_count;
+    volatile bool _cancel_mqtt;                         //mqtt_open()/mqtt_connect() must stop
+    volatile uint32_t _mqtt_waiting;                    //mqtt_open()/mqtt_connect() calls running, a cancel without one is ignored
+    volatile uint32_t _dns_cancel;                      //incremented to stop the resolveUrl() calls in progress
 };
  
 #endif  //__BG96_H__
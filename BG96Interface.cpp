@@ -67,12 +67,22 @@
 #define TX_COMPLETE          23                        //all TX data has been sent
 #define TX_DOCB              24                        //indicatew we need to exeucte the call-back
 
+#define DNS_ACTIVE           30                        //DNS query sent, waiting for the BG96 result
+#define DNS_DOCB             31                        //DNS result received, need to perform the call-back
+
 #if !defined(BG96_LIBRARY_READ_TIMEOUTMS)
 #define BG96_LIBRARY_READ_TIMEOUTMS    30000                    //read timeout in MS
 #endif
 #define EQ_FREQ                50                       //frequency in ms to check for Tx/Rx data
 #define EQ_FREQ_SLOW           2000                     //frequency in ms to check when in slow monitor mode
 
+#define LINK_BACKOFF_MIN       1000                     //first delay in ms before recovering a lost link
+#define LINK_BACKOFF_MAX       64000                    //longest delay in ms between recovery attempts
+#define LINK_REREG_AFTER       8000                     //backoff from which a new network selection is requested
+#define LINK_CTX_RETRY         8000                     //first delay in ms between attempts to reactivate an additional context
+#define LINK_CTX_TRIES         6                        //reactivations of an additional context tried before giving up
+#define SOCK_DRAIN_RETRY       2000                     //delay in ms before closing again a connectID the BG96 did not answer for
+
 #define EVENT_COMPLETE         0                        //signals when a TX/RX event is complete
 #define EVENT_GETMORE          0x01                     //signals when we need additional TX/RX data
 
@@ -165,16 +175,42 @@ BG96Interface::BG96Interface(void) :
 {
     for( int i=0; i<BG96_SOCKET_COUNT; i++ ) {
         g_sock[i].id = -1;
+        g_sock[i].cid = -1;
         g_sock[i].disTO = false;
         g_sock[i].connected   = false;
+        g_sock[i].pdp_id      = 0;
         g_socRx[i].m_rx_state = READ_START;
         g_socRx[i].m_rx_disTO = false;
         g_socTx[i].m_tx_state = TX_IDLE;
         }
+    for( int i=0; i<BG96_DNS_COUNT; i++ ) {
+        g_dns[i].id       = 0;
+        g_dns[i].callback = NULL;
+        }
+    g_dns_id = 0;
+    g_dns_polling = false;
+    g_drain_id = 0;
+    g_conn_status = NSAPI_STATUS_DISCONNECTED;
+    g_link_poll_id = 0;
+    g_link_retry_id = 0;
+    g_link_backoff = LINK_BACKOFF_MIN;
+    g_link_kick = 0;
+    g_link_reset = false;
+    for( int i=0; i<=BG96_PDP_MAX; i++ ) {
+        g_ctx_retry_id[i] = 0;
+        g_ctx_tries[i] = 0;
+        }
+    _BG96.attachLinkEvent(BG96_Link_Callback(this, &BG96Interface::_link_urc));
     #if MBED_CONF_BG96_LIBRARY_BG96_DEBUG == true
     g_debug=MBED_CONF_BG96_LIBRARY_BG96_DEBUG_SETTING;
     #endif
-    _tls = NULL;
+    for( int i=0; i<MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS; i++ ) {
+        _tls[i] = NULL;
+        _tls_used[i] = false;
+        _tls_conn[i].host[0] = 0x00;
+        _tls_conn[i].idle = false;
+        }
+    _tls_expire_id = 0;
     _mqtt = NULL;
     _power_off = 0;
     _fs_imp = new FSImplementation(&_BG96);
@@ -187,9 +223,11 @@ BG96Interface::BG96Interface(void) :
 */
 BG96Interface::~BG96Interface()
 {
+    if (_tls_expire_id != 0) _bg96_queue.cancel(_tls_expire_id);
     if (_fs_imp != NULL) delete(_fs_imp);
     if (_mqtt != NULL) delete(_mqtt);
-    if (_tls != NULL) delete(_tls);
+    for( int i=0; i<MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS; i++ )
+        if (_tls[i] != NULL) delete(_tls[i]);
 }
 
 /** ----------------------------------------------------------
@@ -216,7 +254,8 @@ nsapi_error_t BG96Interface::connect(void)
     }
     //printf("[BG96Interface]: MAC address = %s\r\n", get_mac_address());
     //printf("[BG96Interface]: IP address = %s\r\n", get_ip_address());
-    while(!_BG96.isConnected()) {}
+    while(ret == NSAPI_ERROR_OK && !_BG96.isConnected())
+        wait_ms(EQ_FREQ);
     //printf("[BG96Interface]: The IP address www.google.com is: %s\r\n", ipaddress);
     return ret;
 }
@@ -249,6 +288,7 @@ nsapi_error_t BG96Interface::connect(const char *apn, const char *username, cons
     if( g_isInitialized == NSAPI_ERROR_IS_CONNECTED ) 
         ok = disconnect();
 
+    _set_status(NSAPI_STATUS_CONNECTING);
     t.start();
     dbgIO_lock;
     while(t.read_ms() < BG96_LIBRARY_READ_TIMEOUTMS && !ok) 
@@ -260,7 +300,11 @@ nsapi_error_t BG96Interface::connect(const char *apn, const char *username, cons
 
     debugOutput(DBGMSG_DRV,"BG96Interface::connect EXIT");
 
-    return ok? set_credentials(apn, username, password) : NSAPI_ERROR_DEVICE_ERROR;
+    if( !ok ) {
+        _set_status(NSAPI_STATUS_DISCONNECTED);
+        return NSAPI_ERROR_DEVICE_ERROR;
+        }
+    return set_credentials(apn, username, password);
 }
 
 /** Set the cellular network credentials --------------------
@@ -273,9 +317,24 @@ nsapi_error_t BG96Interface::connect(const char *apn, const char *username, cons
 nsapi_error_t BG96Interface::set_credentials(const char *apn, const char *username, const char *password)
 {
     debugOutput(DBGMSG_DRV,"BG96Interface::set_credentials ENTER/EXIT, APN=%s, USER=%s, PASS=%s",apn,username,password);
-    g_isInitialized = (_BG96.connect((char*)apn, (char*)username, (char*)password)==true)? NSAPI_ERROR_NO_CONNECTION : NSAPI_ERROR_IS_CONNECTED;
+    g_isInitialized = (_BG96.connect((char*)apn, (char*)username, (char*)password)==NSAPI_ERROR_OK)? NSAPI_ERROR_IS_CONNECTED : NSAPI_ERROR_NO_CONNECTION;
+
+    if( g_isInitialized != NSAPI_ERROR_IS_CONNECTED ) {
+        _set_status(NSAPI_STATUS_DISCONNECTED);
+        return NSAPI_ERROR_NO_CONNECTION;
+        }
 
-    return g_isInitialized;
+    // watch for PDP and registration losses while connected
+    gvupdate_mutex.lock();
+    if( _bg96_monitor.get_state() == Thread::Inactive ) 
+        g_bg96_queue_id = _bg96_monitor.start(callback(&_bg96_queue, &EventQueue::dispatch_forever));
+    g_link_backoff = LINK_BACKOFF_MIN;
+    g_link_kick = 0;
+    if( g_link_poll_id == 0 )
+        g_link_poll_id = _bg96_queue.call_every(EQ_FREQ_SLOW, mbed::Callback<void()>(this, &BG96Interface::_link_poll));
+    gvupdate_mutex.unlock();
+    _set_status(NSAPI_STATUS_GLOBAL_UP);
+    return NSAPI_ERROR_OK;
 }
  
 /**----------------------------------------------------------
@@ -292,8 +351,30 @@ int BG96Interface::disconnect(void)
     _bg96_queue.cancel(g_bg96_queue_id);
     g_bg96_queue_id = -1; 
     g_isInitialized = NSAPI_ERROR_NO_CONNECTION;
+    gvupdate_mutex.lock();
+    if( g_link_poll_id )
+        _bg96_queue.cancel(g_link_poll_id);
+    if( g_link_retry_id )
+        _bg96_queue.cancel(g_link_retry_id);
+    g_link_poll_id = g_link_retry_id = 0;
+    for( int i=0; i<=BG96_PDP_MAX; i++ ) {
+        if( g_ctx_retry_id[i] )
+            _bg96_queue.cancel(g_ctx_retry_id[i]);
+        g_ctx_retry_id[i] = 0;
+        }
+    gvupdate_mutex.unlock();
+    _set_status(NSAPI_STATUS_DISCONNECTED);
+
+    // stop connects and DNS lookups still waiting on the BG96
+    _BG96.cancelResolve();
+    for( int i=0; i<BG96_SOCKET_COUNT; i++ )
+        if( g_sock[i].id >= 0 && !g_sock[i].connected )
+            _BG96.cancelOpen(g_sock[i].cid);
     dbgIO_lock;
     ret = _BG96.disconnect();
+    for( int i=0; i<BG96_SOCKET_COUNT; i++ )
+        if( g_sock[i].id >= 0 )
+            _BG96.cancelOpen(g_sock[i].cid, false);
     dbgIO_unlock;
     debugOutput(DBGMSG_DRV,"BG96Interface::disconnect EXIT");
     return ret? NSAPI_ERROR_OK:NSAPI_ERROR_DEVICE_ERROR;
@@ -363,6 +444,19 @@ const char *BG96Interface::get_mac_address()
     return ptr;
 }
 
+/**---------------------------------------------------------- 
+* @brief  Query registered state, uses the cached value when recent
+* @param  none
+* @retval true if registered on the home network or roaming
+*/
+bool BG96Interface::registered()
+{
+    dbgIO_lock;
+    int stat = _BG96.getRegistrationStatus();
+    dbgIO_unlock;
+    return (stat == 1 || stat == 5);
+}
+
 /**---------------------------------------------------------- 
 * @brief  Get Module Firmware Information
 * @param  none
@@ -378,6 +472,379 @@ const char* BG96Interface::getRevision(void)
     return ptr;
 }
 
+/**----------------------------------------------------------
+* @brief  register a callback for connection status changes
+* @param  status_cb: callback, called from the event queue
+* @retval none
+*/
+void BG96Interface::attach(mbed::Callback<void(nsapi_event_t, intptr_t)> status_cb)
+{
+    gvupdate_mutex.lock();
+    g_status_cb = status_cb;
+    gvupdate_mutex.unlock();
+}
+
+/**----------------------------------------------------------
+* @brief  get the connection status
+* @param  none
+* @retval nsapi_connection_status_t
+*/
+nsapi_connection_status_t BG96Interface::get_connection_status() const
+{
+    return g_conn_status;
+}
+
+/**----------------------------------------------------------
+* @brief  change the connection status and tell the application
+* @param  status: new status
+* @retval none
+*/
+void BG96Interface::_set_status(nsapi_connection_status_t status)
+{
+    mbed::Callback<void(nsapi_event_t, intptr_t)> cb;
+
+    gvupdate_mutex.lock();
+    if( g_conn_status != status ) {
+        g_conn_status = status;
+        cb = g_status_cb;
+        }
+    gvupdate_mutex.unlock();
+    if( cb ) {
+        debugOutput(DBGMSG_EQ,"connection status changed to %d", status);
+        cb(NSAPI_EVENT_CONNECTION_STATUS_CHANGE, status);
+        }
+}
+
+/**----------------------------------------------------------
+* @brief  called by the BG96 URC handler when the link changes.
+*         The driver is locked, so the event is handled from the
+*         event queue.
+* @param  ev: link event
+*         cid: PDP context of a BG96_LINK_PDP_DOWN event
+* @retval none
+*/
+void BG96Interface::_link_urc(BG96_LINK_EVENT ev, int cid)
+{
+    if( ev == BG96_LINK_PDP_DOWN && cid != _BG96.setContext(0) ) {
+        if( cid < 1 || cid > BG96_PDP_MAX )
+            return;
+        gvupdate_mutex.lock();
+        if( g_ctx_retry_id[cid] == 0 ) {    //a recovery already scheduled keeps its backoff
+            g_ctx_tries[cid] = 0;
+            g_ctx_retry_id[cid] = _bg96_queue.call(mbed::Callback<void(int)>(this, &BG96Interface::_context_recover), cid);
+            }
+        gvupdate_mutex.unlock();
+        }
+    else
+        _bg96_queue.call(mbed::Callback<void(BG96_LINK_EVENT)>(this, &BG96Interface::_link_event), ev);
+}
+
+/**----------------------------------------------------------
+* @brief  event queue handler for link changes. A lost PDP context
+*         or registration starts the recovery, a new registration
+*         retries it straight away.
+* @param  ev: link event
+* @retval none
+*/
+void BG96Interface::_link_event(BG96_LINK_EVENT ev)
+{
+    bool now = false;
+
+    debugOutput(DBGMSG_EQ,"link event %d", ev);
+    gvupdate_mutex.lock();
+    if( g_link_poll_id == 0 ) {             //not connected yet or disconnected by the application
+        gvupdate_mutex.unlock();
+        return;
+        }
+    if( ev == BG96_LINK_RESET )
+        g_link_reset = true;
+    if( ev == BG96_LINK_REGISTERED ) {
+        if( g_conn_status == NSAPI_STATUS_CONNECTING && g_link_retry_id ) {
+            _bg96_queue.cancel(g_link_retry_id);
+            g_link_retry_id = 0;
+            now = true;
+            }
+        }
+    else if( g_link_retry_id == 0 ) {
+        g_link_backoff = LINK_BACKOFF_MIN;
+        g_link_kick = 0;
+        g_link_retry_id = _bg96_queue.call_in(g_link_backoff, mbed::Callback<void()>(this, &BG96Interface::_link_recover));
+        }
+    gvupdate_mutex.unlock();
+
+    if( ev != BG96_LINK_REGISTERED )
+        _set_status(NSAPI_STATUS_CONNECTING);
+    if( now )
+        _link_recover();
+}
+
+/**----------------------------------------------------------
+* @brief  periodic event while connected, reads the URCs the BG96
+*         sends when no other command is running
+* @param  none
+* @retval none
+*/
+void BG96Interface::_link_poll(void)
+{
+    dbgIO_lock;
+    _BG96.process_urc();
+    dbgIO_unlock;
+}
+
+/**----------------------------------------------------------
+* @brief  reactivate an additional context the network deactivated.
+*         The default context keeps the link up, so the connection
+*         status is not changed. Each call sends AT+QIACT once so the
+*         event queue is not held for the whole QIACT ceiling; a failed
+*         attempt is retried with a doubling delay, up to LINK_CTX_TRIES
+*         times.
+* @param  cid: PDP context id
+* @retval none
+*/
+void BG96Interface::_context_recover(int cid)
+{
+    bool ok;
+
+    gvupdate_mutex.lock();
+    g_ctx_retry_id[cid] = 0;
+    bool up = (g_link_poll_id != 0);
+    int  tries = ++g_ctx_tries[cid];
+    gvupdate_mutex.unlock();
+    if( !up )
+        return;
+
+    debugOutput(DBGMSG_EQ,"reactivating PDP context %d, attempt %d", cid, tries);
+    dbgIO_lock;
+    ok = _BG96.connect(cid, true) == NSAPI_ERROR_OK;
+    dbgIO_unlock;
+
+    gvupdate_mutex.lock();
+    if( ok || tries >= LINK_CTX_TRIES )
+        g_ctx_tries[cid] = 0;
+    else if( g_link_poll_id != 0 && g_ctx_retry_id[cid] == 0 )
+        g_ctx_retry_id[cid] = _bg96_queue.call_in(LINK_CTX_RETRY << (tries-1),
+                                  mbed::Callback<void(int)>(this, &BG96Interface::_context_recover), cid);
+    gvupdate_mutex.unlock();
+    if( !ok && tries >= LINK_CTX_TRIES )
+        debugOutput(DBGMSG_EQ,"PDP context %d not reactivated, giving up", cid);
+}
+
+/**----------------------------------------------------------
+* @brief  recover a lost link in short steps run from the event
+*         queue: while the BG96 is not registered the step only checks
+*         the registration, restarting the network search once per
+*         BG96_REG_TO if it takes too long; once registered each PDP
+*         context gets a single activation attempt. The next step is
+*         scheduled with an exponential backoff, a registration URC
+*         runs it straight away.
+* @param  none
+* @retval none
+*/
+void BG96Interface::_link_recover(void)
+{
+    bool ok = false;
+    bool kick = false;
+    int  stat;
+
+    gvupdate_mutex.lock();
+    g_link_retry_id = 0;
+    bool down = (g_conn_status == NSAPI_STATUS_CONNECTING);
+    gvupdate_mutex.unlock();
+    if( !down )
+        return;
+
+    debugOutput(DBGMSG_EQ,"recovering link, backoff %d ms", g_link_backoff);
+    dbgIO_lock;
+    stat = _BG96.getRegistrationStatus();
+    if( stat != 1 && stat != 5 ) {
+        uint64_t now = Kernel::get_ms_count();
+        kick = g_link_backoff >= LINK_REREG_AFTER && (g_link_kick == 0 || now - g_link_kick >= BG96_REG_TO);
+        if( kick && _BG96.reregister() )
+            g_link_kick = now;
+        }
+    else
+        ok = (_BG96.reactivate(true) == NSAPI_ERROR_OK) && _BG96.isConnected();
+    dbgIO_unlock;
+
+    gvupdate_mutex.lock();
+    bool reopen = ok && g_link_reset;
+    if( ok ) {
+        g_link_backoff = LINK_BACKOFF_MIN;
+        g_link_kick = 0;
+        g_link_reset = false;
+        }
+    else if( g_conn_status == NSAPI_STATUS_CONNECTING && g_link_retry_id == 0 ) {
+        if( (g_link_backoff *= 2) > LINK_BACKOFF_MAX )
+            g_link_backoff = LINK_BACKOFF_MAX;
+        g_link_retry_id = _bg96_queue.call_in(g_link_backoff, mbed::Callback<void()>(this, &BG96Interface::_link_recover));
+        }
+    gvupdate_mutex.unlock();
+
+    if( reopen ) {
+        _restore_sockets();
+        if( _mqtt != NULL )
+            _mqtt->restore();
+        }
+    if( ok ) {
+        debugOutput(DBGMSG_EQ,"link recovered");
+        _set_status(NSAPI_STATUS_GLOBAL_UP);
+        }
+}
+
+/**----------------------------------------------------------
+* @brief  reopen the sockets that were connected when the BG96 was
+*         restarted. A socket that cannot be reopened is marked as
+*         not connected, the application is told through the socket
+*         callback either way.
+* @param  none
+* @retval none
+*/
+void BG96Interface::_restore_sockets(void)
+{
+    for( int i=0; i<BG96_SOCKET_COUNT; i++ ) {
+        BG96SOCKET *sock = &g_sock[i];
+        bool        ok;
+
+        if( sock->id < 0 || !sock->connected )
+            continue;
+        dbgIO_lock;
+        ok = _BG96.open((sock->proto == NSAPI_UDP) ? 'u' : 't', sock->cid,
+                        sock->addr.get_ip_address(), sock->addr.get_port(), sock->pdp_id);
+        dbgIO_unlock;
+        debugOutput(DBGMSG_EQ,"socket %d %s after restart", i, ok? "reopened" : "lost");
+        if( !ok )
+            sock->connected = false;
+        if( sock->_callback != NULL )
+            sock->_callback(sock->_data);
+        }
+}
+
+/**----------------------------------------------------------
+* @brief  configure and activate an additional PDP context
+* @param  pdp_id: context id, 1-16
+*         apn, username, password: context credentials
+* @retval nsapi_error_t
+*/
+nsapi_error_t BG96Interface::activate_context(int pdp_id, const char *apn, const char *username, const char *password)
+{
+    BG96_PDP_Ctx  ctx = { pdp_id, apn, username? username : "", password? password : "" };
+    nsapi_error_t ret = NSAPI_ERROR_DEVICE_ERROR;
+
+    debugOutput(DBGMSG_DRV,"BG96Interface::activate_context(%d,%s) ENTER",pdp_id,apn);
+    if( pdp_id < 1 || pdp_id > 16 || apn == NULL )
+        return NSAPI_ERROR_PARAMETER;
+
+    dbgIO_lock;
+    if( _BG96.configure_pdp_context(&ctx) == pdp_id )
+        ret = _BG96.connect(pdp_id);
+    dbgIO_unlock;
+    debugOutput(DBGMSG_DRV,"BG96Interface::activate_context EXIT (%d)",ret);
+    return ret;
+}
+
+/**----------------------------------------------------------
+* @brief  deactivate a PDP context activated with activate_context
+* @param  pdp_id: context id, 1-16
+* @retval nsapi_error_t
+*/
+nsapi_error_t BG96Interface::deactivate_context(int pdp_id)
+{
+    bool ok;
+
+    debugOutput(DBGMSG_DRV,"BG96Interface::deactivate_context(%d)",pdp_id);
+    if( pdp_id < 1 || pdp_id > 16 )
+        return NSAPI_ERROR_PARAMETER;
+
+    dbgIO_lock;
+    ok = _BG96.disconnect(pdp_id);
+    dbgIO_unlock;
+    return ok? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
+}
+
+/**----------------------------------------------------------
+* @brief  Get the timeout used for a command and its latencies
+* @param  cmd: the command
+*         timing: structure to receive the values
+* @retval none
+*/
+void BG96Interface::getCommandTiming(BG96_CMD cmd, BG96_CMD_TIMING &timing)
+{
+    _BG96.getCommandTiming(cmd, timing);
+}
+
+/**----------------------------------------------------------
+* @brief  Get the AT channel watchdog counters
+* @param  stats: structure to receive the counters
+* @retval none
+*/
+void BG96Interface::getWatchdogStats(BG96_WD_STATS &stats)
+{
+    _BG96.getWatchdogStats(stats);
+}
+
+/**----------------------------------------------------------
+* @brief  Get the startup timeline
+* @param  tl: structure to receive the timeline
+* @retval none
+*/
+void BG96Interface::getStartupTimeline(BG96_BOOT_TIMELINE &tl)
+{
+    _BG96.getStartupTimeline(tl);
+}
+
+/**----------------------------------------------------------
+* @brief  Print the startup timeline
+* @param  none
+* @retval none
+*/
+void BG96Interface::printStartupTimeline(void)
+{
+    BG96_BOOT_TIMELINE tl;
+
+    _BG96.getStartupTimeline(tl);
+    dbgIO_lock;
+    printf("[BG96 Driver]: startup timeline (ms)\r\n");
+    for( int s=0; s<BG96_BOOT_COUNT; s++ ) {
+        if( tl.start[s] < 0 )
+            printf("  %-10s  not run\r\n", BG96::bootStepName((BG96_BOOT_STEP)s));
+        else if( tl.end[s] < 0 )
+            printf("  %-10s  %7d  ...\r\n", BG96::bootStepName((BG96_BOOT_STEP)s), (int)tl.start[s]);
+        else
+            printf("  %-10s  %7d  %7d  %6d %s\r\n", BG96::bootStepName((BG96_BOOT_STEP)s), (int)tl.start[s],
+                   (int)tl.end[s], (int)(tl.end[s]-tl.start[s]), tl.ok[s]? "":"failed");
+        }
+    dbgIO_unlock;
+}
+
+/**----------------------------------------------------------
+* @brief  Get the radio settings
+* @param  cfg: structure to receive the settings
+* @retval NSAPI_ERROR_OK on success
+*/
+int BG96Interface::getRadioConfig(BG96_RADIO_CFG &cfg)
+{
+    dbgIO_lock;
+    int rc = _BG96.getRadioConfig(cfg);
+    dbgIO_unlock;
+    return rc;
+}
+
+/**----------------------------------------------------------
+* @brief  Change the radio settings, takes effect on the next
+*         network search
+* @param  cfg: settings, "" or -1 leave a value unchanged
+* @retval NSAPI_ERROR_OK on success
+*/
+int BG96Interface::setRadioConfig(const BG96_RADIO_CFG &cfg)
+{
+    debugOutput(DBGMSG_DRV,"BG96Interface::setRadioConfig ENTER");
+    dbgIO_lock;
+    int rc = _BG96.setRadioConfig(cfg);
+    dbgIO_unlock;
+    debugOutput(DBGMSG_DRV,"BG96Interface::setRadioConfig EXIT");
+    return rc;
+}
+
 /**----------------------------------------------------------
 * @brief  attach function/callback to the socket
 *         Not used
@@ -450,6 +917,15 @@ int BG96Interface::setsockopt(void *handle, int level, int optname, const void *
         return NSAPI_ERROR_PARAMETER;
         }
 
+    if (level == BG96_SOCKOPT_LEVEL && optname == BG96_SOCKOPT_PDP_CONTEXT) {
+        if (optlen != sizeof(int) || !optval || *(const int*)optval < 0 || *(const int*)optval > 16)
+            return NSAPI_ERROR_PARAMETER;
+        if (sock->connected)
+            return NSAPI_ERROR_IS_CONNECTED;
+        sock->pdp_id = *(const int*)optval;
+        return NSAPI_ERROR_OK;
+        }
+
     if (level == NSAPI_SOCKET && sock->proto == NSAPI_TCP) {
         switch (optname) {
             case NSAPI_REUSEADDR:
@@ -493,6 +969,14 @@ int BG96Interface::getsockopt(void *handle, int level, int optname, void *optval
         return NSAPI_ERROR_PARAMETER;
     }
 
+    if (level == BG96_SOCKOPT_LEVEL && optname == BG96_SOCKOPT_PDP_CONTEXT) {
+        if (*optlen < sizeof(int))
+            return NSAPI_ERROR_PARAMETER;
+        *(int*)optval = sock->pdp_id;
+        *optlen = sizeof(int);
+        return NSAPI_ERROR_OK;
+        }
+
     if (level == NSAPI_SOCKET && sock->proto == NSAPI_TCP) {
         switch (optname) {
             case NSAPI_REUSEADDR:
@@ -539,7 +1023,7 @@ void BG96Interface::doDebug( int v )
 */
 int BG96Interface::socket_open(void **handle, nsapi_protocol_t proto)
 {
-    int           i;
+    int           i, cid=-1;
     nsapi_error_t ret=NSAPI_ERROR_OK;
 
     debugOutput(DBGMSG_DRV,"ENTER socket_open(), protocol=%s", (proto==NSAPI_TCP)?"TCP":"UDP");
@@ -547,8 +1031,20 @@ int BG96Interface::socket_open(void **handle, nsapi_protocol_t proto)
     for( i=0; i<BG96_SOCKET_COUNT; i++ )     //find the next available socket...
         if( g_sock[i].id == -1  )
             break;
+    if( i < BG96_SOCKET_COUNT )
+        g_sock[i].id = -2;                   //...reserve it while the BG96 is asked, without holding the lock
+    gvupdate_mutex.unlock();
 
-    if( i == BG96_SOCKET_COUNT ) {
+    if( i < BG96_SOCKET_COUNT ) {           //...and a connectID the BG96 is not still closing
+        dbgIO_lock;
+        cid = _BG96.allocSocket();
+        dbgIO_unlock;
+        }
+
+    gvupdate_mutex.lock();
+    if( i == BG96_SOCKET_COUNT || cid < 0 ) {
+        if( i < BG96_SOCKET_COUNT )
+            g_sock[i].id = -1;
         ret = NSAPI_ERROR_NO_SOCKET;
         debugOutput(DBGMSG_DRV,"EXIT socket_open; NO SOCKET AVAILABLE (%d)",i);
         }
@@ -559,14 +1055,16 @@ int BG96Interface::socket_open(void **handle, nsapi_protocol_t proto)
         g_socRx[i].m_rx_state = READ_START;
 
         g_sock[i].id          = i;
+        g_sock[i].cid         = cid;
         g_sock[i].disTO       = false;
         g_sock[i].proto       = proto;
         g_sock[i].connected   = false;
         g_sock[i]._callback   = NULL;
         g_sock[i]._data       = NULL;
+        g_sock[i].pdp_id      = 0;
         *handle = &g_sock[i];
-        debugOutput(DBGMSG_DRV,"EXIT socket_open; Socket=%d, protocol =%s",
-                i, (g_sock[i].proto==NSAPI_UDP)?"UDP":"TCP");
+        debugOutput(DBGMSG_DRV,"EXIT socket_open; Socket=%d, connectID=%d, protocol =%s",
+                i, cid, (g_sock[i].proto==NSAPI_UDP)?"UDP":"TCP");
         }
     gvupdate_mutex.unlock();
 
@@ -574,7 +1072,9 @@ int BG96Interface::socket_open(void **handle, nsapi_protocol_t proto)
 }
 
 /**----------------------------------------------------------
-*  @brief  close a socket
+*  @brief  close a socket, without waiting for the BG96. Its
+*          connectID is closed from the event queue and only
+*          reused once the BG96 answered
 *  @param  handle: Pointer to handle
 *  @return nsapi_error_t
 */
@@ -586,6 +1086,11 @@ int BG96Interface::socket_close(void *handle)
     TXEVENT       *txsock;
     int           i = sock->id;
 
+    // stop a socket_connect() still waiting on the BG96 before anything that may block:
+    // it holds dbgout_mutex, which debugOutput() takes in debug builds
+    if( i >= 0 )
+        _BG96.closeAsync(sock->cid);
+
     debugOutput(DBGMSG_DRV,"ENTER socket_close(); Socket=%d", i);
 
     if(i >= 0) {
@@ -596,19 +1101,21 @@ int BG96Interface::socket_close(void *handle)
         txsock->m_tx_state = TX_IDLE;
         rxsock->m_rx_state = READ_START;
 
-        dbgIO_lock;
-        if( sock->connected ) 
-            _BG96.close(sock->id);
-        dbgIO_unlock;
-
         sock->id       = -1;
+        sock->cid      = -1;
         sock->disTO    = false;
         sock->proto    = NSAPI_TCP;
         sock->connected= false;
         sock->_callback= NULL;
         sock->_data    = NULL;
+        sock->pdp_id   = 0;
         ret = NSAPI_ERROR_OK;
         txrx_mutex.unlock();
+
+        gvupdate_mutex.lock();
+        if( g_drain_id == 0 )               //one drain closes every pending connectID
+            g_drain_id = _bg96_queue.call(mbed::Callback<void()>(this, &BG96Interface::_drain_sockets));
+        gvupdate_mutex.unlock();
         debugOutput(DBGMSG_DRV,"EXIT socket_close(), socket %d - success",i);
         }
     else
@@ -616,6 +1123,31 @@ int BG96Interface::socket_close(void *handle)
     return ret;
 }
 
+/**----------------------------------------------------------
+*  @brief  close the connectIDs of closed sockets, retried
+*          until the BG96 answers for all of them. Only one
+*          drain is scheduled at a time (g_drain_id)
+*  @param  none
+*  @return none
+*/
+void BG96Interface::_drain_sockets(void)
+{
+    int left;
+
+    gvupdate_mutex.lock();
+    g_drain_id = 0;
+    gvupdate_mutex.unlock();
+
+    dbgIO_lock;
+    left = _BG96.drainSockets();
+    dbgIO_unlock;
+
+    gvupdate_mutex.lock();
+    if( left > 0 && g_drain_id == 0 )
+        g_drain_id = _bg96_queue.call_in(SOCK_DRAIN_RETRY, mbed::Callback<void()>(this, &BG96Interface::_drain_sockets));
+    gvupdate_mutex.unlock();
+}
+
 /**----------------------------------------------------------
 *  @brief  accept connections from remote sockets
 *  @param  handle: Pointer to handle of client socket (connecting)
@@ -638,6 +1170,7 @@ int BG96Interface::socket_connect(void *handle, const SocketAddress &addr)
     BG96SOCKET    *sock = (BG96SOCKET *)handle;
     nsapi_error_t ret=NSAPI_ERROR_OK;
     const char    proto = (sock->proto == NSAPI_UDP) ? 'u' : 't';
+    const int     cid = sock->cid;
     bool          k;
     int           cnt;
 
@@ -645,14 +1178,14 @@ int BG96Interface::socket_connect(void *handle, const SocketAddress &addr)
     debugOutput(DBGMSG_DRV,"ENTER socket_connect(); Socket=%d; IP=%s; PORT=%d;", 
                  sock->id, addr.get_ip_address(), addr.get_port());
     dbgIO_lock;
-    for( k=true, cnt=0; cnt<3 && k; cnt++ ) {
-        k = !_BG96.open(proto, sock->id, addr.get_ip_address(), addr.get_port()); 
-        if( k ) 
-            _BG96.close(sock->id);
+    for( k=true, cnt=0; cnt<3 && k && sock->cid == cid; cnt++ ) {
+        k = !_BG96.open(proto, cid, addr.get_ip_address(), addr.get_port(), sock->pdp_id); 
+        if( k && sock->cid == cid ) 
+            _BG96.close(cid);
         }
     dbgIO_unlock;
 
-    if( cnt<3 ) {
+    if( !k ) {
         sock->addr = addr;
         sock->connected = true;
 
@@ -698,6 +1231,7 @@ nsapi_error_t BG96Interface::gethostbyname(const char* name, SocketAddress *addr
         dbgIO_lock;
         ok=_BG96.resolveUrl(name,ipstr);
         dbgIO_unlock;
+        iter++;
     }
 
     if( !ok ) {
@@ -712,6 +1246,189 @@ nsapi_error_t BG96Interface::gethostbyname(const char* name, SocketAddress *addr
     return ret;
 }
 
+/**----------------------------------------------------------
+*  @brief  start looking up the IP address of a URL name. The BG96
+*          reports the result with a URC, which is returned to the
+*          application from the event queue.
+*  @param  name = URL string
+*          cb = callback to return the result with
+*          version = not used
+*  @return 0 if resolved immediately, negative on error or the
+*          request id
+*/
+nsapi_value_or_error_t BG96Interface::gethostbyname_async(const char *name, NetworkStack::hostbyname_cb_t cb, nsapi_version_t version)
+{
+    SocketAddress address;
+    BG96DNSREQ    *req=NULL;
+    int           id=0;
+    bool          ok;
+
+    debugOutput(DBGMSG_DRV,"ENTER gethostbyname_async(); URL=%s;", name);
+
+    if( address.set_ip_address(name) ) {
+        debugOutput(DBGMSG_DRV,"EXIT gethostbyname_async() -- already an IP address");
+        cb(NSAPI_ERROR_OK, &address);
+        return NSAPI_ERROR_OK;
+        }
+
+    gvupdate_mutex.lock();
+    for( int i=0; i<BG96_DNS_COUNT; i++ )       //find the next available request...
+        if( g_dns[i].id == 0 ) {
+            req = &g_dns[i];
+            break;
+            }
+    if( req != NULL ) {
+        if( ++g_dns_id <= 0 )
+            g_dns_id = 1;
+        id = g_dns_id;
+        req->id       = id;
+        req->state    = DNS_ACTIVE;
+        req->callback = cb;
+        req->owner    = this;
+        }
+    gvupdate_mutex.unlock();
+
+    if( req == NULL ) {
+        debugOutput(DBGMSG_DRV,"EXIT gethostbyname_async() -- too many DNS requests");
+        return NSAPI_ERROR_NO_MEMORY;
+        }
+
+    dbgIO_lock;
+    ok = _BG96.startResolveUrl(name, mbed::callback(&BG96Interface::_dns_urc, req));
+    dbgIO_unlock;
+
+    if( !ok ) {
+        gvupdate_mutex.lock();
+        req->id       = 0;
+        req->callback = NULL;
+        gvupdate_mutex.unlock();
+        debugOutput(DBGMSG_DRV,"EXIT gethostbyname_async() -- failed to start DNS");
+        return NSAPI_ERROR_DNS_FAILURE;
+        }
+
+    _dns_schedule();
+    debugOutput(DBGMSG_DRV,"EXIT gethostbyname_async(); request %d", id);
+    return id;
+}
+
+/**----------------------------------------------------------
+*  @brief  cancel a gethostbyname_async() request. The request slot
+*          is released when the BG96 answers the query.
+*  @param  id = request id returned by gethostbyname_async()
+*  @return nsapi_error_t
+*/
+nsapi_error_t BG96Interface::gethostbyname_async_cancel(int id)
+{
+    nsapi_error_t ret = NSAPI_ERROR_PARAMETER;
+
+    debugOutput(DBGMSG_DRV,"ENTER/EXIT gethostbyname_async_cancel(); request %d", id);
+    gvupdate_mutex.lock();
+    for( int i=0; i<BG96_DNS_COUNT && id > 0; i++ )
+        if( g_dns[i].id == id ) {
+            g_dns[i].callback = NULL;
+            ret = NSAPI_ERROR_OK;
+            }
+    gvupdate_mutex.unlock();
+    return ret;
+}
+
+/**----------------------------------------------------------
+*  @brief  called by the BG96 URC handler with the result of a DNS
+*          query. May execute on any thread using the BG96, so the
+*          result is only saved here and returned from the event queue.
+*  @param  req = request the result belongs to
+*          err = result of the query
+*          ip  = address string or NULL
+*  @return none
+*/
+void BG96Interface::_dns_urc(BG96DNSREQ *req, nsapi_error_t err, const char *ip)
+{
+    BG96Interface *intf = (BG96Interface*)req->owner;
+
+    intf->gvupdate_mutex.lock();
+    req->result = err;
+    if( err == NSAPI_ERROR_OK ) {
+        strncpy(req->ip, ip, sizeof(req->ip)-1);
+        req->ip[sizeof(req->ip)-1] = 0x00;
+        }
+    req->state = DNS_DOCB;
+    intf->gvupdate_mutex.unlock();
+    intf->_bg96_queue.call(mbed::Callback<void()>(intf,&BG96Interface::_dns_event));
+}
+
+/**----------------------------------------------------------
+*  @brief  event queue handler, return DNS results to the application
+*  @param  none
+*  @return none
+*/
+void BG96Interface::_dns_event(void)
+{
+    for( int i=0; i<BG96_DNS_COUNT; i++ ) {
+        NetworkStack::hostbyname_cb_t cb = NULL;
+        SocketAddress address;
+        nsapi_error_t result = NSAPI_ERROR_DNS_FAILURE;
+
+        gvupdate_mutex.lock();
+        if( g_dns[i].id != 0 && g_dns[i].state == DNS_DOCB ) {
+            cb     = g_dns[i].callback;
+            result = g_dns[i].result;
+            if( result == NSAPI_ERROR_OK )
+                address.set_ip_address(g_dns[i].ip);
+            g_dns[i].id       = 0;
+            g_dns[i].callback = NULL;
+            }
+        gvupdate_mutex.unlock();
+
+        if( cb ) {
+            debugOutput(DBGMSG_EQ,"Call DNS call-back, result %d, IP=%s", result, address.get_ip_address());
+            cb(result, (result == NSAPI_ERROR_OK)? &address : NULL);
+            }
+        }
+}
+
+/**----------------------------------------------------------
+*  @brief  make sure the event queue is running and checking for
+*          DNS results
+*  @param  none
+*  @return none
+*/
+void BG96Interface::_dns_schedule(void)
+{
+    gvupdate_mutex.lock();
+    if( _bg96_monitor.get_state() == Thread::Inactive ) 
+        g_bg96_queue_id = _bg96_monitor.start(callback(&_bg96_queue, &EventQueue::dispatch_forever));
+
+    if( !g_dns_polling ) {
+        g_dns_polling = true;
+        _bg96_queue.call_in(EQ_FREQ,mbed::Callback<void()>((BG96Interface*)this,&BG96Interface::_dns_poll));
+        }
+    gvupdate_mutex.unlock();
+}
+
+/**----------------------------------------------------------
+*  @brief  periodic event to process DNS URCs while requests are
+*          outstanding
+*  @param  none
+*  @return none
+*/
+void BG96Interface::_dns_poll(void)
+{
+    bool active = false;
+
+    dbgIO_lock;
+    _BG96.process_urc();
+    dbgIO_unlock;
+
+    gvupdate_mutex.lock();
+    for( int i=0; i<BG96_DNS_COUNT; i++ )
+        if( g_dns[i].id != 0 && g_dns[i].state == DNS_ACTIVE )
+            active = true;
+    g_dns_polling = active;
+    if( active )
+        _bg96_queue.call_in(EQ_FREQ,mbed::Callback<void()>((BG96Interface*)this,&BG96Interface::_dns_poll));
+    gvupdate_mutex.unlock();
+}
+
 /**----------------------------------------------------------
 * @brief  send data to a udp socket
 * @param  handle: Pointer to handle
@@ -757,7 +1474,7 @@ int BG96Interface::socket_send(void *handle, const void *data, unsigned size)
 
     switch( txsock->m_tx_state ) {
         case TX_IDLE:
-            txsock->m_tx_socketID  = sock->id;
+            txsock->m_tx_socketID  = sock->cid;
             txsock->m_tx_state     = TX_STARTING;
             txsock->m_tx_dptr      = (uint8_t*)data;
             txsock->m_tx_orig_size = size;
@@ -847,7 +1564,7 @@ int BG96Interface::socket_recv(void *handle, void *data, unsigned size)
     switch( rxsock->m_rx_state ) {
         case READ_START:  //need to start a read sequence of events
             rxsock->m_rx_disTO     = sock->disTO;
-            rxsock->m_rx_socketID  = sock->id;
+            rxsock->m_rx_socketID  = sock->cid;
             rxsock->m_rx_state     = READ_INIT;
             rxsock->m_rx_dptr      = (uint8_t*)data;
             rxsock->m_rx_req_size  = (uint32_t)size;
@@ -1080,11 +1797,222 @@ bool BG96Interface::getGNSSLocation(GNSSLoc& loc)
     return done;
 }
 
+/**----------------------------------------------------------
+*  @brief  take a free TLS pool slot, or the one of the connection
+*          idle for the longest time. gvupdate_mutex must be held;
+*          the socket of a new slot is created by _tls_socket()
+*  @param  set to true if the slot holds an idle connection the
+*          caller must close
+*  @return slot index, -1 if all the sockets are in use
+*/
+int BG96Interface::_tls_take(bool &evict)
+{
+    int i, oldest = -1;
+
+    evict = false;
+    for( i=0; i<MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS; i++ ) {
+        if( !_tls_used[i] )
+            break;
+        if( _tls_conn[i].idle && (oldest < 0 || _tls_conn[i].idle_since < _tls_conn[oldest].idle_since) )
+            oldest = i;
+        }
+    if( i == MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS ) {
+        if( oldest < 0 )
+            return -1;
+        i = oldest;
+        evict = true;
+        }
+    _tls_used[i] = true;
+    _tls_conn[i].idle = false;
+    _tls_conn[i].host[0] = 0x00;
+    return i;
+}
+
+/**----------------------------------------------------------
+*  @brief  socket of a slot taken by _tls_take(), created on first
+*          use. Called without gvupdate_mutex, as the constructor
+*          takes an SSL context from the BG96
+*  @param  slot index
+*  @return TLS socket
+*/
+BG96TLSSocket * BG96Interface::_tls_socket(int i)
+{
+    BG96TLSSocket *tls;
+
+    gvupdate_mutex.lock();
+    tls = _tls[i];
+    gvupdate_mutex.unlock();
+    if( tls == NULL ) {
+        tls = new BG96TLSSocket(&_BG96);            //the slot is taken, no one else creates it
+        gvupdate_mutex.lock();
+        _tls[i] = tls;
+        gvupdate_mutex.unlock();
+        }
+    return tls;
+}
+
 BG96TLSSocket * BG96Interface::getBG96TLSSocket()
 {
-    BG96* bg96 = &_BG96;
-    if (_tls == NULL) _tls = new BG96TLSSocket(bg96);
-    return _tls;
+    BG96TLSSocket *tls = NULL;
+    bool evict;
+    int i;
+
+    gvupdate_mutex.lock();
+    i = _tls_take(evict);
+    gvupdate_mutex.unlock();
+    if( i >= 0 )
+        tls = _tls_socket(i);
+    if( evict )
+        tls->reset();                       //the idle connection belonged to another user
+    debugOutput(DBGMSG_DRV,"getBG96TLSSocket %s", tls? "done":"failed, pool empty");
+    return tls;
+}
+
+void BG96Interface::discardBG96TLSSocket(BG96TLSSocket * tls)
+{
+    if (tls == NULL) return;
+    tls->reset();                           //the next user must not inherit the credentials
+    gvupdate_mutex.lock();
+    for( int i=0; i<MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS; i++ )
+        if( _tls[i] == tls ) {
+            _tls_used[i] = false;
+            _tls_conn[i].idle = false;
+            _tls_conn[i].host[0] = 0x00;
+            }
+    gvupdate_mutex.unlock();
+}
+
+/**----------------------------------------------------------
+*  @brief  hand out a connection to host:port, an idle one when
+*          the BG96 still has it open (AT+QSSLSTATE), otherwise
+*          connect a pool socket. A dropped idle connection is
+*          reconnected on the same SSL context, so the TLS session
+*          cached there is resumed; one opened with other credentials
+*          is reset and connected with the ones given
+*  @param  host and port of the server
+*  @param  credentials used for a new connection, NULL if unused
+*  @return connected TLS socket, NULL on failure
+*/
+BG96TLSSocket * BG96Interface::getBG96TLSConnection(const char *host, int port, const char *root_ca_pem,
+                                                    const char *client_cert_pem, const char *client_key_pem)
+{
+    BG96TLSSocket *tls = NULL;
+    bool evict = false, warm = false;
+    uint32_t cred;
+    int i;
+
+    if( host == NULL )
+        return NULL;
+    cred = BG96::credentialHash(client_key_pem, BG96::credentialHash(client_cert_pem, BG96::credentialHash(root_ca_pem)));
+    gvupdate_mutex.lock();
+    for( i=0; i<MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS; i++ )
+        if( _tls_used[i] && _tls_conn[i].idle && _tls_conn[i].port == port && strcmp(_tls_conn[i].host, host) == 0 )
+            break;
+    if( i < MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS ) {
+        _tls_conn[i].idle = false;
+        warm = (_tls_conn[i].cred == cred);
+        evict = !warm;                                  //opened with other credentials, not handed out
+        _tls_conn[i].cred = cred;
+        }
+    else if( (i = _tls_take(evict)) >= 0 ) {
+        strncpy(_tls_conn[i].host, host, sizeof(_tls_conn[i].host)-1);
+        _tls_conn[i].host[sizeof(_tls_conn[i].host)-1] = 0x00;
+        _tls_conn[i].port = port;
+        _tls_conn[i].cred = cred;
+        }
+    gvupdate_mutex.unlock();
+    if( i >= 0 )
+        tls = _tls_socket(i);
+
+    if( tls == NULL ) {
+        debugOutput(DBGMSG_DRV,"getBG96TLSConnection %s:%d failed, pool in use", host, port);
+        return NULL;
+        }
+    if( warm && tls->is_connected() ) {
+        debugOutput(DBGMSG_DRV,"getBG96TLSConnection %s:%d reused", host, port);
+        return tls;
+        }
+    if( evict )
+        tls->reset();                                   //evicted, drop the previous user's credentials
+    else
+        tls->close();                                   //closed by the server while idle
+    if( (!warm && root_ca_pem != NULL && tls->set_root_ca_cert(root_ca_pem) != NSAPI_ERROR_OK) ||
+        (!warm && client_cert_pem != NULL && tls->set_client_cert_key(client_cert_pem, client_key_pem) != NSAPI_ERROR_OK) ||
+        tls->connect(host, port) != NSAPI_ERROR_OK ) {
+        discardBG96TLSSocket(tls);
+        debugOutput(DBGMSG_DRV,"getBG96TLSConnection %s:%d failed to connect", host, port);
+        return NULL;
+        }
+    debugOutput(DBGMSG_DRV,"getBG96TLSConnection %s:%d %s", host, port, warm? "reconnected":"connected");
+    return tls;
+}
+
+/**----------------------------------------------------------
+*  @brief  keep a connection open for the next request to the
+*          same server; one that is no longer connected, or still
+*          has response bytes unread, is closed
+*  @param  socket returned by getBG96TLSConnection()
+*  @return none
+*/
+void BG96Interface::releaseBG96TLSConnection(BG96TLSSocket * tls)
+{
+    bool unread;
+    int i;
+
+    if( tls == NULL )
+        return;
+    // the tail of this response must not be read by the next request
+    unread = tls->available() > 0 || (tls->get_client_id() >= 0 && _BG96.sslChkRxAvail(tls->get_client_id()));
+    gvupdate_mutex.lock();
+    for( i=0; i<MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS; i++ )
+        if( _tls[i] == tls )
+            break;
+    if( i == MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS || !_tls_used[i] || _tls_conn[i].host[0] == 0x00 ||
+        tls->get_client_id() < 0 || unread ) {
+        gvupdate_mutex.unlock();
+        discardBG96TLSSocket(tls);
+        return;
+        }
+    _tls_conn[i].idle = true;
+    _tls_conn[i].idle_since = Kernel::get_ms_count();
+    if( _tls_expire_id == 0 )
+        _tls_expire_id = _bg96_queue.call_in(MBED_CONF_BG96_LIBRARY_BG96_TLS_IDLE_TIMEOUT,
+                                             mbed::Callback<void()>(this, &BG96Interface::_tls_expire));
+    gvupdate_mutex.unlock();
+}
+
+/**----------------------------------------------------------
+*  @brief  close the connections idle for longer than the idle
+*          timeout and schedule the next check
+*  @param  none
+*  @return none
+*/
+void BG96Interface::_tls_expire(void)
+{
+    BG96TLSSocket *expired[MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS];
+    uint64_t now = Kernel::get_ms_count(), next = 0;
+    int n = 0;
+
+    gvupdate_mutex.lock();
+    _tls_expire_id = 0;
+    for( int i=0; i<MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS; i++ ) {
+        if( !_tls_used[i] || !_tls_conn[i].idle )
+            continue;
+        if( now - _tls_conn[i].idle_since >= MBED_CONF_BG96_LIBRARY_BG96_TLS_IDLE_TIMEOUT ) {
+            _tls_conn[i].idle = false;                  //stays used until closed below
+            expired[n++] = _tls[i];
+            }
+        else if( next == 0 || _tls_conn[i].idle_since + MBED_CONF_BG96_LIBRARY_BG96_TLS_IDLE_TIMEOUT < next )
+            next = _tls_conn[i].idle_since + MBED_CONF_BG96_LIBRARY_BG96_TLS_IDLE_TIMEOUT;
+        }
+    if( next != 0 )
+        _tls_expire_id = _bg96_queue.call_in((int)(next - now), mbed::Callback<void()>(this, &BG96Interface::_tls_expire));
+    gvupdate_mutex.unlock();
+
+    for( int k=0; k<n; k++ ) {
+        debugOutput(DBGMSG_DRV,"_tls_expire closing idle TLS connection");
+        discardBG96TLSSocket(expired[k]);
+        }
 }
 
 BG96MQTTClient * BG96Interface::getBG96MQTTClient(BG96TLSSocket* tls)
@@ -1092,6 +2020,7 @@ BG96MQTTClient * BG96Interface::getBG96MQTTClient(BG96TLSSocket* tls)
     BG96* bg96 = &_BG96;
     if (_mqtt != NULL) return _mqtt;
     if (tls == NULL) tls = getBG96TLSSocket();
+    if (tls == NULL) return NULL;
     _mqtt = new BG96MQTTClient(bg96, tls);
     return _mqtt;
 }
@@ -58,11 +58,16 @@
 #include "FSInterface.h"
 #include "FSImplementation.h"
 #include "BG96TLSSocket.h"
+#include "BG96McuTLSSocket.h"
 #include "BG96MQTTClient.h"
 
 //#define APN_DEFAULT          "m2m.com.attz"
 //#define BG96_MISC_TIMEOUT    15000
 #define BG96_SOCKET_COUNT    5
+#define BG96_DNS_COUNT       BG96_DNS_QUEUE_SIZE
+
+#define BG96_SOCKOPT_LEVEL        0x4236  //setsockopt level of the BG96 specific options
+#define BG96_SOCKOPT_PDP_CONTEXT  1       //int, PDP context the socket connects through, 0 for the default
 
 #define DBGMSG_DRV           0x04
 #define DBGMSG_EQ            0x08
@@ -101,6 +106,7 @@ typedef struct tx_event_t {
  */
 typedef struct _socket_t {
     int              id;                   //nbr given by BG96 driver or -1 if not used
+    int              cid;                  //BG96 connectID of the socket, -1 if not used
     SocketAddress    addr;                 //address this socket is attached to
     bool             disTO;                //true of socket is listening for incomming data
     nsapi_protocol_t proto;                //TCP or UDP
@@ -109,8 +115,32 @@ typedef struct _socket_t {
     void             *_data;               //callback data to be returned
     void             *dptr_last;           //pointer to the last data buffer used
     unsigned         dptr_size;            //the size of the last user data buffer
+    int              pdp_id;               //PDP context used by the socket, 0 for the default context
     } BG96SOCKET;
 
+/** BG96_dns class
+ *  Outstanding gethostbyname_async() request
+ */
+typedef struct _dns_req_t {
+    int              id;                   //id returned to the application, 0 if not used
+    int              state;                //state of the DNS request
+    nsapi_error_t    result;               //result reported by the BG96
+    char             ip[NSAPI_IP_SIZE];    //address reported by the BG96
+    NetworkStack::hostbyname_cb_t callback;//callback used to return the result, NULL if cancelled
+    void             *owner;               //BG96Interface that issued the request
+    } BG96DNSREQ;
+
+/** BG96TLSCONN
+ *  Keep-alive state of a TLS pool socket
+ */
+typedef struct _tls_conn_t {
+    char             host[64];             //server of a keep-alive connection, empty if none
+    int              port;
+    uint32_t         cred;                 //BG96::credentialHash() of the CA, client certificate and key it was opened with
+    bool             idle;                 //released, kept open for the next request to this server
+    uint64_t         idle_since;           //ms when it was released
+    } BG96TLSCONN;
+
 
 class BG96Interface : public NetworkStack, public NetworkInterface, public GNSSInterface, public FSInterface
 {
@@ -161,18 +191,93 @@ public:
      */
     virtual const char *get_mac_address();
  
+   /** Configure and activate an additional PDP context. Sockets bind to it
+     *  with setsockopt(BG96_SOCKOPT_LEVEL, BG96_SOCKOPT_PDP_CONTEXT), TLS
+     *  sockets and MQTT clients with their own set_pdp_context/configure_pdp_context
+     *
+     *  @param pdp_id   context id, 1-16
+     *  @param apn      APN of the context
+     *  @param user     Optional, username
+     *  @param pass     Optional, password
+     *  @return         nsapi_error_t
+     */
+    nsapi_error_t activate_context(int pdp_id, const char *apn, const char *username = 0, const char *password = 0);
+
+   /** Deactivate a PDP context activated with activate_context
+     *
+     *  @param pdp_id   context id, 1-16
+     *  @return         nsapi_error_t
+     */
+    nsapi_error_t deactivate_context(int pdp_id);
+
    /** Query Module RSSI
      *
      * @return          RSSI value
      */
     int get_rssi(void);
 
+   /** Register a callback for network status changes. The callback is
+     *  called from the driver event queue when the connection goes down
+     *  and when it has been recovered.
+     *
+     *  @param status_cb    callback for status changes
+     */
+    virtual void attach(mbed::Callback<void(nsapi_event_t, intptr_t)> status_cb);
+
+   /** Get the connection status
+     *
+     *  @return         NSAPI_STATUS_GLOBAL_UP when connected, NSAPI_STATUS_CONNECTING
+     *                  while connecting or recovering, NSAPI_STATUS_DISCONNECTED otherwise
+     */
+    virtual nsapi_connection_status_t get_connection_status() const;
+
    /** Query Module SW revision
      *
      *  @return         SW Revision string
      */
     const char* getRevision(void);
 
+   /** Get the timeout used for a long BG96 command and the latencies it
+     *  was learned from
+     *
+     *  @param          the command
+     *  @param          structure to receive the values
+     */
+    void getCommandTiming(BG96_CMD cmd, BG96_CMD_TIMING &timing);
+
+   /** Get the AT channel watchdog counters: unanswered commands, restarts
+     *  and the time they took
+     *
+     *  @param          structure to receive the counters
+     */
+    void getWatchdogStats(BG96_WD_STATS &stats);
+
+   /** Get when each step of the last startup and connect ran, steps that
+     *  do not need the network overlap the registration wait
+     *
+     *  @param          structure to receive the timeline
+     */
+    void getStartupTimeline(BG96_BOOT_TIMELINE &tl);
+
+   /** Print the startup timeline, one line per step with its start, end
+     *  and duration
+     */
+    void printStartupTimeline(void);
+
+   /** Query the radio settings (RAT search order and mode, IoT mode, bands)
+     *
+     *  @param          structure to receive the settings
+     *  @return         NSAPI_ERROR_OK on success
+     */
+    int getRadioConfig(BG96_RADIO_CFG &cfg);
+
+   /** Change the radio settings, only values that differ are written
+     *
+     *  @param          settings, "" or -1 leave a value unchanged
+     *  @return         NSAPI_ERROR_OK on success
+     */
+    int setRadioConfig(const BG96_RADIO_CFG &cfg);
+
    /** Query registered state 
      *
      *  @return         true if registerd, false if not 
@@ -211,8 +316,43 @@ public:
      */  
     bool initializeGNSS(void);
 
+   /** Get a TLS socket from the pool. Each one has its own SSL context and
+     *  client ID, so several can be connected at the same time
+     *
+     *  @return         TLS socket, NULL if all MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS are in use
+     */
     BG96TLSSocket * getBG96TLSSocket();
 
+   /** Close a TLS socket and give it back to the pool, its credentials
+     *  and settings are dropped so the next user starts clean
+     *
+     *  @param          socket returned by getBG96TLSSocket()
+     */
+    void discardBG96TLSSocket(BG96TLSSocket * tls);
+
+   /** Get a connection to a server from the TLS keep-alive pool. An idle
+     *  connection to the same host and port, opened with the same
+     *  credentials, is handed out when the BG96 still reports it open,
+     *  otherwise a pool socket is connected with the credentials given
+     *
+     *  @param          host name of the server
+     *  @param          port of the server
+     *  @param          CA certificate, NULL if not used
+     *  @param          client certificate and key, NULL if not used
+     *  @return         connected TLS socket, NULL if the pool is in use or the connection failed
+     */
+    BG96TLSSocket * getBG96TLSConnection(const char *host, int port, const char *root_ca_pem=NULL,
+                                         const char *client_cert_pem=NULL, const char *client_key_pem=NULL);
+
+   /** Give a connection back to the keep-alive pool. It stays open for
+     *  MBED_CONF_BG96_LIBRARY_BG96_TLS_IDLE_TIMEOUT ms, or until its pool
+     *  socket is needed for another server. A connection with response
+     *  bytes still unread is discarded instead
+     *
+     *  @param          socket returned by getBG96TLSConnection()
+     */
+    void releaseBG96TLSConnection(BG96TLSSocket * tls);
+
     BG96MQTTClient* getBG96MQTTClient(BG96TLSSocket* tls);
 
     void disallowPowerOff(void);
@@ -284,6 +424,25 @@ protected:
      */
     virtual nsapi_error_t gethostbyname(const char* name, SocketAddress *address, nsapi_version_t version);
 
+    /** Get Host IP by name without blocking. The result is returned
+     *  through the callback from the driver event queue.
+     *
+     *  @param name         Hostname to resolve
+     *  @param callback     Callback that is called with the result
+     *  @param version      not used
+     *  @return             0 on immediate success, negative on failure or
+     *                      a positive id that can be passed to cancel
+     */
+    virtual nsapi_value_or_error_t gethostbyname_async(const char *name, NetworkStack::hostbyname_cb_t callback,
+            nsapi_version_t version = NSAPI_UNSPEC);
+
+    /** Cancel a gethostbyname_async() request, the callback will not be called
+     *
+     *  @param id           id returned by gethostbyname_async()
+     *  @return             nsapi_error_t
+     */
+    virtual nsapi_error_t gethostbyname_async_cancel(int id);
+
 
     /** return a pointer to the NetworkStack object
      *
@@ -433,6 +592,21 @@ private:
     int        rx_event(RXEVENT *ptr);                  //called to RX data
     void       g_eq_event(void);                        //event queue to tx/rx
     void       _eq_schedule(void);
+    void       _dns_schedule(void);                     //start checking for DNS results
+    void       _dns_poll(void);                         //periodic check for DNS results
+    void       _dns_event(void);                        //return DNS results to the application
+    static void _dns_urc(BG96DNSREQ *req, nsapi_error_t err, const char *ip);
+    void       _set_status(nsapi_connection_status_t status);
+    void       _link_urc(BG96_LINK_EVENT ev, int cid);  //called by the BG96 URC handler
+    void       _link_event(BG96_LINK_EVENT ev);         //react to a link change from the event queue
+    void       _link_poll(void);                        //periodic check for link URCs while connected
+    void       _link_recover(void);                     //re-register and reactivate the PDP contexts
+    void       _context_recover(int cid);               //reactivate an additional context the network dropped
+    void       _drain_sockets(void);                    //close the connectIDs of closed sockets
+    void       _restore_sockets(void);                  //reopen the sockets lost when the BG96 was restarted
+    int        _tls_take(bool &evict);                  //take a TLS pool slot, evicting the oldest idle connection
+    BG96TLSSocket * _tls_socket(int i);                 //socket of a taken slot, created outside gvupdate_mutex
+    void       _tls_expire(void);                       //close the keep-alive connections idle for too long
 
     nsapi_error_t g_isInitialized;                      //TRUE if the BG96Interface is connected to the network
     int        g_bg96_queue_id;                         //the ID of the EventQueue used by the driver
@@ -441,6 +615,20 @@ private:
     BG96SOCKET g_sock[BG96_SOCKET_COUNT];               //
     TXEVENT    g_socTx[BG96_SOCKET_COUNT];              //
     RXEVENT    g_socRx[BG96_SOCKET_COUNT];              //
+    BG96DNSREQ g_dns[BG96_DNS_COUNT];                   //outstanding asynchronous DNS requests
+    int        g_dns_id;                                //last DNS request id handed out
+    bool       g_dns_polling;                           //true while _dns_poll is scheduled
+    int        g_drain_id;                              //event id of _drain_sockets, 0 if not scheduled
+
+    nsapi_connection_status_t g_conn_status;            //connection status reported to the application
+    mbed::Callback<void(nsapi_event_t, intptr_t)> g_status_cb;
+    int        g_link_poll_id;                          //event id of _link_poll, 0 if not scheduled
+    int        g_link_retry_id;                         //event id of _link_recover, 0 if not scheduled
+    int        g_link_backoff;                          //ms before the next recovery attempt
+    uint64_t   g_link_kick;                             //time the network search was last restarted, 0 if not during this outage
+    bool       g_link_reset;                            //true if the BG96 was restarted and sockets must be reopened
+    int        g_ctx_retry_id[BG96_PDP_MAX+1];          //event id of _context_recover per context, 0 if not scheduled
+    int        g_ctx_tries[BG96_PDP_MAX+1];             //failed reactivations of each additional context
 
     Thread     _bg96_monitor;                           //event queue thread
     EventQueue _bg96_queue;
@@ -450,7 +638,10 @@ private:
     BG96       _BG96;                                   //create the BG96 HW interface object
     
     FSImplementation *  _fs_imp;
-    BG96TLSSocket* _tls;
+    BG96TLSSocket* _tls[MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS];     //TLS socket pool, created on first use
+    bool        _tls_used[MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS];
+    BG96TLSCONN _tls_conn[MBED_CONF_BG96_LIBRARY_BG96_TLS_SOCKETS];  //keep-alive state of the pool sockets
+    int         _tls_expire_id;                                     //event id of _tls_expire, 0 if not scheduled
     BG96MQTTClient* _mqtt;
     bool        _power_off_allowed;
     #if  MBED_CONF_BG96_LIBRARY_BG96_DEBUG == true
@@ -33,9 +33,8 @@
 #include "mbed.h"
 #include "nsapi_types.h"
 
-//TODO: error mechanism to be reviewed. It may happen that getError will return an invalid error because another AT command
-// might have been fired which would have also failed for another reason after the initial fs related command failed. fs error should then 
-// be maintained in the BG96 core driver class and updated at each fs commande failure inside the mutex lock/unlock.
+// fs errors are the +CME ERROR codes recorded by the BG96 driver inside the failing fs command transaction,
+// so another AT command failing in between cannot overwrite them.
 
 FSImplementation::FSImplementation(BG96 *bg96)
 {
@@ -51,7 +50,7 @@ size_t FSImplementation::fs_free_size()
         _fs_error = error;
         return freesize;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return 0;
     }
 }
@@ -65,7 +64,7 @@ size_t FSImplementation::fs_total_size()
         _fs_error = error;
         return totalsize;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return 0;
     }  
 }
@@ -79,7 +78,7 @@ int FSImplementation::fs_total_number_of_files()
         _fs_error = error;
         return nfiles;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return 0;
     }
 }
@@ -93,7 +92,7 @@ size_t FSImplementation::fs_total_size_of_files()
         _fs_error = error;
         return sfiles;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return 0;
     }   
 }
@@ -106,7 +105,7 @@ size_t FSImplementation::fs_file_size(const char *filename)
         _fs_error = error;
         return filesize;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return 0;
     }
 }
@@ -119,7 +118,7 @@ bool FSImplementation::fs_file_exists(const char *filename)
         _fs_error = error;
         return true;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return false;
     }
 }
@@ -132,7 +131,7 @@ int FSImplementation::fs_delete_file(const char *filename)
         _fs_error = error;
         return 0;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return -1;
     }
 }
@@ -145,7 +144,7 @@ int FSImplementation::fs_upload_file(const char *filename, void *data, size_t si
         _fs_error = error;
         return 0;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return -1;
     }
 }
@@ -158,7 +157,7 @@ size_t FSImplementation::fs_download_file(const char *filename, void* data, int1
         _fs_error = error;
         return fsize;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return 0;
     }
 }
@@ -170,7 +169,7 @@ bool FSImplementation::fs_open(const char *filename, FILE_MODE mode, FILE_HANDLE
         _fs_error = error;
         return true;
     }
-    _bg96->getError(_fs_error);
+    _bg96->getLastError(BG96_OP_FS, _fs_error);
     return false;
 }
 
@@ -181,7 +180,7 @@ bool FSImplementation::fs_read(FILE_HANDLE fh, size_t length, void *data)
         _fs_error = error;
         return true;
     } else {
-        _bg96->getError(_fs_error);
+        _bg96->getLastError(BG96_OP_FS, _fs_error);
         return false;
     }
 }
@@ -193,7 +192,7 @@ bool FSImplementation::fs_write(FILE_HANDLE fh, size_t length, void *data)
         _fs_error = error;
         return true;
     }
-    _bg96->getError(_fs_error);
+    _bg96->getLastError(BG96_OP_FS, _fs_error);
     return false;
 }
 
@@ -204,7 +203,7 @@ bool FSImplementation::fs_seek(FILE_HANDLE fh, size_t offset)
         _fs_error = error;
         return true;
     }
-    _bg96->getError(_fs_error);
+    _bg96->getLastError(BG96_OP_FS, _fs_error);
     return false;   
 }
 
@@ -215,7 +214,7 @@ bool FSImplementation::fs_rewind(FILE_HANDLE fh)
         _fs_error = error;
         return true;
     }
-    _bg96->getError(_fs_error);
+    _bg96->getLastError(BG96_OP_FS, _fs_error);
     return false;   
 }
 
@@ -226,7 +225,7 @@ bool FSImplementation::fs_eof(FILE_HANDLE fh)
         _fs_error = error;
         return true;
     }
-    _bg96->getError(_fs_error);
+    _bg96->getLastError(BG96_OP_FS, _fs_error);
     return false;   
 }
 
@@ -237,7 +236,7 @@ bool FSImplementation::fs_get_offset(FILE_HANDLE fh, size_t &offset)
         _fs_error = error;
         return true;
     }
-    _bg96->getError(_fs_error);
+    _bg96->getLastError(BG96_OP_FS, _fs_error);
     return false;
 }
 
@@ -248,7 +247,7 @@ bool FSImplementation::fs_truncate(FILE_HANDLE fh, size_t offset)
         _fs_error = error;
         return true;
     }
-    _bg96->getError(_fs_error);
+    _bg96->getLastError(BG96_OP_FS, _fs_error);
     return false;
 }
 
@@ -259,7 +258,7 @@ bool FSImplementation::fs_close(FILE_HANDLE fh)
         _fs_error = error;
         return true;
     }
-    _bg96->getError(_fs_error);
+    _bg96->getLastError(BG96_OP_FS, _fs_error);
     return false;
 }
 
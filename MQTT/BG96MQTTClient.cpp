@@ -38,15 +38,37 @@
 #define RETURN_RC_IF_NEG(A,B)   A = B; \
                                 if (A < 0) return A
 
+#define QMTCFG_VERSION      "AT+QMTCFG=\"version\",%d,%d"
+#define QMTCFG_PDPCID       "AT+QMTCFG=\"pdpcid\",%d,%d"
+#define QMTCFG_WILL         "AT+QMTCFG=\"will\",%d,%d,%d,%d,\"%s\",\"%s\""
+#define QMTCFG_TIMEOUT      "AT+QMTCFG=\"timeout\",%d,%d,%d,%d"
+#define QMTCFG_SESSION      "AT+QMTCFG=\"session\",%d,%d"
+#define QMTCFG_KEEPALIVE    "AT+QMTCFG=\"keepalive\",%d,%d"
+#define QMTCFG_SSL          "AT+QMTCFG=\"ssl\",%d,%d,%d"
+
+/**
+ * @brief replace a string kept by the client with a heap copy of s
+ */
+static char* copy_string(char* old, const char* s)
+{
+    char* copy = NULL;
+    if (s != NULL && (copy = (char *)malloc(strlen(s)+1)) != NULL)
+        memcpy(copy, s, strlen(s)+1);
+    if (old != NULL) free(old);
+    return copy;
+}
+
 BG96MQTTClient::BG96MQTTClient(BG96* bg96, BG96TLSSocket* tls) //mqtt_thread(osPriorityNormal,2048,NULL,NULL)
 {
     _bg96 = bg96;
     _tls  = tls;
-    _tls->set_socket_id(2);
     _ctx.pdp_ctx_id  = DEFAULT_PDP;
-    _ctx.ssl_ctx_id  = 2;
+    _ctx.ssl_ctx_id  = _tls->get_sslctx_id();   //certificates are set through the TLS socket on its SSL context
     _ctx.mqtt_ctx_id = 0;
     _sublist = NULL;
+    _host = NULL;
+    _port = 0;
+    _client_id = _username = _password = NULL;
     _nmid = 1;
     _mqtt_thread = NULL;
     _running = false;
@@ -55,6 +77,10 @@ BG96MQTTClient::BG96MQTTClient(BG96* bg96, BG96TLSSocket* tls) //mqtt_thread(osP
 BG96MQTTClient::~BG96MQTTClient()
 {
     stopRunning();
+    _host = copy_string(_host, NULL);
+    _client_id = copy_string(_client_id, NULL);
+    _username = copy_string(_username, NULL);
+    _password = copy_string(_password, NULL);
 //    if (_sublist != NULL) freeSublist(); //maybe a good thing to record it and reactivate it on reconnection instead.
 }
 
@@ -72,35 +98,49 @@ void BG96MQTTClient::stopMQTTClient()
 
 nsapi_error_t BG96MQTTClient::configure_pdp_context(BG96_PDP_Ctx* pdp_ctx)
 {
-    return _bg96->configure_pdp_context(pdp_ctx);
+    int rc = _bg96->configure_pdp_context(pdp_ctx);
+    if (rc < 0) return rc;
+    return configure_mqtt_pdpcid(rc);
 }
 
 nsapi_error_t BG96MQTTClient::open(MQTTNetwork_Ctx* network_ctx)
 {
     int rc=-1;
-    char cmd[40];
     if (network_ctx == NULL) return NSAPI_ERROR_DEVICE_ERROR;
 
     if (_ctx.options == NULL) return NSAPI_ERROR_DEVICE_ERROR;
 
     if (_ctx.options->sslenable > 0) {
-        sprintf(cmd, "AT+QSSLCFG=\"sslversion\",%d,4",_ctx.ssl_ctx_id); //Quick turn around. TODO: Use a specific API.
-        _bg96->send_generic_cmd(cmd,BG96_AT_TIMEOUT);
-        sprintf(cmd, "AT+QSSLCFG=\"seclevel\",%d,1",_ctx.ssl_ctx_id); //Quick turn around. TODO: Use a specific API.
-        _bg96->send_generic_cmd(cmd,BG96_AT_TIMEOUT);       
         _tls->set_root_ca_cert(network_ctx->ca_cert.payload);
         _tls->set_client_cert_key(network_ctx->client_cert.payload,
                                   network_ctx->client_key.payload);
+        if (_tls->apply_profile() != NSAPI_ERROR_OK) {
+            debug("BG96MQTTClient: Error applying the SSL profile.\r\n");
+            return NSAPI_ERROR_DEVICE_ERROR;
+        }
 
     }
 
+    rc = open_network(network_ctx->hostname.payload, network_ctx->port);
+    if (rc == NSAPI_ERROR_OK) {
+        _host = copy_string(_host, network_ctx->hostname.payload);
+        _port = network_ctx->port;
+    }
+    return rc;
+}
 
-    // if (!_bg96->isConnected()) _bg96->connect(_ctx.pdp_ctx_id); //Check is needed or 
+nsapi_error_t BG96MQTTClient::open_network(const char* hostname, int port)
+{
+    int rc=-1;
+    if (!_bg96->isContextActive(_ctx.pdp_ctx_id) && _bg96->connect(_ctx.pdp_ctx_id) != NSAPI_ERROR_OK) {
+        debug("PDP context %d could not be activated\r\n", _ctx.pdp_ctx_id);
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
 
-    rc = _bg96->mqtt_open(network_ctx->hostname.payload, network_ctx->port); 
+    rc = _bg96->mqtt_open(hostname, port); 
     switch(rc) {
         case 0:
-            debug("Successfully opened MQTT Socket to %s:%d\r\n", network_ctx->hostname.payload, network_ctx->port);    
+            debug("Successfully opened MQTT Socket to %s:%d\r\n", hostname, port);    
             return NSAPI_ERROR_OK;
         case BG96_MQTT_NETWORK_ERROR_WRONG_PARAMETER:
             debug("BG96MQTTClient: Error opening network socket. Wrong parameter.\r\n");
@@ -125,26 +165,39 @@ nsapi_error_t BG96MQTTClient::open(MQTTNetwork_Ctx* network_ctx)
 
 nsapi_error_t BG96MQTTClient::close()
 {
+    _host = copy_string(_host, NULL);
     return _bg96->mqtt_close();
 }
 
 nsapi_error_t BG96MQTTClient::configure_mqtt(MQTTClientOptions* options)
 {
-    int rc=-1;
+    char cfg[6][48];
+    char will[256];
+    const char* cmds[7];
     if (options == NULL) return NSAPI_ERROR_DEVICE_ERROR;
-    RETURN_RC_IF_NEG(rc, configure_mqtt_version(options->version));
-    RETURN_RC_IF_NEG(rc, configure_mqtt_pdpcid(_ctx.pdp_ctx_id)); //TODO: replace value par MACRO in every place where pdp id is required
-    RETURN_RC_IF_NEG(rc, configure_mqtt_will(options->will_fg,
-                                             options->will_qos,
-                                             options->will_retain,
-                                             options->will_topic.payload,
-                                             options->will_msg.payload));
-    RETURN_RC_IF_NEG(rc, configure_mqtt_timeout(options->timeout,
-                                                options->retries,
-                                                options->timeout_notice));
-    RETURN_RC_IF_NEG(rc, configure_mqtt_session(options->cleansession));
-    RETURN_RC_IF_NEG(rc, configure_mqtt_keepalive(options->keepalive));
-    RETURN_RC_IF_NEG(rc, configure_mqtt_sslenable(options->sslenable));
+    // all QMTCFG settings go out in one batch, a failing setting is
+    // reported by the driver but does not stop the remaining ones
+    sprintf(cfg[0], QMTCFG_VERSION, _ctx.mqtt_ctx_id, options->version);
+    sprintf(cfg[1], QMTCFG_PDPCID, _ctx.mqtt_ctx_id, _ctx.pdp_ctx_id); //TODO: replace value par MACRO in every place where pdp id is required
+    snprintf(will, sizeof(will), QMTCFG_WILL, _ctx.mqtt_ctx_id, options->will_fg,
+                                                                options->will_qos,
+                                                                options->will_retain,
+                                                                options->will_topic.payload,
+                                                                options->will_msg.payload);
+    sprintf(cfg[2], QMTCFG_TIMEOUT, _ctx.mqtt_ctx_id, options->timeout,
+                                                      options->retries,
+                                                      options->timeout_notice);
+    sprintf(cfg[3], QMTCFG_SESSION, _ctx.mqtt_ctx_id, options->cleansession);
+    sprintf(cfg[4], QMTCFG_KEEPALIVE, _ctx.mqtt_ctx_id, options->keepalive);
+    sprintf(cfg[5], QMTCFG_SSL, _ctx.mqtt_ctx_id, options->sslenable, _ctx.ssl_ctx_id);
+    cmds[0] = cfg[0];
+    cmds[1] = cfg[1];
+    cmds[2] = will;
+    cmds[3] = cfg[2];
+    cmds[4] = cfg[3];
+    cmds[5] = cfg[4];
+    cmds[6] = cfg[5];
+    _bg96->send_batch(cmds, 7, BG96_AT_TIMEOUT);
     _ctx.options = options;
     return NSAPI_ERROR_OK;
 }
@@ -152,14 +205,15 @@ nsapi_error_t BG96MQTTClient::configure_mqtt(MQTTClientOptions* options)
 nsapi_error_t BG96MQTTClient::configure_mqtt_version(int version)
 {
     char cmd[80];
-    sprintf(cmd, "AT+QMTCFG=\"version\",%d,%d",_ctx.mqtt_ctx_id,version);
+    sprintf(cmd, QMTCFG_VERSION,_ctx.mqtt_ctx_id,version);
     return _bg96->send_generic_cmd(cmd, BG96_AT_TIMEOUT);
 }
 
 nsapi_error_t BG96MQTTClient::configure_mqtt_pdpcid(int pdp_id)
 {
     char cmd[80];
-    sprintf(cmd, "AT+QMTCFG=\"pdpcid\",%d,%d",_ctx.mqtt_ctx_id, pdp_id);
+    _ctx.pdp_ctx_id = pdp_id;   //open() activates this context if needed
+    sprintf(cmd, QMTCFG_PDPCID,_ctx.mqtt_ctx_id, pdp_id);
     return _bg96->send_generic_cmd(cmd, BG96_AT_TIMEOUT);
 }
 
@@ -170,7 +224,7 @@ nsapi_error_t BG96MQTTClient::configure_mqtt_will(  int will_fg,
                                                     const char* will_msg)
 {
     char cmd[256];
-    sprintf(cmd, "AT+QMTCFG=\"will\",%d,%d,%d,%d,\"%s\",\"%s\"",_ctx.mqtt_ctx_id, will_fg,
+    sprintf(cmd, QMTCFG_WILL,_ctx.mqtt_ctx_id, will_fg,
                                                                           will_qos,
                                                                           will_retain,
                                                                           will_topic,
@@ -181,28 +235,28 @@ nsapi_error_t BG96MQTTClient::configure_mqtt_will(  int will_fg,
 nsapi_error_t BG96MQTTClient::configure_mqtt_timeout(int timeout, int retries,int timeout_notice)
 {
     char cmd[80];
-    sprintf(cmd, "AT+QMTCFG=\"timeout\",%d,%d,%d,%d",_ctx.mqtt_ctx_id, timeout, retries, timeout_notice);
+    sprintf(cmd, QMTCFG_TIMEOUT,_ctx.mqtt_ctx_id, timeout, retries, timeout_notice);
     return _bg96->send_generic_cmd(cmd, BG96_AT_TIMEOUT);
 }
 
 nsapi_error_t BG96MQTTClient::configure_mqtt_session(int cleansession)
 {
     char cmd[80];
-    sprintf(cmd, "AT+QMTCFG=\"session\",%d,%d",_ctx.mqtt_ctx_id, cleansession);
+    sprintf(cmd, QMTCFG_SESSION,_ctx.mqtt_ctx_id, cleansession);
     return _bg96->send_generic_cmd(cmd, BG96_AT_TIMEOUT);
 }
 
 nsapi_error_t BG96MQTTClient::configure_mqtt_keepalive(int keepalive)
 {
     char cmd[80];
-    sprintf(cmd, "AT+QMTCFG=\"keepalive\",%d,%d",_ctx.mqtt_ctx_id, keepalive);
+    sprintf(cmd, QMTCFG_KEEPALIVE,_ctx.mqtt_ctx_id, keepalive);
     return _bg96->send_generic_cmd(cmd, BG96_AT_TIMEOUT);
 }
 
 nsapi_error_t BG96MQTTClient::configure_mqtt_sslenable(int sslenable)
 {
     char cmd[80];
-    sprintf(cmd, "AT+QMTCFG=\"ssl\",%d,%d,%d", _ctx.mqtt_ctx_id, sslenable, _ctx.ssl_ctx_id);
+    sprintf(cmd, QMTCFG_SSL, _ctx.mqtt_ctx_id, sslenable, _ctx.ssl_ctx_id);
     return _bg96->send_generic_cmd(cmd, BG96_AT_TIMEOUT);
 }
 
@@ -216,6 +270,11 @@ nsapi_error_t BG96MQTTClient::connect(MQTTConnect_Ctx* ctx)
                                                result);
     if (result.result == 0 && result.rc == 0)  {
         _running = true;
+        if (ctx->client_id.payload != _client_id) {     //restore() passes the copies back in
+            _client_id = copy_string(_client_id, ctx->client_id.payload);
+            _username = copy_string(_username, ctx->username.payload);
+            _password = copy_string(_password, ctx->password.payload);
+        }
         return NSAPI_ERROR_OK;
     }
     debug("BG96MQTT: Connect return result: %d and error code: %d\r\n", result.result, result.rc);
@@ -250,9 +309,41 @@ nsapi_error_t BG96MQTTClient::connect(MQTTConnect_Ctx* ctx)
 nsapi_error_t BG96MQTTClient::disconnect()
 {
    stopRunning();
+   _client_id = copy_string(_client_id, NULL);
+   _username = copy_string(_username, NULL);
+   _password = copy_string(_password, NULL);
    return _bg96->mqtt_disconnect(_ctx.mqtt_ctx_id);
 }
 
+nsapi_error_t BG96MQTTClient::restore()
+{
+    nsapi_error_t rc;
+    if (_host == NULL) return NSAPI_ERROR_OK; //nothing was open
+    // the QMTCFG and QSSLCFG settings were lost with the restart, the certificate files were not
+    if (_ctx.options != NULL) configure_mqtt(_ctx.options);
+    if (_ctx.options != NULL && _ctx.options->sslenable > 0 &&
+        (_tls->restore_credentials() != NSAPI_ERROR_OK || _tls->apply_profile() != NSAPI_ERROR_OK)) {
+        debug("BG96MQTTClient: Error restoring the TLS settings.\r\n");
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    rc = open_network(_host, _port);
+    if (rc != NSAPI_ERROR_OK || _client_id == NULL) return rc;
+    MQTTConnect_Ctx saved;
+    saved.client_id.payload = _client_id;
+    saved.client_id.len = strlen(_client_id);
+    saved.username.payload = _username;
+    saved.username.len = _username? strlen(_username) : 0;
+    saved.password.payload = _password;
+    saved.password.len = _password? strlen(_password) : 0;
+    rc = connect(&saved);
+    if (rc != NSAPI_ERROR_OK) return rc;
+    for (MQTTSubscription* sub = _sublist; sub != NULL; sub = (MQTTSubscription*)sub->next) {
+        if (_bg96->mqtt_subscribe(_ctx.mqtt_ctx_id, sub->topic.payload, sub->qos, sub->msg_id) != NSAPI_ERROR_OK)
+            debug("BG96MQTTClient: Could not subscribe again to %s\r\n", sub->topic.payload);
+    }
+    return rc;
+}
+
 nsapi_error_t BG96MQTTClient::subscribe(const char* topic, int qos, MQTTMessageHandler handler, void *param) {
     int rc=-1;
     char * atopic = (char *)malloc(strlen(topic)+1);
@@ -166,6 +166,18 @@ public:
 //    MQTTCONNECTSTATE    get_connect_state();
     nsapi_error_t       disconnect();                    //free connect struct here
 
+    /** Open, connect and subscribe again after the BG96 was restarted,
+     *  with the host, port and credentials of the last open() and
+     *  connect(). These are copied by open() and connect(), so the
+     *  contexts passed to them need not outlive the calls
+     */
+    nsapi_error_t       restore();
+
+    /** Stop an open() or connect() in progress from another thread, the
+     *  MQTT network is closed and the call fails
+     */
+    void                cancel() { _bg96->cancelMqtt(); }
+
 
 
     nsapi_error_t       subscribe(const char* topic, int qos, MQTTMessageHandler handler, void *param);
@@ -179,6 +191,7 @@ public:
     void                setSubscriptions(MQTTSubscription* subs) { _sublist = subs;};
     MQTTSubscription*   findSubscriptionByTopic(const char* topic);
 protected:
+    nsapi_error_t       open_network(const char* hostname, int port);
     int                 getNextMessageId(){ return _nmid++; }; // TODO: Modify this to limit to values in range or use simple LIFO buffer
     bool                append_subscription(MQTTSubscription* newsub);
     bool                remove_subscription(MQTTSubscription* subtoremove);
@@ -190,6 +203,11 @@ private:
     BG96*               _bg96;
     BG96TLSSocket*      _tls;
     MQTTClient_Ctx      _ctx;
+    char*               _host;      //copy of the host of the last successful open(), NULL once closed
+    int                 _port;
+    char*               _client_id; //copies of the credentials of the last successful connect(), NULL once disconnected
+    char*               _username;
+    char*               _password;
     MQTTSubscription*   _sublist;
     int                 _nmid; //next msg id
     bool                _running;
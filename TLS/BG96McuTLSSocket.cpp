@@ -0,0 +1,403 @@
+/**
+ * @file BG96McuTLSSocket.cpp
+ * @brief TLS client running mbedTLS on the MCU over a BG96Interface TCP socket
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include "BG96Interface.h"
+#include "BG96McuTLSSocket.h"
+
+#if MBED_CONF_BG96_LIBRARY_BG96_MCU_TLS
+
+BG96McuTLSSocket::BG96McuTLSSocket(BG96Interface *iface)
+{
+    stack = iface;
+    mbedtls_entropy_init(&entropy);
+    mbedtls_ctr_drbg_init(&drbg);
+    mbedtls_ssl_config_init(&conf);
+    mbedtls_ssl_init(&ssl);
+    mbedtls_x509_crt_init(&cacert);
+    mbedtls_x509_crt_init(&clientcert);
+    mbedtls_pk_init(&clientkey);
+    mbedtls_ssl_session_init(&session);
+    ready = connected = resumed = has_session = has_ca = has_client = false;
+    resume = true;
+    verify = true;
+    session_host[0] = 0x00;
+    session_port = 0;
+    timeout = BG96MCUTLS_DEFAULT_TO;
+}
+
+BG96McuTLSSocket::~BG96McuTLSSocket()
+{
+    close();
+    mbedtls_ssl_session_free(&session);
+    mbedtls_pk_free(&clientkey);
+    mbedtls_x509_crt_free(&clientcert);
+    mbedtls_x509_crt_free(&cacert);
+    mbedtls_ssl_free(&ssl);
+    mbedtls_ssl_config_free(&conf);
+    mbedtls_ctr_drbg_free(&drbg);
+    mbedtls_entropy_free(&entropy);
+}
+
+/**
+ * @brief seed the RNG and set up the SSL context, done by the first
+ *        connect() so that creating a socket costs no entropy
+ */
+bool BG96McuTLSSocket::setup()
+{
+    static const char pers[] = "BG96McuTLSSocket";
+    int rc;
+
+    if ((rc = mbedtls_ctr_drbg_seed(&drbg, mbedtls_entropy_func, &entropy,
+                                    (const unsigned char *)pers, sizeof(pers))) != 0 ||
+        (rc = mbedtls_ssl_config_defaults(&conf, MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_TRANSPORT_STREAM,
+                                          MBEDTLS_SSL_PRESET_DEFAULT)) != 0) {
+        debug("BG96McuTLSSocket: mbedTLS setup failed -0x%04X\r\n", -rc);
+        return false;
+    }
+    mbedtls_ssl_conf_rng(&conf, mbedtls_ctr_drbg_random, &drbg);
+#if defined(MBEDTLS_SSL_SESSION_TICKETS)
+    mbedtls_ssl_conf_session_tickets(&conf, MBEDTLS_SSL_SESSION_TICKETS_ENABLED);
+#endif
+    mbedtls_ssl_conf_authmode(&conf, verify? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE);
+    mbedtls_ssl_conf_ca_chain(&conf, &cacert, NULL);
+    if (has_client)
+        mbedtls_ssl_conf_own_cert(&conf, &clientcert, &clientkey);
+    if ((rc = mbedtls_ssl_setup(&ssl, &conf)) != 0) {
+        debug("BG96McuTLSSocket: mbedTLS setup failed -0x%04X\r\n", -rc);
+        return false;
+    }
+    mbedtls_ssl_set_bio(&ssl, this, bio_send, bio_recv, NULL);
+    ready = true;
+    return true;
+}
+
+int BG96McuTLSSocket::bio_send(void *ctx, const unsigned char *buf, size_t len)
+{
+    nsapi_size_or_error_t rc = ((BG96McuTLSSocket *)ctx)->tcp.send(buf, len);
+    if (rc == NSAPI_ERROR_WOULD_BLOCK)
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    return (rc < 0)? -1 : rc;
+}
+
+int BG96McuTLSSocket::bio_recv(void *ctx, unsigned char *buf, size_t len)
+{
+    nsapi_size_or_error_t rc = ((BG96McuTLSSocket *)ctx)->tcp.recv(buf, len);
+    if (rc == NSAPI_ERROR_WOULD_BLOCK)
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    return (rc < 0)? -1 : rc;
+}
+
+/**
+ * @brief turn the server certificate check off (or on again), before the
+ *        first connect(). It is on by default, so a socket without a CA
+ *        certificate only connects once the check is explicitly disabled.
+ */
+nsapi_error_t BG96McuTLSSocket::set_verify(bool enable)
+{
+    nsapi_error_t rc = NSAPI_ERROR_OK;
+
+    mutex.lock();
+    if (ready)
+        rc = NSAPI_ERROR_UNSUPPORTED;
+    else
+        verify = enable;
+    mutex.unlock();
+    return rc;
+}
+
+/**
+ * @brief parse the CA certificate, before the first connect()
+ */
+nsapi_error_t BG96McuTLSSocket::set_root_ca_cert(const char * root_ca_pem)
+{
+    nsapi_error_t rc = NSAPI_ERROR_OK;
+
+    if (root_ca_pem == NULL)
+        return NSAPI_ERROR_PARAMETER;
+    mutex.lock();
+    if (ready) {
+        rc = NSAPI_ERROR_UNSUPPORTED;
+    } else if (mbedtls_x509_crt_parse(&cacert, (const unsigned char *)root_ca_pem, strlen(root_ca_pem) + 1) != 0) {
+        debug("BG96McuTLSSocket: invalid CA certificate\r\n");
+        rc = NSAPI_ERROR_PARAMETER;
+    } else {
+        has_ca = true;
+    }
+    mutex.unlock();
+    return rc;
+}
+
+/**
+ * @brief parse the client certificate and key, before the first connect()
+ */
+nsapi_error_t BG96McuTLSSocket::set_client_cert_key(const char * client_cert_pem, const char * client_private_key_pem)
+{
+    nsapi_error_t rc = NSAPI_ERROR_OK;
+
+    if (client_cert_pem == NULL || client_private_key_pem == NULL)
+        return NSAPI_ERROR_PARAMETER;
+    mutex.lock();
+    if (ready) {
+        rc = NSAPI_ERROR_UNSUPPORTED;
+    } else if (mbedtls_x509_crt_parse(&clientcert, (const unsigned char *)client_cert_pem, strlen(client_cert_pem) + 1) != 0 ||
+               mbedtls_pk_parse_key(&clientkey, (const unsigned char *)client_private_key_pem,
+                                    strlen(client_private_key_pem) + 1, NULL, 0) != 0) {
+        debug("BG96McuTLSSocket: invalid client certificate or key\r\n");
+        rc = NSAPI_ERROR_PARAMETER;
+    } else {
+        has_client = true;
+    }
+    mutex.unlock();
+    return rc;
+}
+
+/**
+ * @brief drop the saved session, the next connect() does a full handshake
+ */
+void BG96McuTLSSocket::forget_session()
+{
+    mutex.lock();
+    mbedtls_ssl_session_free(&session);
+    mbedtls_ssl_session_init(&session);
+    has_session = false;
+    session_host[0] = 0x00;
+    mutex.unlock();
+}
+
+/**
+ * @brief open a TCP connection through the BG96 and run the handshake on
+ *        the MCU. The session saved by the previous connect() to the same
+ *        host and port is offered for resumption; is_resumed() tells if
+ *        the server accepted it.
+ */
+nsapi_error_t BG96McuTLSSocket::connect(const char* hostname, int port)
+{
+    SocketAddress addr;
+    uint64_t deadline;
+    bool offered;
+    int rc;
+
+    if (hostname == NULL)
+        return NSAPI_ERROR_PARAMETER;
+    mutex.lock();
+    if (connected) {
+        mutex.unlock();
+        return NSAPI_ERROR_IS_CONNECTED;
+    }
+    if (verify && !has_ca) {
+        debug("BG96McuTLSSocket: no CA certificate, set one or call set_verify(false)\r\n");
+        mutex.unlock();
+        return NSAPI_ERROR_AUTH_FAILURE;
+    }
+    if (!ready && !setup()) {
+        mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (stack->gethostbyname(hostname, &addr) != NSAPI_ERROR_OK) {
+        mutex.unlock();
+        return NSAPI_ERROR_DNS_FAILURE;
+    }
+    addr.set_port(port);
+    if (tcp.open(stack) != NSAPI_ERROR_OK) {
+        mutex.unlock();
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    tcp.set_timeout(this->timeout);
+    if (tcp.connect(addr) != NSAPI_ERROR_OK) {
+        debug("BG96McuTLSSocket: TCP connection to %s failed\r\n", hostname);
+        tcp.close();
+        mutex.unlock();
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+
+    mbedtls_ssl_session_reset(&ssl);
+    mbedtls_ssl_set_hostname(&ssl, hostname);
+    offered = resume && has_session && session_port == port && strcmp(session_host, hostname) == 0;
+    if (offered && mbedtls_ssl_set_session(&ssl, &session) != 0)
+        offered = false;
+    deadline = Kernel::get_ms_count() + BG96MCUTLS_HANDSHAKE_TO;
+    while ((rc = mbedtls_ssl_handshake(&ssl)) != 0) {
+        if ((rc != MBEDTLS_ERR_SSL_WANT_READ && rc != MBEDTLS_ERR_SSL_WANT_WRITE) || Kernel::get_ms_count() >= deadline)
+            break;
+    }
+    if (rc != 0) {
+        debug("BG96McuTLSSocket: handshake with %s failed -0x%04X\r\n", hostname, -rc);
+        tcp.close();
+        mutex.unlock();
+        if (offered)
+            forget_session();
+        return NSAPI_ERROR_AUTH_FAILURE;
+    }
+
+    // a resumed session keeps the master secret, a full handshake makes a new one
+    resumed = offered && memcmp(ssl.session->master, session.master, sizeof(session.master)) == 0;
+    if (resume) {                                   //a resumed handshake may come with a new ticket
+        mbedtls_ssl_session_free(&session);
+        mbedtls_ssl_session_init(&session);
+        has_session = mbedtls_ssl_get_session(&ssl, &session) == 0;
+        strncpy(session_host, hostname, sizeof(session_host) - 1);
+        session_host[sizeof(session_host) - 1] = 0x00;
+        session_port = port;
+    }
+    connected = true;
+    debug("BG96McuTLSSocket: %s handshake with %s, %s\r\n", resumed? "resumed" : "full", hostname,
+          mbedtls_ssl_get_ciphersuite(&ssl));
+    mutex.unlock();
+    return NSAPI_ERROR_OK;
+}
+
+/**
+ * @brief send all the data, waiting up to the socket timeout
+ * @return bytes sent, NSAPI_ERROR_WOULD_BLOCK if nothing could be sent
+ *         in time, NSAPI_ERROR_DEVICE_ERROR on error
+ */
+nsapi_error_t BG96McuTLSSocket::send(const void * data, nsapi_size_t size)
+{
+    uint64_t deadline = Kernel::get_ms_count() + this->timeout;
+    const unsigned char *p = (const unsigned char *)data;
+    nsapi_size_t sent = 0;
+    int rc = 0;
+
+    mutex.lock();
+    if (!connected) {
+        mutex.unlock();
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    while (sent < size) {
+        rc = mbedtls_ssl_write(&ssl, p + sent, size - sent);
+        if (rc > 0) {
+            sent += rc;
+            continue;
+        }
+        if ((rc != MBEDTLS_ERR_SSL_WANT_READ && rc != MBEDTLS_ERR_SSL_WANT_WRITE) || Kernel::get_ms_count() >= deadline)
+            break;
+    }
+    mutex.unlock();
+    if (sent > 0) return sent;
+    return (rc == MBEDTLS_ERR_SSL_WANT_WRITE || rc == MBEDTLS_ERR_SSL_WANT_READ)? NSAPI_ERROR_WOULD_BLOCK : NSAPI_ERROR_DEVICE_ERROR;
+}
+
+/**
+ * @brief receive data, waiting up to the socket timeout
+ * @return bytes received, 0 if the server closed the connection,
+ *         NSAPI_ERROR_TIMEOUT if nothing arrived in time
+ */
+nsapi_error_t BG96McuTLSSocket::recv(void * buffer, nsapi_size_t size)
+{
+    uint64_t deadline = Kernel::get_ms_count() + this->timeout;
+    int rc;
+
+    mutex.lock();
+    if (!connected) {
+        mutex.unlock();
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    while ((rc = mbedtls_ssl_read(&ssl, (unsigned char *)buffer, size)) < 0) {
+        if ((rc != MBEDTLS_ERR_SSL_WANT_READ && rc != MBEDTLS_ERR_SSL_WANT_WRITE) || Kernel::get_ms_count() >= deadline)
+            break;
+    }
+    mutex.unlock();
+    if (rc >= 0) return rc;
+    if (rc == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY) return 0;
+    return (rc == MBEDTLS_ERR_SSL_WANT_READ || rc == MBEDTLS_ERR_SSL_WANT_WRITE)? NSAPI_ERROR_TIMEOUT : NSAPI_ERROR_DEVICE_ERROR;
+}
+
+nsapi_error_t BG96McuTLSSocket::close()
+{
+    mutex.lock();
+    if (!connected) {
+        mutex.unlock();
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    mbedtls_ssl_close_notify(&ssl);
+    nsapi_error_t rc = tcp.close();
+    connected = false;
+    mutex.unlock();
+    return rc;
+}
+
+static bool was_resumed(BG96TLSSocket *sock)    { return sock->is_resumed(); }
+static bool was_resumed(BG96McuTLSSocket *sock) { return sock->is_resumed(); }
+
+/**
+ * @brief connect, send the request and read the response until the
+ *        server closes or stops sending, rounds times
+ */
+template <class S>
+static void bench_engine(S *sock, const char *hostname, int port, const char *request, int rounds, BG96_TLS_ENGINE_BENCH *r)
+{
+    uint64_t full_sum = 0, resumed_sum = 0;
+    char buf[256];
+
+    for (int n = 0; n < rounds; n++) {
+        uint64_t t0 = Kernel::get_ms_count();
+        if (sock->connect(hostname, port) != NSAPI_ERROR_OK) {
+            r->failed++;
+            continue;
+        }
+        uint64_t t1 = Kernel::get_ms_count();
+        if (was_resumed(sock)) {
+            r->resumed++;
+            resumed_sum += t1 - t0;
+        } else {
+            r->full++;
+            full_sum += t1 - t0;
+        }
+        if (request != NULL && sock->send(request, strlen(request)) == (nsapi_error_t)strlen(request)) {
+            uint64_t last = Kernel::get_ms_count();
+            nsapi_error_t cnt;
+            t1 = last;
+            while ((cnt = sock->recv(buf, sizeof(buf))) > 0) {
+                r->rx_bytes += cnt;
+                last = Kernel::get_ms_count();
+            }
+            r->rx_ms += (uint32_t)(last - t1);
+        }
+        sock->close();
+    }
+    if (r->full > 0) r->full_ms = (uint32_t)(full_sum / r->full);
+    if (r->resumed > 0) r->resumed_ms = (uint32_t)(resumed_sum / r->resumed);
+    debug("BG96McuTLSSocket: %s %d full %lu ms, %d resumed %lu ms, %d failed, %lu bytes in %lu ms\r\n", r->engine,
+          r->full, (unsigned long)r->full_ms, r->resumed, (unsigned long)r->resumed_ms, r->failed,
+          (unsigned long)r->rx_bytes, (unsigned long)r->rx_ms);
+}
+
+/**
+ * @brief compare the BG96 TLS engine (results[0]) with mbedTLS on the MCU
+ *        (results[1]): rounds connections to hostname:port with each,
+ *        timing the handshakes and, when request is not NULL (e.g. an
+ *        HTTP GET with "Connection: close"), the response download
+ * @return NSAPI_ERROR_OK, NSAPI_ERROR_NO_SOCKET if no BG96TLSSocket is free
+ */
+int BG96McuTLSSocket::benchmark(BG96Interface *iface, const char *hostname, int port, const char *ca_pem,
+                                const char *request, int rounds, BG96_TLS_ENGINE_BENCH results[2])
+{
+    if (iface == NULL || hostname == NULL || results == NULL || rounds < 1)
+        return NSAPI_ERROR_PARAMETER;
+    memset(results, 0x00, 2 * sizeof(BG96_TLS_ENGINE_BENCH));
+    results[0].engine = "bg96";
+    results[1].engine = "mcu";
+
+    BG96TLSSocket *modem = iface->getBG96TLSSocket();
+    if (modem == NULL)
+        return NSAPI_ERROR_NO_SOCKET;
+    if (ca_pem != NULL)
+        modem->set_root_ca_cert(ca_pem);
+    bench_engine(modem, hostname, port, request, rounds, &results[0]);
+    iface->discardBG96TLSSocket(modem);
+
+    BG96McuTLSSocket *mcu = new BG96McuTLSSocket(iface);
+    if (ca_pem != NULL)
+        mcu->set_root_ca_cert(ca_pem);
+    else
+        mcu->set_verify(false);                     //as the BG96 engine, seclevel 0 without a CA
+    bench_engine(mcu, hostname, port, request, rounds, &results[1]);
+    delete mcu;
+    return NSAPI_ERROR_OK;
+}
+
+#endif //MBED_CONF_BG96_LIBRARY_BG96_MCU_TLS
@@ -0,0 +1,100 @@
+/**
+ * @file BG96McuTLSSocket.h
+ * @brief TLS client running mbedTLS on the MCU over a BG96Interface TCP socket
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#ifndef __BG96MCUTLSSOCKET_H__
+#define __BG96MCUTLSSOCKET_H__
+#include "BG96.h"
+#include "nsapi_types.h"
+
+#if MBED_CONF_BG96_LIBRARY_BG96_MCU_TLS
+#include "mbedtls/ssl.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+#define BG96MCUTLS_DEFAULT_TO               3000    //ms send() and recv() wait, like BG96TLSSOCKET_DEFAULT_TO
+#define BG96MCUTLS_HANDSHAKE_TO             60000   //ms connect() waits for the handshake
+
+class BG96Interface;
+
+/** Handshake and throughput of one TLS engine, from BG96McuTLSSocket::benchmark() */
+typedef struct {
+    const char *engine;             //"bg96" or "mcu"
+    int         full;               //full handshakes
+    uint32_t    full_ms;            //mean connect() time of the full handshakes
+    int         resumed;            //abbreviated (resumed session) handshakes
+    uint32_t    resumed_ms;         //mean connect() time of the resumed handshakes
+    int         failed;             //connect() that failed
+    uint32_t    rx_bytes;           //response bytes received, all rounds
+    uint32_t    rx_ms;              //from the request to the last response byte, all rounds
+} BG96_TLS_ENGINE_BENCH;
+
+/** BG96McuTLSSocket class.
+ *  TLS client running mbedTLS on the MCU, over a TCP socket of the
+ *  BG96Interface. Unlike BG96TLSSocket it is not limited to the BG96
+ *  cipher suites, and the session of the last connection is kept so
+ *  the next connect() to the same host and port can resume it (session
+ *  ticket, or session ID) with an abbreviated handshake. It costs RAM
+ *  (mbedTLS needs about 40KB of heap during the handshake) and needs a
+ *  target with an entropy source. Use one or the other class for each
+ *  connection.
+ */
+class BG96McuTLSSocket
+{
+public:
+    BG96McuTLSSocket(BG96Interface *iface);
+    ~BG96McuTLSSocket();
+
+    void            set_timeout(int timeout)    {this->timeout = timeout;};
+    int             get_timeout()               {return this->timeout;};
+    void            set_resumption(bool enable) {this->resume = enable;};
+    nsapi_error_t   set_verify(bool enable);
+    bool            is_resumed()                {return this->resumed;};
+    nsapi_error_t   set_root_ca_cert(const char * root_ca_pem);
+    nsapi_error_t   set_client_cert_key(const char * client_cert_pem, const char * client_private_key_pem);
+    nsapi_error_t   connect(const char* hostname, int port);
+    bool            is_connected()              {return this->connected;};
+    nsapi_error_t   send(const void * data, nsapi_size_t size);
+    nsapi_error_t   recv(void * buffer, nsapi_size_t size);
+    nsapi_error_t   close();
+    void            forget_session();
+
+    static int      benchmark(BG96Interface *iface, const char *hostname, int port, const char *ca_pem,
+                              const char *request, int rounds, BG96_TLS_ENGINE_BENCH results[2]);
+
+private:
+    bool        setup();
+    static int  bio_send(void *ctx, const unsigned char *buf, size_t len);
+    static int  bio_recv(void *ctx, unsigned char *buf, size_t len);
+
+    NetworkStack *stack;
+    TCPSocket   tcp;
+    Mutex       mutex;                  //serialises the calls on this socket
+    mbedtls_entropy_context  entropy;
+    mbedtls_ctr_drbg_context drbg;
+    mbedtls_ssl_config       conf;
+    mbedtls_ssl_context      ssl;
+    mbedtls_x509_crt         cacert;
+    mbedtls_x509_crt         clientcert;
+    mbedtls_pk_context       clientkey;
+    mbedtls_ssl_session      session;   //session of the last handshake
+    bool        ready;                  //RNG seeded and ssl set up
+    bool        connected;
+    bool        resume;                 //offer the saved session on the next connect()
+    bool        resumed;                //the last handshake resumed the saved session
+    bool        has_session;
+    bool        has_ca;
+    bool        has_client;
+    bool        verify;                 //check the server certificate, connect() fails without a CA
+    char        session_host[64];       //server the saved session belongs to
+    int         session_port;
+    int         timeout;                //ms send() and recv() wait for data
+};
+
+#endif //MBED_CONF_BG96_LIBRARY_BG96_MCU_TLS
+#endif //__BG96MCUTLSSOCKET_H__
@@ -33,110 +33,236 @@
 #include "rtos.h"
 #include "Callback.h"
 
-static Thread timeout_thread;
-
-void timeout_task(void * tls_socket);
-
 BG96TLSSocket::BG96TLSSocket(BG96* bg96driver) 
 {
     bg96 = bg96driver;
-    pdp_ctx = 1;
-    sslctx_id = 0;
-    client_id = 0;
+    pdp_ctx = 0;
+    sslctx_id = bg96->allocSslContext();
+    own_ctx = sslctx_id >= 0;
+    if (!own_ctx) {
+       debug("BG96TLSSocket: no SSL context left, sharing context 0\r\n");
+        sslctx_id = 0;
+    }
+    client_id = -1;
     timeout = BG96TLSSOCKET_DEFAULT_TO;
-    timeout_ovf = false;
+    rx_head = rx_len = 0;
+    profile = BG96::getSslProfile("default");
+    has_ca = has_client = false;
+    resumed = false;
+    session_host[0] = 0x00;
+    session_port = 0;
+    reset_handshake_stats();
+}
+
+BG96TLSSocket::~BG96TLSSocket()
+{
+    close();
+    if (own_ctx)
+        bg96->releaseSslContext(sslctx_id);
+}
+
+/**
+ * @brief select the SSL context by hand in place of the one taken
+ *        from the BG96 pool
+ */
+void BG96TLSSocket::set_socket_id(int socket_id)
+{
+    mutex.lock();
+    if (own_ctx)
+        bg96->releaseSslContext(sslctx_id);
+    own_ctx = false;
+    sslctx_id = socket_id;
+    session_host[0] = 0x00;
+    mutex.unlock();
+}
+
+/**
+ * @brief UFS name of a credential of this socket's SSL context, so the
+ *        sockets do not overwrite each other's files
+ */
+void BG96TLSSocket::file_name(char *name, const char *base)
+{
+    sprintf(name, "%s%d.pem", base, sslctx_id);
 }
 
 nsapi_error_t BG96TLSSocket::set_root_ca_cert(const char* cacert)
 {
     nsapi_error_t rc = NSAPI_ERROR_DEVICE_ERROR;
-    static char ca_filename[80];
-    memset(ca_filename, 0, 80);
+    char ca_filename[32];
     if (cacert == NULL) {
        debug("BG96TLSSocket: error - invalid CA certificate.\r\n");
         return rc;
     }
 
-    if ( bg96->send_file(cacert, "cacert.pem", true) ) {
-        strcpy(ca_filename, "cacert.pem");
-    } else {
+    mutex.lock();
+    session_host[0] = 0x00;                         //new credentials, new session
+    file_name(ca_filename, "cacert");
+    if ( !bg96->send_credential(cacert, ca_filename) ) {
        debug("BG96TLSSocket: Error transferring CA certificate file to modem.\r\n");
-        rc = NSAPI_ERROR_DEVICE_ERROR;
-        return rc;
+        mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
     }
 
     if ( configure_cacert_path(ca_filename) ){
+        has_ca = true;
         rc = NSAPI_ERROR_OK;
     } else {
        debug("BG96TSLSocket: Error while configuring CA path in TLS Socket.\r\n");
         rc = NSAPI_ERROR_DEVICE_ERROR;
     }
+    mutex.unlock();
     return rc;
 }
 
 nsapi_error_t BG96TLSSocket::set_client_cert_key(const char * client_cert_pem, const char * client_private_key_pem)
 {
     nsapi_error_t rc = NSAPI_ERROR_OK;
-    if (client_cert_pem != NULL) {
-        rc = set_cert_pem(client_cert_pem);
+    char cfg[2][80];
+    char cert_filename[32], key_filename[32];
+    const char* cmds[2];
+
+    if (client_cert_pem == NULL || client_private_key_pem == NULL) {
+        if (client_cert_pem != NULL) {
+            rc = set_cert_pem(client_cert_pem);
+        }
+        if (rc == NSAPI_ERROR_OK && client_private_key_pem !=NULL) {
+            rc = set_privkey_pem(client_private_key_pem);
+        }
+        return rc;
+    }
+
+    // upload both files first, then configure both paths in a single transaction
+    mutex.lock();
+    session_host[0] = 0x00;                         //new credentials, new session
+    file_name(cert_filename, "clientcert");
+    file_name(key_filename, "privkey");
+    if ( !bg96->send_credential(client_cert_pem, cert_filename) ) {
+       debug("BG96TLSSocket: Error transferring client certificate file to modem.\r\n");
+        mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if ( !bg96->send_credential(client_private_key_pem, key_filename) ) {
+       debug("BG96TLSSocket: Error transferring private key file to modem.\r\n");
+        mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    sprintf(cfg[0], "AT+QSSLCFG=\"clientcert\",%d,\"%s\"", sslctx_id, cert_filename);
+    sprintf(cfg[1], "AT+QSSLCFG=\"clientkey\",%d,\"%s\"", sslctx_id, key_filename);
+    cmds[0] = cfg[0];
+    cmds[1] = cfg[1];
+    rc = bg96->send_batch(cmds, 2, BG96_AT_TIMEOUT);
+    if (rc == NSAPI_ERROR_OK) {
+        has_client = true;
+    } else {
+       debug("BG96TSLSocket: Error while configuring client cert and key paths in TLS Socket.\r\n");
     }
-    if (rc == NSAPI_ERROR_OK && client_private_key_pem !=NULL) {
-        rc = set_privkey_pem(client_private_key_pem);
-    } 
+    mutex.unlock();
     return rc;
 }
 
+/**
+ * @brief configure the SSL context again with the credential files set
+ *        before, after a BG96 restart cleared the AT+QSSLCFG settings
+ *        (the files stay on UFS)
+ */
+nsapi_error_t BG96TLSSocket::restore_credentials()
+{
+    nsapi_error_t rc = NSAPI_ERROR_OK;
+    char filename[32];
+
+    mutex.lock();
+    if (has_ca) {
+        file_name(filename, "cacert");
+        if (!configure_cacert_path(filename))
+            rc = NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (has_client) {
+        file_name(filename, "clientcert");
+        if (!configure_client_cert_path(filename))
+            rc = NSAPI_ERROR_DEVICE_ERROR;
+        file_name(filename, "privkey");
+        if (!configure_privkey_path(filename))
+            rc = NSAPI_ERROR_DEVICE_ERROR;
+    }
+    mutex.unlock();
+    return rc;
+}
+
+/**
+ * @brief close the socket and drop what its last user configured, before
+ *        it is handed to another one. Clearing has_ca/has_client is
+ *        enough for apply_profile() to stop using the credential files,
+ *        which stay on UFS for send_credential() to reuse; the profile,
+ *        PDP context, timeout and cached session go back to the defaults
+ */
+nsapi_error_t BG96TLSSocket::reset()
+{
+    close();
+    mutex.lock();
+    has_ca = has_client = false;
+    profile = BG96::getSslProfile("default");
+    pdp_ctx = 0;
+    timeout = BG96TLSSOCKET_DEFAULT_TO;
+    session_host[0] = 0x00;
+    session_port = 0;
+    mutex.unlock();
+    return NSAPI_ERROR_OK;
+}
+
 nsapi_error_t BG96TLSSocket::set_cert_pem(const char * client_cert_pem)
 {
     nsapi_error_t rc = NSAPI_ERROR_DEVICE_ERROR;
-    static char cert_pem_filename[80];
-    memset(cert_pem_filename, 0, 80);
+    char cert_pem_filename[32];
     if (client_cert_pem == NULL) {
        debug("BG96TLSSocket: error - invalid client certificate.\r\n");
         return rc;
     }
 
-    if ( bg96->send_file(client_cert_pem, "clientcert.pem", true) ) {
-        strcpy(cert_pem_filename, "clientcert.pem");
-    } else {
+    mutex.lock();
+    session_host[0] = 0x00;                         //new credentials, new session
+    file_name(cert_pem_filename, "clientcert");
+    if ( !bg96->send_credential(client_cert_pem, cert_pem_filename) ) {
        debug("BG96TLSSocket: Error transferring client certificate file to modem.\r\n");
-        rc = NSAPI_ERROR_DEVICE_ERROR;
-        return rc;
+        mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
     }
 
     if ( configure_client_cert_path(cert_pem_filename) ){
+        has_client = true;
         rc = NSAPI_ERROR_OK;
     } else {
        debug("BG96TSLSocket: Error while configuring client cert path in TLS Socket.\r\n");
         rc = NSAPI_ERROR_DEVICE_ERROR;
     }
+    mutex.unlock();
     return rc;
 }
 
 nsapi_error_t BG96TLSSocket::set_privkey_pem(const char * client_private_key_pem)
 {
     nsapi_error_t rc = NSAPI_ERROR_DEVICE_ERROR;
-    static char privkey_pem_filename[80];
-    memset(privkey_pem_filename, 0, 80);
+    char privkey_pem_filename[32];
     if (client_private_key_pem == NULL) {
        debug("BG96TLSSocket: error - invalid client key.\r\n");
         return rc;
     }
 
-    if ( bg96->send_file(client_private_key_pem, "privkey.pem", true) ) {
-        strcpy(privkey_pem_filename, "privkey.pem");
-    } else {
+    mutex.lock();
+    session_host[0] = 0x00;                         //new credentials, new session
+    file_name(privkey_pem_filename, "privkey");
+    if ( !bg96->send_credential(client_private_key_pem, privkey_pem_filename) ) {
        debug("BG96TLSSocket: Error transferring private key file to modem.\r\n");
-        rc = NSAPI_ERROR_DEVICE_ERROR;
-        return rc;
+        mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
     }
 
-    if ( configure_client_cert_path(privkey_pem_filename) ){
+    if ( configure_privkey_path(privkey_pem_filename) ){
         rc = NSAPI_ERROR_OK;
     } else {
        debug("BG96TSLSocket: Error while configuring private key path in TLS Socket.\r\n");
         rc = NSAPI_ERROR_DEVICE_ERROR;
     }
+    mutex.unlock();
     return rc;
 }
 
@@ -173,6 +299,151 @@ int BG96TLSSocket::configure_privkey_path(const char* path)
     return rc;
 }
 
+/**
+ * @brief select the SSL profile connect() applies to this socket's SSL
+ *        context, NULL to keep the context as configured by hand
+ */
+nsapi_error_t BG96TLSSocket::set_profile(const BG96_SSL_PROFILE *profile)
+{
+    mutex.lock();
+    if (this->profile != profile)
+        session_host[0] = 0x00;
+    this->profile = profile;
+    mutex.unlock();
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t BG96TLSSocket::set_profile(const char *name)
+{
+    const BG96_SSL_PROFILE *p = BG96::getSslProfile(name);
+    if (p == NULL) {
+       debug("BG96TLSSocket: no SSL profile %s\r\n", name? name : "");
+        return NSAPI_ERROR_PARAMETER;
+    }
+    return set_profile(p);
+}
+
+/**
+ * @brief apply the profile to the SSL context. A profile without a
+ *        security level gets 2 with a client certificate, 1 with only
+ *        a CA certificate, 0 otherwise. The BG96 is only sent the
+ *        settings when the context does not already have them.
+ */
+nsapi_error_t BG96TLSSocket::apply_profile()
+{
+    nsapi_error_t rc = NSAPI_ERROR_OK;
+    int seclevel;
+
+    mutex.lock();
+    if (profile != NULL) {
+        seclevel = profile->seclevel;
+        if (seclevel < 0)
+            seclevel = has_client? 2 : has_ca? 1 : 0;
+        rc = bg96->configure_ssl_profile(sslctx_id, profile, seclevel);
+    }
+    mutex.unlock();
+    return rc;
+}
+
+int BG96TLSSocket::configure_sslversion(int version)
+{
+    return bg96->configure_ssl_option("sslversion", sslctx_id, version);
+}
+
+int BG96TLSSocket::configure_ciphersuite(const char *suite)
+{
+    return bg96->configure_ciphersuite(sslctx_id, suite);
+}
+
+int BG96TLSSocket::configure_seclevel(int seclevel)
+{
+    return bg96->configure_ssl_option("seclevel", sslctx_id, seclevel);
+}
+
+int BG96TLSSocket::configure_ignorelocaltime(bool ignorelocaltime)
+{
+    return bg96->configure_ssl_option("ignorelocaltime", sslctx_id, ignorelocaltime? 1 : 0);
+}
+
+int BG96TLSSocket::configure_negotiatetime(int negotiatetime)
+{
+    return bg96->configure_ssl_option("negotiatetime", sslctx_id, negotiatetime);
+}
+
+/**
+ * @brief time connect() to hostname:port with each profile, rounds times
+ *        per profile, closing the connection after each handshake. The
+ *        socket's own profile is restored afterwards.
+ * @return number of successful handshakes, NSAPI_ERROR_PARAMETER on bad
+ *         arguments
+ */
+int BG96TLSSocket::benchmark_handshake(const char *hostname, int port, const BG96_SSL_PROFILE **profiles,
+                                       int count, int rounds, BG96_TLS_BENCH *results)
+{
+    const BG96_SSL_PROFILE *saved = profile;
+    int total = 0;
+
+    if (hostname == NULL || profiles == NULL || results == NULL || count < 1 || rounds < 1)
+        return NSAPI_ERROR_PARAMETER;
+    for (int i = 0; i < count; i++) {
+        BG96_TLS_BENCH *r = &results[i];
+        uint64_t sum = 0;
+        memset(r, 0x00, sizeof(*r));
+        r->name = profiles[i]? profiles[i]->name : "none";
+        set_profile(profiles[i]);
+        if (apply_profile() != NSAPI_ERROR_OK) {
+            r->failed = rounds;
+            continue;
+        }
+        for (int n = 0; n < rounds; n++) {
+            uint64_t t0 = Kernel::get_ms_count();
+            if (connect(hostname, port) != NSAPI_ERROR_OK) {
+                r->failed++;
+                continue;
+            }
+            uint32_t ms = (uint32_t)(Kernel::get_ms_count() - t0);
+            close();
+            if (r->ok == 0 || ms < r->min_ms) r->min_ms = ms;
+            if (ms > r->max_ms) r->max_ms = ms;
+            sum += ms;
+            r->ok++;
+        }
+        if (r->ok > 0)
+            r->avg_ms = (uint32_t)(sum / r->ok);
+        total += r->ok;
+       debug("BG96TLSSocket: %s %d ok %d failed, %lu/%lu/%lu ms min/avg/max\r\n", r->name, r->ok, r->failed,
+              (unsigned long)r->min_ms, (unsigned long)r->avg_ms, (unsigned long)r->max_ms);
+    }
+    set_profile(saved);
+    return total;
+}
+
+void BG96TLSSocket::get_handshake_stats(BG96_TLS_HANDSHAKE_STATS &stats)
+{
+    mutex.lock();
+    stats.full = hs_full;
+    stats.full_ms = hs_full? (uint32_t)(hs_full_ms / hs_full) : 0;
+    stats.resumed = hs_resumed;
+    stats.resumed_ms = hs_resumed? (uint32_t)(hs_resumed_ms / hs_resumed) : 0;
+    stats.failed = hs_failed;
+    mutex.unlock();
+}
+
+void BG96TLSSocket::reset_handshake_stats()
+{
+    mutex.lock();
+    hs_full = hs_resumed = hs_failed = 0;
+    hs_full_ms = hs_resumed_ms = 0;
+    mutex.unlock();
+}
+
+/**
+ * @brief open the TLS connection. When the BG96 caches sessions and the
+ *        last connection of this socket went to the same server with the
+ *        same profile and credentials, the BG96 offers that session and
+ *        the handshake is counted as resumed. The BG96 does not report
+ *        whether the server accepted it, compare the mean times.
+ */
 nsapi_error_t BG96TLSSocket::connect(const char* hostname, int port)
 {
     int rc = NSAPI_ERROR_OK;
@@ -181,61 +452,266 @@ nsapi_error_t BG96TLSSocket::connect(const char* hostname, int port)
     //     return NSAPI_ERROR_DEVICE_ERROR;
     // }
     // wait(4);
+    if (!bg96->isContextActive(pdp_ctx) && bg96->connect(pdp_ctx) != NSAPI_ERROR_OK) {
+       debug("BG96TLSSocket: PDP context %d could not be activated\r\n", pdp_ctx);
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    mutex.lock();
+    if (client_id >= 0) {
+        mutex.unlock();
+        return NSAPI_ERROR_IS_CONNECTED;
+    }
+    rx_head = rx_len = 0;
+    if (apply_profile() != NSAPI_ERROR_OK) {
+       debug("BG96TLSSocket: Error %d applying SSL profile\r\n", bg96->getLastError(BG96_OP_SSL));
+        mutex.unlock();
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    client_id = bg96->allocSocket();
+    if (client_id < 0) {
+       debug("BG96TLSSocket: no client ID left\r\n");
+        mutex.unlock();
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    resumed = profile != NULL && profile->session_cache && bg96->sslSessionCache() > 0 &&
+              session_port == port && strcmp(session_host, hostname) == 0;
+    uint64_t t0 = Kernel::get_ms_count();
     if (bg96->sslopen(hostname, port, pdp_ctx, client_id, sslctx_id)) {
+        uint64_t ms = Kernel::get_ms_count() - t0;
+        if (resumed) {
+            hs_resumed++;
+            hs_resumed_ms += ms;
+        } else {
+            hs_full++;
+            hs_full_ms += ms;
+        }
+        strncpy(session_host, hostname, sizeof(session_host) - 1);
+        session_host[sizeof(session_host) - 1] = 0x00;
+        session_port = port;
         rc = NSAPI_ERROR_OK;
        debug("\r\n\r\n\r\nBG96TLSSocket: Successfully opened TLS connection to %s\r\n", hostname);
     } else {
-        char errstring[80];
-        bg96->getError(errstring);
-       debug("BG96TLSSocket %s opening TLS Socket\r\n", errstring);
+       debug("BG96TLSSocket: Error %d opening TLS Socket\r\n", bg96->getLastError(BG96_OP_SSL));
+        bg96->sslclose(client_id);
+        bg96->releaseSocket(client_id);
+        client_id = -1;
+        hs_failed++;
+        resumed = false;
+        session_host[0] = 0x00;
         rc = NSAPI_ERROR_DEVICE_ERROR;
     }
+    mutex.unlock();
     return rc;
 }
 
 bool BG96TLSSocket::is_connected()
 {
-    return bg96->ssl_client_status(client_id);
+    mutex.lock();
+    bool connected = client_id >= 0 && bg96->ssl_client_status(client_id);
+    mutex.unlock();
+    return connected;
 }
 
+/**
+ * @brief send data in BG96_SSL_SEND_MAX chunks, each sent as soon as the
+ *        previous one is acknowledged with SEND OK. While the BG96 send
+ *        buffer is full (SEND FAIL) the chunk is retried with a growing
+ *        delay, up to the socket timeout.
+ * @return bytes sent, less than size if the timeout expired or an error
+ *         occurred after some progress; NSAPI_ERROR_WOULD_BLOCK if the
+ *         BG96 buffer stayed full, NSAPI_ERROR_DEVICE_ERROR on error
+ */
 nsapi_error_t BG96TLSSocket::send(const void * data, nsapi_size_t size)
 {
-    int rc = -1;
-    rc = bg96->sslsend(client_id, data, size, this->timeout);
-    if ( rc > 0 ) {
-        return rc;
-    } else {
-        return NSAPI_ERROR_TIMEOUT; // Not necessary the issue, but no way to find out.
-    };
+    uint64_t deadline = Kernel::get_ms_count() + this->timeout;
+    const uint8_t *p = (const uint8_t *)data;
+    nsapi_size_t sent = 0;
+    int backoff = BG96TLSSOCKET_SEND_BACKOFF;
+    int rc = 0;
+
+    mutex.lock();
+    if (client_id < 0) {
+        mutex.unlock();
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    while (sent < size) {
+        nsapi_size_t chunk = size - sent;
+        if (chunk > BG96_SSL_SEND_MAX)
+            chunk = BG96_SSL_SEND_MAX;
+        rc = bg96->sslsend(client_id, p + sent, chunk, this->timeout);
+        if (rc > 0) {
+            sent += rc;
+            backoff = BG96TLSSOCKET_SEND_BACKOFF;
+            continue;
+        }
+        if (rc < 0 || Kernel::get_ms_count() + backoff > deadline)
+            break;
+        wait_ms(backoff);                           //the BG96 send buffer is full
+        if (backoff < 1000)
+            backoff *= 2;
+    }
+    mutex.unlock();
+    if (sent > 0) return sent;
+    return (rc == 0)? NSAPI_ERROR_WOULD_BLOCK : NSAPI_ERROR_DEVICE_ERROR;
 }
 
-nsapi_error_t BG96TLSSocket::recv(void * buffer, nsapi_size_t size)
+/**
+ * @brief read what the BG96 holds into the receive buffer, with one
+ *        maximum size AT+QSSLRECV, waiting until the deadline for the
+ *        BG96 to signal data. The mutex must be held.
+ * @return bytes added, 0 if the server closed the connection,
+ *         NSAPI_ERROR_TIMEOUT if nothing arrived in time
+ */
+nsapi_error_t BG96TLSSocket::fill(uint64_t deadline)
 {
-    int cnt = -1;
-    timeout_thread.start(callback(timeout_task, this));
-    while (!this->timeout_ovf && cnt < 0) {
-        cnt = bg96->sslrecv(this->client_id, buffer, size);
+    int cnt = 0;
+    int rx;
+
+    if (rx_head > 0) {
+        memmove(rx_buf, rx_buf + rx_head, rx_len);
+        rx_head = 0;
+    }
+    if (rx_len == sizeof(rx_buf))
+        return NSAPI_ERROR_NO_MEMORY;
+    while ((rx = bg96->sslWaitRx(client_id, deadline)) > 0) {
+        cnt = bg96->sslrecv(client_id, rx_buf + rx_len, sizeof(rx_buf) - rx_len);
+        if (cnt != 0 || Kernel::get_ms_count() >= deadline)
+            break;
     }
-    timeout_thread.terminate();
-    if (cnt == -1 && this->timeout_ovf) return NSAPI_ERROR_TIMEOUT;
-    return cnt;
+    if (cnt > 0) {
+        rx_len += cnt;
+        return cnt;
+    }
+    if (cnt < 0) return cnt;
+    if (rx < 0) return 0;
+    return NSAPI_ERROR_TIMEOUT;
 }
 
-void timeout_task(void * arg)
+/**
+ * @brief receive data, from the receive buffer first. When it is empty,
+ *        wait up to the socket timeout for the BG96 to signal data; a
+ *        request at least as large as the buffer is read straight into
+ *        the caller's buffer.
+ * @return bytes received, 0 if the server closed the connection,
+ *         NSAPI_ERROR_TIMEOUT if nothing arrived in time
+ */
+nsapi_error_t BG96TLSSocket::recv(void * buffer, nsapi_size_t size)
 {
-    BG96TLSSocket* tls_socket = (BG96TLSSocket *)arg;
-    tls_socket->set_timeout_ovf(false);
-    while(!tls_socket->get_timeout_ovf()) {
-        Thread::wait(tls_socket->get_timeout());
-        tls_socket->set_timeout_ovf(true);
+    uint64_t deadline = Kernel::get_ms_count() + this->timeout;
+    nsapi_error_t rc;
+
+    mutex.lock();
+    if (rx_len == 0 && client_id < 0) {
+        mutex.unlock();
+        return NSAPI_ERROR_NO_CONNECTION;
     }
+    if (rx_len == 0 && size >= sizeof(rx_buf)) {
+        int cnt = 0;
+        int rx;
+        while ((rx = bg96->sslWaitRx(client_id, deadline)) > 0) {
+            cnt = bg96->sslrecv(client_id, buffer, sizeof(rx_buf));
+            if (cnt != 0 || Kernel::get_ms_count() >= deadline)
+                break;
+        }
+        mutex.unlock();
+        if (cnt != 0) return cnt;
+        return (rx < 0)? 0 : NSAPI_ERROR_TIMEOUT;
+    }
+    if (rx_len == 0 && (rc = fill(deadline)) <= 0) {
+        mutex.unlock();
+        return rc;
+    }
+    if (size > rx_len)
+        size = rx_len;
+    memcpy(buffer, rx_buf + rx_head, size);
+    rx_head += size;
+    rx_len -= size;
+    mutex.unlock();
+    return size;
 }
 
-nsapi_error_t   BG96TLSSocket::close()
+/**
+ * @brief copy the next bytes without removing them, waiting like recv()
+ *        when nothing is buffered
+ * @return bytes copied, 0 if the server closed the connection,
+ *         NSAPI_ERROR_TIMEOUT if nothing arrived in time
+ */
+nsapi_error_t BG96TLSSocket::peek(void * buffer, nsapi_size_t size)
 {
-    return bg96->sslclose(this->client_id);
-}
+    nsapi_error_t rc;
 
+    mutex.lock();
+    if (rx_len == 0 && client_id < 0) {
+        mutex.unlock();
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    if (rx_len == 0 && (rc = fill(Kernel::get_ms_count() + this->timeout)) <= 0) {
+        mutex.unlock();
+        return rc;
+    }
+    if (size > rx_len)
+        size = rx_len;
+    memcpy(buffer, rx_buf + rx_head, size);
+    mutex.unlock();
+    return size;
+}
 
+/**
+ * @brief receive one line, up to and including '\n'. The line is 0
+ *        terminated, a line longer than size-1 is returned in parts.
+ *        More data is read from the BG96 until the line is complete
+ *        or the socket timeout expires.
+ * @return length of the line, 0 if the server closed the connection
+ *         before any byte, NSAPI_ERROR_TIMEOUT if no complete line
+ *         arrived in time (the partial line stays buffered)
+ */
+nsapi_error_t BG96TLSSocket::readline(char * buffer, nsapi_size_t size)
+{
+    uint64_t deadline = Kernel::get_ms_count() + this->timeout;
+    nsapi_size_t n = 0;
+    nsapi_error_t rc = 0;
+    uint8_t *eol = NULL;
 
+    if (size < 2) return NSAPI_ERROR_PARAMETER;
+    mutex.lock();
+    while (true) {
+        eol = (uint8_t*)memchr(rx_buf + rx_head, '\n', rx_len);
+        if (eol != NULL || rx_len >= size - 1 || rx_len == sizeof(rx_buf))
+            break;
+        if (client_id < 0)                          //closed, only the buffered bytes are left
+            break;
+        if ((rc = fill(deadline)) <= 0)
+            break;
+    }
+    if (eol != NULL)
+        n = eol - (rx_buf + rx_head) + 1;
+    else if (rc >= 0)
+        n = rx_len;                                 //full buffer, or the last bytes before the close
+    if (n > size - 1)
+        n = size - 1;
+    if (n == 0) {
+        mutex.unlock();
+        return (client_id < 0)? NSAPI_ERROR_NO_CONNECTION : rc;
+    }
+    memcpy(buffer, rx_buf + rx_head, n);
+    buffer[n] = 0x00;
+    rx_head += n;
+    rx_len -= n;
+    mutex.unlock();
+    return n;
+}
 
+nsapi_error_t   BG96TLSSocket::close()
+{
+    mutex.lock();
+    if (client_id < 0) {
+        mutex.unlock();
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    bool done = bg96->sslclose(this->client_id);
+    bg96->releaseSocket(client_id);
+    client_id = -1;
+    rx_head = rx_len = 0;
+    mutex.unlock();
+    return done? NSAPI_ERROR_OK : NSAPI_ERROR_DEVICE_ERROR;
+}
@@ -39,23 +39,71 @@
 #define BG96TLSSOCKET_SSLVERSION_TLS1_2     3
 #define BG96TLSSOCKET_SSLVERSION_ALL        4       //THIS IS THE DEFAULT
 #define BG96TLSSOCKET_DEFAULT_TO            3000    //3 seconds
+#define BG96TLSSOCKET_SEND_BACKOFF          50      //first wait in ms when the BG96 send buffer is full, doubled up to 1s
+#define BG96TLSSOCKET_RXBUF_SIZE            BG96::BG96_BUFF_SIZE    //receive buffer, one maximum size AT+QSSLRECV
 
+/** Handshake times of one SSL profile, from benchmark_handshake() */
+typedef struct {
+    const char *name;               //profile name
+    int         ok;                 //handshakes that succeeded
+    int         failed;             //handshakes that failed
+    uint32_t    min_ms;             //fastest successful connect()
+    uint32_t    max_ms;             //slowest successful connect()
+    uint32_t    avg_ms;             //mean of the successful connect()
+} BG96_TLS_BENCH;
+
+/** Handshake counts and mean connect() times of a BG96TLSSocket */
+typedef struct {
+    int         full;               //full handshakes
+    uint32_t    full_ms;            //mean time of the full handshakes
+    int         resumed;            //handshakes offering the cached session of the same server
+    uint32_t    resumed_ms;         //mean time of the resumed handshakes
+    int         failed;             //handshakes that failed
+} BG96_TLS_HANDSHAKE_STATS;
+
+/** BG96TLSSocket class.
+ *  TLS client running on the BG96. Each instance has its own SSL context,
+ *  taken when it is created, and its own client ID (0-11), taken by
+ *  connect() and given back by close(). Calls on an instance are
+ *  serialised, different instances can be used from different threads.
+ */
 class BG96TLSSocket 
 {
 public:
     BG96TLSSocket(BG96 * bg96driver);
-    ~BG96TLSSocket() {};
+    ~BG96TLSSocket();
 
     void            set_timeout(int timeout)    {this->timeout = timeout;};
     int             get_timeout()               {return this->timeout;};
-    bool            get_timeout_ovf()           {return this->timeout_ovf;};
-    void            set_timeout_ovf(bool ovf)   {this->timeout_ovf = ovf;};
-    void            set_socket_id(int socket_id){this->sslctx_id = socket_id;};
+    void            set_socket_id(int socket_id);
+    int             get_sslctx_id()             {return this->sslctx_id;};
+    int             get_client_id()             {return this->client_id;};
+    void            set_pdp_context(int pdp_id) {this->pdp_ctx = pdp_id;};
+    int             get_pdp_context()           {return this->pdp_ctx;};
+    nsapi_error_t   set_profile(const BG96_SSL_PROFILE *profile);
+    nsapi_error_t   set_profile(const char *name);
+    const BG96_SSL_PROFILE *get_profile()       {return this->profile;};
+    nsapi_error_t   apply_profile();
+    int             configure_sslversion(int version);
+    int             configure_ciphersuite(const char *suite);
+    int             configure_seclevel(int seclevel);
+    int             configure_ignorelocaltime(bool ignorelocaltime);
+    int             configure_negotiatetime(int negotiatetime);
+    int             benchmark_handshake(const char *hostname, int port, const BG96_SSL_PROFILE **profiles,
+                                        int count, int rounds, BG96_TLS_BENCH *results);
     nsapi_error_t   recv(void * buffer, nsapi_size_t size);
+    nsapi_error_t   peek(void * buffer, nsapi_size_t size);
+    nsapi_error_t   readline(char * buffer, nsapi_size_t size);
+    nsapi_size_t    available()                 {return this->rx_len;};
     nsapi_error_t   send(const void * data, nsapi_size_t size);
     nsapi_error_t   set_root_ca_cert(const char * root_ca_pem);
     nsapi_error_t   set_client_cert_key(const char * client_cert_pem, const char * client_private_key_pem);
+    nsapi_error_t   restore_credentials();
+    nsapi_error_t   reset();
     nsapi_error_t   connect(const char* hostname, int port);
+    bool            is_resumed()                {return this->resumed;};
+    void            get_handshake_stats(BG96_TLS_HANDSHAKE_STATS &stats);
+    void            reset_handshake_stats();
     bool            is_connected();
     nsapi_error_t   close();
 
@@ -65,19 +113,28 @@ private:
     int     configure_cacert_path(const char* path);
     int     configure_client_cert_path(const char* path);
     int     configure_privkey_path(const char* path);
-    int     configure_sslversion(int version);
-//    nsapi_error_t configure_ciphersuite(BG96TLSSocket_cipher_suite_t suite);
-    int     configure_seclevel(int seclevel);
-    int     configure_ignorelocaltime(bool ignorelocaltime);
-    int     configure_negotiatetime(int negotiatetime);
+    void    file_name(char *name, const char *base);
+    nsapi_error_t fill(uint64_t deadline);
 
 
     BG96*   bg96;
+    Mutex   mutex;                  //serialises the calls on this socket
+    bool    own_ctx;                //true if sslctx_id was taken from the BG96 pool
     int     sslctx_id;
-    int     client_id;
-    int     pdp_ctx;
-    int     timeout;
-    bool    timeout_ovf;
+    int     client_id;              //-1 while not connected
+    int     pdp_ctx;                //0 for the default context
+    const BG96_SSL_PROFILE *profile;    //applied by connect(), NULL to keep the context as configured
+    bool    has_ca;                 //a CA certificate is configured
+    bool    has_client;             //a client certificate is configured
+    bool    resumed;                //the last connect() offered the cached session
+    char    session_host[64];       //server of the session the BG96 caches, empty if none
+    int     session_port;
+    int     hs_full, hs_resumed, hs_failed;
+    uint64_t hs_full_ms, hs_resumed_ms;     //summed handshake times
+    int     timeout;                //ms recv() and send() wait for the BG96
+    uint8_t rx_buf[BG96TLSSOCKET_RXBUF_SIZE];
+    nsapi_size_t rx_head;           //first byte not yet returned
+    nsapi_size_t rx_len;            //bytes in rx_buf from rx_head
 };
 
 #endif //__BG96TLSSOCKET_H__
\ No newline at end of file